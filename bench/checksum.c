@@ -0,0 +1,104 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "checksum.h"
+
+#define ROUNDS 2000000
+
+static const int sizes[] = { 64, 576, 1428, 4096 };
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* nanoseconds per call, each sum feeding the next so none is skipped. */
+static double time_partial(const unsigned char *buf, int size)
+{
+    volatile uint32_t sink;
+    uint32_t sum = 0;
+    double start;
+    int i;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++)
+        sum = checksum_partial(buf, size, sum & 1);
+    sink = sum;
+    (void)sink;
+
+    return (now() - start) / ROUNDS * 1e9;
+}
+
+static double time_copy(unsigned char *dst, const unsigned char *buf, int size)
+{
+    volatile uint32_t sink;
+    uint32_t sum = 0;
+    double start;
+    int i;
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++)
+        sum = checksum_copy(dst, buf, size, sum & 1);
+    sink = sum;
+    (void)sink;
+
+    return (now() - start) / ROUNDS * 1e9;
+}
+
+int main(void)
+{
+    static unsigned char buf[4096] __attribute__((aligned(64)));
+    static unsigned char dst[4096] __attribute__((aligned(64)));
+    const char *name;
+    unsigned int n;
+    int i;
+
+    for (i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = rand();
+
+    printf("%-8s %6s %12s %12s\n", "variant", "bytes", "partial ns", "copy ns");
+
+    for (n = 0; (name = checksum_variant(n)); n++) {
+        if (select_checksum(n) < 0)
+            continue;
+
+        for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+            printf("%-8s %6d %12.1f %12.1f\n", name, sizes[i],
+                   time_partial(buf, sizes[i]), time_copy(dst, buf, sizes[i]));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "echo-skt.h"
+#include "options.h"
+#include "peer.h"
+#include "session.h"
+
+#define LOOKUPS 4000000
+
+/* link addresses of the clients, and the tunnel addresses they route. */
+#define LINK_NET 0x0a000000
+#define TUNNEL_NET 0xac100000
+
+struct options opts;
+
+static const unsigned int counts[] = { 1000, 10000, 100000 };
+
+/* lookups run by a thread. */
+struct lookups
+{
+    pthread_t thread;
+    struct sessions *sessions;
+    const uint32_t *order;
+    unsigned int count;
+    unsigned int first;
+    int route;
+    double ns;
+    int failed;
+};
+
+/* cpu time of the calling thread, which threads sharing a cpu do not
+ * inflate, while waiting for cache lines other cpus took still counts.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* resident memory in KiB. */
+static long resident(void)
+{
+    long size, pages = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+            pages = 0;
+        fclose(f);
+    }
+
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* find sessions in a random order, by link address and id as packets
+ * received are, or by tunnel address as frames read are.
+ */
+static void *run_lookups(void *arg)
+{
+    struct lookups *lookups = arg;
+    struct iphdr iph;
+    unsigned int i, n;
+    double start;
+
+    memset(&iph, 0, sizeof(iph));
+    iph.version = 4;
+
+    start = now();
+    for (i = 0; i < LOOKUPS; i++) {
+        n = lookups->order[(lookups->first + i) % lookups->count];
+
+        if (lookups->route) {
+            iph.daddr = htonl(TUNNEL_NET + n);
+            if (!route_session(lookups->sessions, (const uint8_t *)&iph, sizeof(iph)))
+                lookups->failed = 1;
+        } else if (!find_session(lookups->sessions, htonl(LINK_NET + n), htons(n))) {
+            lookups->failed = 1;
+        }
+    }
+    lookups->ns = (now() - start) / LOOKUPS * 1e9;
+
+    return NULL;
+}
+
+/* the mean time of a lookup, each thread starting in another place. */
+static double time_lookups(struct sessions *sessions, const uint32_t *order,
+                           unsigned int count, unsigned int nthreads, int route)
+{
+    struct lookups lookups[nthreads];
+    double ns = 0;
+    unsigned int i;
+
+    for (i = 0; i < nthreads; i++) {
+        lookups[i].sessions = sessions;
+        lookups[i].order = order;
+        lookups[i].count = count;
+        lookups[i].first = i * (count / nthreads);
+        lookups[i].route = route;
+        lookups[i].failed = 0;
+
+        if (pthread_create(&lookups[i].thread, NULL, run_lookups, &lookups[i]) != 0)
+            return -1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(lookups[i].thread, NULL);
+        if (lookups[i].failed)
+            return -1;
+        ns += lookups[i].ns / nthreads;
+    }
+
+    return ns;
+}
+
+/* open count sessions as clients connecting would, then time finding them
+ * from one thread and from several.
+ */
+static int measure(unsigned int count, unsigned int nthreads)
+{
+    struct peer_hot hot;
+    struct peer host;
+    struct sessions *sessions;
+    struct peer *peer;
+    uint32_t *order, n;
+    unsigned int i, j;
+    long before, used;
+    double ns[4];
+
+    memset(&host, 0, sizeof(host));
+    memset(&hot, 0, sizeof(hot));
+    host.hot = &hot;
+
+    if (!(order = malloc(count * sizeof(*order))))
+        return -1;
+
+    for (i = 0; i < count; i++)
+        order[i] = i;
+
+    before = resident();
+
+    if (!(sessions = open_sessions(&host, count)))
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (!(peer = add_session(sessions, htonl(LINK_NET + i), htons(i))))
+            return -1;
+        reset_downstream(&peer->hot->downstream, 0, 1);
+        address_session(sessions, peer, htonl(TUNNEL_NET + i));
+    }
+
+    used = resident() - before;
+
+    for (i = count - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        n = order[i];
+        order[i] = order[j];
+        order[j] = n;
+    }
+
+    ns[0] = time_lookups(sessions, order, count, 1, 0);
+    ns[1] = time_lookups(sessions, order, count, 1, 1);
+    ns[2] = time_lookups(sessions, order, count, nthreads, 0);
+    ns[3] = time_lookups(sessions, order, count, nthreads, 1);
+
+    for (i = 0; i < 4; i++) {
+        if (ns[i] < 0)
+            return -1;
+    }
+
+    printf("%8u %10ld KiB %10ld B %8.1f ns %8.1f ns %8.1f ns %8.1f ns\n",
+           count, used, used * 1024 / count, ns[0], ns[1], ns[2], ns[3]);
+    fflush(stdout);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+    int status;
+    pid_t pid;
+
+    /* as many threads as there are cpus, or as given. */
+    if (argc > 1)
+        nthreads = atol(argv[1]);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    opts.mtu = 1500 - sizeof(struct echo_buf);
+    opts.payload = opts.mtu;
+    opts.window = ICMPTUNNEL_WINDOW;
+
+    printf("%8s %14s %12s %11s %11s   with %ld threads:\n", "sessions", "rss",
+           "per session", "find", "route", nthreads);
+    printf("%61s %11s\n", "find", "route");
+    fflush(stdout);
+
+    /* each count in a process of its own, so none starts with the memory
+     * of another.
+     */
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+
+        if (pid == 0)
+            _exit(measure(counts[i], nthreads) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "unable to measure %u sessions.\n", counts[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -11,18 +11,36 @@ pub fn build(b: *std.Build) void {
         .optimize = optimize,
     });
     exe.addCSourceFiles(&.{
+        "src/bundle.c",
         "src/checksum.c",
         "src/client.c",
         "src/client-handlers.c",
+        "src/control.c",
         "src/daemon.c",
+        "src/downstream.c",
         "src/echo-skt.c",
         "src/forwarder.c",
+        "src/forwarder-uring.c",
+        "src/fragment.c",
+        "src/gso.c",
+        "src/histogram.c",
         "src/icmptunnel.c",
+        "src/latency.c",
+        "src/peer.c",
+        "src/pktbuf.c",
+        "src/pmtu.c",
         "src/privs.c",
+        "src/profile.c",
         "src/resolve.c",
+        "src/route.c",
         "src/server.c",
         "src/server-handlers.c",
+        "src/session.c",
+        "src/stats.c",
+        "src/timer.c",
         "src/tun-device.c",
+        "src/window.c",
+        "src/worker.c",
     }, &.{
         "-std=c99",
         "-pedantic",
@@ -35,6 +53,7 @@ pub fn build(b: *std.Build) void {
 
     exe.addIncludePath(.{ .path = "src" });
     exe.linkLibC();
+    exe.linkSystemLibrary("pthread");
     b.installArtifact(exe);
 
     const run_cmd = b.addRunArtifact(exe);
@@ -46,4 +65,102 @@ pub fn build(b: *std.Build) void {
 
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
+
+    const checksum_test = b.addExecutable(.{
+        .name = "checksum-test",
+        .target = target,
+        .optimize = optimize,
+    });
+    checksum_test.addCSourceFiles(&.{
+        "test/checksum.c",
+        "src/checksum.c",
+    }, &.{
+        "-std=c99",
+        "-pedantic",
+        "-Wall",
+        "-Wextra",
+    });
+    checksum_test.addIncludePath(.{ .path = "src" });
+    checksum_test.linkLibC();
+
+    const test_cmd = b.addRunArtifact(checksum_test);
+
+    const histogram_test = b.addExecutable(.{
+        .name = "histogram-test",
+        .target = target,
+        .optimize = optimize,
+    });
+    histogram_test.addCSourceFiles(&.{
+        "test/histogram.c",
+        "src/histogram.c",
+    }, &.{
+        "-std=c99",
+        "-pedantic",
+        "-Wall",
+        "-Wextra",
+    });
+    histogram_test.addIncludePath(.{ .path = "src" });
+    histogram_test.linkLibC();
+
+    const histogram_cmd = b.addRunArtifact(histogram_test);
+
+    const test_step = b.step("test", "Check checksums and histograms against references");
+    test_step.dependOn(&test_cmd.step);
+    test_step.dependOn(&histogram_cmd.step);
+
+    const checksum_bench = b.addExecutable(.{
+        .name = "checksum-bench",
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    checksum_bench.addCSourceFiles(&.{
+        "bench/checksum.c",
+        "src/checksum.c",
+    }, &.{
+        "-std=c99",
+        "-pedantic",
+        "-Wall",
+        "-Wextra",
+    });
+    checksum_bench.addIncludePath(.{ .path = "src" });
+    checksum_bench.linkLibC();
+
+    const bench_cmd = b.addRunArtifact(checksum_bench);
+
+    const sessions_bench = b.addExecutable(.{
+        .name = "sessions-bench",
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    sessions_bench.addCSourceFiles(&.{
+        "bench/sessions.c",
+        "src/checksum.c",
+        "src/downstream.c",
+        "src/echo-skt.c",
+        "src/fragment.c",
+        "src/gso.c",
+        "src/peer.c",
+        "src/pktbuf.c",
+        "src/pmtu.c",
+        "src/route.c",
+        "src/session.c",
+        "src/timer.c",
+        "src/tun-device.c",
+        "src/window.c",
+    }, &.{
+        "-std=c99",
+        "-pedantic",
+        "-Wall",
+        "-Wextra",
+        "-Wno-int-conversion",
+    });
+    sessions_bench.addIncludePath(.{ .path = "src" });
+    sessions_bench.linkLibC();
+    sessions_bench.linkSystemLibrary("pthread");
+
+    const sessions_cmd = b.addRunArtifact(sessions_bench);
+
+    const bench_step = b.step("bench", "Time checksums, and the memory and lookups of sessions");
+    bench_step.dependOn(&bench_cmd.step);
+    bench_step.dependOn(&sessions_cmd.step);
 }
@@ -0,0 +1,151 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/timerfd.h>
+
+#include "checksum.h"
+#include "echo-skt.h"
+#include "tun-device.h"
+#include "bundle.h"
+
+/* each frame is preceded by its length. */
+#define BUNDLE_PREFIX sizeof(uint16_t)
+
+int open_bundle(struct bundle *bundle, int mtu, unsigned int delay)
+{
+    bundle->size = 0;
+    bundle->sum = 0;
+    bundle->max = mtu;
+    bundle->frames = 0;
+    bundle->delay = delay;
+    bundle->armed = 0;
+
+    if (!(bundle->buf = malloc(sizeof(*bundle->buf) + mtu))) {
+        fprintf(stderr, "unable to allocate bundle: %s\n", strerror(errno));
+        bundle->timerfd = -1;
+        return -1;
+    }
+
+    if ((bundle->timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "unable to create bundle timer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int bundle_frame(struct bundle *bundle, const void *frame, int size)
+{
+    uint16_t len = htons(size);
+    uint32_t sum;
+    uint8_t *p;
+
+    if (bundle->size + (int)BUNDLE_PREFIX + size > bundle->max)
+        return -1;
+
+    p = bundle->buf->payload + bundle->size;
+    memcpy(p, &len, sizeof(len));
+    sum = checksum_copy(p + BUNDLE_PREFIX, frame, size, len);
+
+    bundle->sum += checksum_at(sum, bundle->size);
+    bundle->size += BUNDLE_PREFIX + size;
+    bundle->frames++;
+
+    /* start the deadline with the first frame, unless already running. */
+    if (!bundle->armed) {
+        struct itimerspec its;
+
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = bundle->delay / 1000000;
+        its.it_value.tv_nsec = (bundle->delay % 1000000) * 1000;
+
+        if (timerfd_settime(bundle->timerfd, 0, &its, NULL) == 0)
+            bundle->armed = 1;
+    }
+
+    return 0;
+}
+
+void reset_bundle(struct bundle *bundle)
+{
+    /* a running timer is left to expire, flushing early is harmless. */
+    bundle->size = 0;
+    bundle->sum = 0;
+    bundle->frames = 0;
+}
+
+void expire_bundle(struct bundle *bundle)
+{
+    uint64_t expirations;
+
+    if (read(bundle->timerfd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+        fprintf(stderr, "unable to read bundle timer: %s\n", strerror(errno));
+
+    bundle->armed = 0;
+}
+
+int unbundle(struct tun_device *device, const uint8_t *payload, int size)
+{
+    const uint8_t *end = payload + size;
+    uint16_t len;
+    int frames = 0;
+
+    while (end - payload > (int)BUNDLE_PREFIX) {
+        memcpy(&len, payload, sizeof(len));
+        len = ntohs(len);
+        payload += BUNDLE_PREFIX;
+
+        if (!len || len > end - payload)
+            return -1; /* truncated bundle. */
+
+        write_tun_device(device, payload, len);
+        payload += len;
+        frames++;
+    }
+
+    return frames;
+}
+
+void close_bundle(struct bundle *bundle)
+{
+    free(bundle->buf);
+    bundle->buf = NULL;
+
+    if (bundle->timerfd >= 0) {
+        close(bundle->timerfd);
+        bundle->timerfd = -1;
+    }
+}
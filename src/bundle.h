@@ -0,0 +1,74 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_BUNDLE_H
+#define ICMPTUNNEL_BUNDLE_H
+
+#include <stdint.h>
+
+struct echo_buf;
+struct tun_device;
+
+/* small frames packed into one echo payload, each after its length. */
+struct bundle
+{
+    struct echo_buf *buf;
+    int size;
+
+    /* running sum of the payload, added up as frames are packed. */
+    uint32_t sum;
+
+    /* payload limit, which may drop once the path is probed. */
+    int max;
+    unsigned int frames;
+
+    /* fires when the first frame has waited long enough. */
+    int timerfd;
+    unsigned int delay;
+    unsigned int armed:1;
+};
+
+/* open a bundle for frames of a tunnel with the given mtu, sent at most
+ * delay microseconds after the first frame is packed.
+ */
+int open_bundle(struct bundle *bundle, int mtu, unsigned int delay);
+
+/* pack a frame, returns -1 if it does not fit. */
+int bundle_frame(struct bundle *bundle, const void *frame, int size);
+
+/* empty the bundle once it has been sent. */
+void reset_bundle(struct bundle *bundle);
+
+/* acknowledge the deadline timer. */
+void expire_bundle(struct bundle *bundle);
+
+/* write each frame of a received bundle to the device. */
+int unbundle(struct tun_device *device, const uint8_t *payload, int size);
+
+/* close the bundle. */
+void close_bundle(struct bundle *bundle);
+
+#endif
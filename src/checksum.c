@@ -24,26 +24,260 @@
  *  SOFTWARE.
  */
 
+#include <string.h>
+
+#include "config.h"
 #include "checksum.h"
 
-uint16_t checksum(const void *buf, int size)
+#if ICMPTUNNEL_SIMD && defined(__GNUC__) && defined(__x86_64__)
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+#if ICMPTUNNEL_SIMD && defined(__aarch64__) && defined(__ARM_NEON)
+#define CHECKSUM_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* the words are added into 64 bits and only folded once at the end, the
+ * ones' complement sum of 16-bit words is the same whatever the width
+ * they are added in, as long as no carry is lost. each way of summing
+ * also copies the buffer to dst, unless it is null.
+ */
+static uint64_t sum_scalar(unsigned char *dst, const unsigned char *p, int size,
+                           uint64_t sum)
 {
-    uint16_t *p = (uint16_t*)buf;
-    uint32_t sum = 0;
+    uint64_t word;
+    uint32_t half;
+    uint16_t quarter;
+
+    for (; size >= 8; p += 8, size -= 8) {
+        memcpy(&word, p, sizeof(word));
+        if (dst) {
+            memcpy(dst, &word, sizeof(word));
+            dst += 8;
+        }
+        sum += word;
+        sum += sum < word;
+    }
+
+    /* leave room for the last few bytes. */
+    sum = (sum >> 32) + (sum & 0xffffffff);
+
+    if (dst)
+        memcpy(dst, p, size);
+
+    if (size >= 4) {
+        memcpy(&half, p, sizeof(half));
+        sum += half;
+        p += 4;
+        size -= 4;
+    }
 
-    /* calculate the sum over the buffer in 2-byte words. */
-    for (sum = 0; size > 1; size -= 2) {
-        sum += *p++;
+    if (size >= 2) {
+        memcpy(&quarter, p, sizeof(quarter));
+        sum += quarter;
+        p += 2;
+        size -= 2;
     }
 
     /* there may be a final byte to sum. */
-    if (size == 1) {
-        sum += *(unsigned char*)p;
+    if (size == 1)
+        sum += *p;
+
+    return sum;
+}
+
+#if CHECKSUM_X86
+
+/* vectors are split in 32-bit halves added to 64-bit lanes, which cannot
+ * overflow for any buffer an int can size.
+ */
+static uint64_t sum_sse2(unsigned char *dst, const unsigned char *p, int size,
+                         uint64_t sum)
+{
+    const __m128i mask = _mm_set1_epi64x(0xffffffff);
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128(), v;
+    uint64_t lanes[2];
+
+    for (; size >= 16; p += 16, size -= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        if (dst) {
+            _mm_storeu_si128((__m128i *)dst, v);
+            dst += 16;
+        }
+        lo = _mm_add_epi64(lo, _mm_and_si128(v, mask));
+        hi = _mm_add_epi64(hi, _mm_srli_epi64(v, 32));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(lo, hi));
+
+    return sum_scalar(dst, p, size, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(unsigned char *dst, const unsigned char *p, int size,
+                         uint64_t sum)
+{
+    const __m256i mask = _mm256_set1_epi64x(0xffffffff);
+    __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256(), v;
+    uint64_t lanes[4];
+
+    for (; size >= 32; p += 32, size -= 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        if (dst) {
+            _mm256_storeu_si256((__m256i *)dst, v);
+            dst += 32;
+        }
+        lo = _mm256_add_epi64(lo, _mm256_and_si256(v, mask));
+        hi = _mm256_add_epi64(hi, _mm256_srli_epi64(v, 32));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(lo, hi));
+
+    return sum_scalar(dst, p, size, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx512f")))
+static uint64_t sum_avx512(unsigned char *dst, const unsigned char *p, int size,
+                           uint64_t sum)
+{
+    const __m512i mask = _mm512_set1_epi64(0xffffffff);
+    __m512i lo = _mm512_setzero_si512(), hi = _mm512_setzero_si512(), v;
+
+    for (; size >= 64; p += 64, size -= 64) {
+        v = _mm512_loadu_si512((const void *)p);
+        if (dst) {
+            _mm512_storeu_si512((void *)dst, v);
+            dst += 64;
+        }
+        lo = _mm512_add_epi64(lo, _mm512_and_si512(v, mask));
+        hi = _mm512_add_epi64(hi, _mm512_srli_epi64(v, 32));
+    }
+
+    return sum_scalar(dst, p, size,
+                      sum + _mm512_reduce_add_epi64(_mm512_add_epi64(lo, hi)));
+}
+
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int has_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+#elif CHECKSUM_NEON
+
+/* pairs of 32-bit words are added to 64-bit lanes. */
+static uint64_t sum_neon(unsigned char *dst, const unsigned char *p, int size,
+                         uint64_t sum)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    uint8x16_t v;
+
+    for (; size >= 16; p += 16, size -= 16) {
+        v = vld1q_u8(p);
+        if (dst) {
+            vst1q_u8(dst, v);
+            dst += 16;
+        }
+        acc = vpadalq_u32(acc, vreinterpretq_u32_u8(v));
     }
 
-    /* sum the high and low 16 bits. */
+    return sum_scalar(dst, p, size, sum + vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1));
+}
+
+#endif
+
+static int always(void)
+{
+    return 1;
+}
+
+/* the ways of summing built in, narrowest first. */
+static const struct
+{
+    const char *name;
+    uint64_t (*sum)(unsigned char *, const unsigned char *, int, uint64_t);
+    int (*supported)(void);
+} variants[] = {
+    { "scalar", sum_scalar, always },
+#if CHECKSUM_X86
+    { "sse2", sum_sse2, always },
+    { "avx2", sum_avx2, has_avx2 },
+    { "avx512f", sum_avx512, has_avx512 },
+#elif CHECKSUM_NEON
+    { "neon", sum_neon, always },
+#endif
+};
+
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/* the widest variant every cpu of the target has, until init_checksum. */
+static uint64_t (*sum_words)(unsigned char *, const unsigned char *, int,
+                             uint64_t) =
+#if CHECKSUM_X86
+    sum_sse2;
+#elif CHECKSUM_NEON
+    sum_neon;
+#else
+    sum_scalar;
+#endif
+
+void init_checksum(void)
+{
+    unsigned int n = NVARIANTS;
+
+#if CHECKSUM_X86
+    __builtin_cpu_init();
+#endif
+
+    /* use the widest vectors the cpu has. */
+    while (!variants[--n].supported())
+        ;
+
+    sum_words = variants[n].sum;
+}
+
+const char *checksum_variant(unsigned int n)
+{
+    return n < NVARIANTS ? variants[n].name : NULL;
+}
+
+int select_checksum(unsigned int n)
+{
+    if (n >= NVARIANTS || !variants[n].supported())
+        return -1;
+
+    sum_words = variants[n].sum;
+    return 0;
+}
+
+/* fold a 64-bit sum down to 16 bits, leaving room to add more. */
+static inline uint32_t fold(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
     sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
 
-    return ~sum;
+    return sum;
+}
+
+uint16_t checksum(const void *buf, int size)
+{
+    return checksum_fold(checksum_partial(buf, size, 0));
+}
+
+uint32_t checksum_partial(const void *buf, int size, uint32_t sum)
+{
+    return fold(sum_words(NULL, buf, size, sum));
+}
+
+uint32_t checksum_copy(void *dst, const void *src, int size, uint32_t sum)
+{
+    return fold(sum_words(dst, src, size, sum));
 }
@@ -29,7 +29,53 @@
 
 #include <stdint.h>
 
+/* pick the fastest way to sum buffers this cpu has, before any thread
+ * starts.
+ */
+void init_checksum(void);
+
+/* name the nth way of summing built in, NULL past the last one. */
+const char *checksum_variant(unsigned int n);
+
+/* sum with the nth way built in instead, for testing. returns -1 if there
+ * is none or the cpu lacks it.
+ */
+int select_checksum(unsigned int n);
+
 /* calculate an icmp checksum. */
 uint16_t checksum(const void *buf, int size);
 
+/* add a buffer at an even offset to a running ones' complement sum. */
+uint32_t checksum_partial(const void *buf, int size, uint32_t sum);
+
+/* copy a buffer to an even offset of dst while adding it to a running
+ * sum, in a single pass over it.
+ */
+uint32_t checksum_copy(void *dst, const void *src, int size, uint32_t sum);
+
+/* move the running sum of a buffer to where the buffer is placed, the
+ * bytes of a sum swap places at an odd offset.
+ */
+static inline uint32_t checksum_at(uint32_t sum, int offset)
+{
+    return offset & 1 ? ((sum << 8) | (sum >> 8)) & 0xffff : sum;
+}
+
+/* update a running sum for a 16-bit word changed from old to new, as in
+ * rfc 1624.
+ */
+static inline uint32_t checksum_replace(uint32_t sum, uint16_t old, uint16_t new)
+{
+    return sum + (uint16_t)~old + new;
+}
+
+/* fold a running sum into a checksum. */
+static inline uint16_t checksum_fold(uint32_t sum)
+{
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return ~sum;
+}
+
 #endif
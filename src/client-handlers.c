@@ -34,18 +34,38 @@
 
 #include "config.h"
 #include "peer.h"
+#include "worker.h"
 #include "daemon.h"
 #include "options.h"
 #include "echo-skt.h"
 #include "tun-device.h"
 #include "protocol.h"
+#include "bundle.h"
 #include "forwarder.h"
 #include "client-handlers.h"
 
-void handle_client_data(struct peer *server, int framesize)
+void send_punchthrus(struct worker *worker, unsigned int used, unsigned int window)
 {
-    struct echo_skt *skt = &server->skt;
-    struct tun_device *device = &server->device;
+    struct peer *server = worker->peer;
+    unsigned int credits, n;
+
+    credits = __atomic_load_n(&server->credits, __ATOMIC_RELAXED);
+    credits = credits > used ? credits - used : 0;
+
+    for (n = 0; credits < window && n < ICMPTUNNEL_PUNCHTHRU_BURST; n++) {
+        send_punchthru(worker);
+        credits++;
+    }
+
+    __atomic_store_n(&server->credits, credits, __ATOMIC_RELAXED);
+}
+
+void handle_client_data(struct worker *worker, int framesize)
+{
+    struct peer *server = worker->peer;
+    struct echo_skt *skt = &worker->skt;
+    struct tun_device *device = &worker->device;
+    unsigned int window, level, type = CONTROL_PUNCHTHRU;
 
     /* if we're not connected then drop the packet. */
     if (!server->connected)
@@ -55,38 +75,73 @@ void handle_client_data(struct peer *server, int framesize)
     if (!framesize)
         return;
 
-    /* write the frame to the tunnel interface. */
-    if (write_tun_device(device, skt->buf->payload, framesize) < 0)
+    /* write the frame, or each bundled frame, to the tunnel interface. */
+    if (skt->buf->pkth.type == PACKET_DATA_BUNDLE) {
+        if (unbundle(device, skt->buf->payload, framesize) < 0)
+            return;
+    } else if (skt->buf->pkth.type == PACKET_FRAGMENT) {
+        if (reassemble(&server->reasm, device, skt->buf->payload, framesize) < 0)
+            return;
+    } else if (write_tun_device(device, skt->buf->payload, framesize) < 0) {
         return;
+    }
 
-    server->seconds = 0;
-    server->timeouts = 0;
+    peer_alive(server);
 
-    /* send punch-thru to avoid server sequence number starvartion. */
-    if (device->iopkts + 1 >= ICMPTUNNEL_PUNCHTHRU_WINDOW / 2)
-        send_punchthru(server);
-    else
-        device->iopkts++;
+    window = window_received(&server->window);
+
+    /* the server ran out of sequence numbers, whatever was counted as
+     * sent, so grow the window for the frames it has waiting.
+     */
+    level = skt->buf->pkth.flags >> PACKET_BACKLOG_SHIFT;
+    if ((server->features & PACKET_F_CREDITS) && level) {
+        window = window_backlog(&server->window, 1U << (level - 1));
+        type = CONTROL_STARVED;
+
+        /* keep at it should nothing more arrive. */
+        if (!__atomic_exchange_n(&server->stalled, 1, __ATOMIC_RELAXED))
+            add_timer(server->timers, &server->punchthru, ICMPTUNNEL_PUNCHTHRU_INTERVAL);
+    } else if (server->stalled) {
+        __atomic_store_n(&server->stalled, 0, __ATOMIC_RELAXED);
+    }
+
+    /* replace the sequence number this packet used up, avoiding server
+     * sequence number starvartion, from the thread sending to the server.
+     */
+    struct control topup = { server, server->nextid, type, 0, 1, window };
+
+    post_control(worker, &topup);
 }
 
-void handle_keep_alive_response(struct peer *server)
+void handle_keep_alive_response(struct worker *worker, int size)
 {
+    struct peer *server = worker->peer;
+
     /* if we're not connected then drop the packet. */
     if (!server->connected)
         return;
 
-    server->seconds = 0;
-    server->timeouts = 0;
+    pthread_mutex_lock(&server->lock);
+    window_pong(&server->window, worker->skt.buf->icmph.un.echo.sequence);
+    receive_timestamp(worker, size);
+    pthread_mutex_unlock(&server->lock);
+
+    peer_alive(server);
 }
 
-void handle_connection_accept(struct peer *server)
+void handle_connection_accept(struct worker *worker)
 {
-    struct packet_header *pkth = &server->skt.buf->pkth;
+    struct peer *server = worker->peer;
+    struct packet_header *pkth = &worker->skt.buf->pkth;
     char ip[sizeof("255.255.255.255")];
 
+    pthread_mutex_lock(&server->lock);
+
     /* if we're already connected then ignore the packet. */
-    if (server->connected)
+    if (server->connected) {
+        pthread_mutex_unlock(&server->lock);
         return;
+    }
 
     inet_ntop(AF_INET, &server->linkip, ip, sizeof(ip));
 
@@ -101,18 +156,39 @@ void handle_connection_accept(struct peer *server)
 
     fprintf(stderr, "connection established with %s.\n", ip);
 
+    server->features = pkth->flags & (PACKET_F_BUNDLE | PACKET_F_FRAGMENT |
+                                      PACKET_F_PROBE | PACKET_F_CREDITS);
+    server->credits = 0;
+    reset_latency(server);
     server->connected = 1;
-    server->seconds = 0;
-    server->timeouts = 0;
+    peer_alive(server);
+
+    /* the accept is a reply to the connection request. */
+    window_pong(&server->window, worker->skt.buf->icmph.un.echo.sequence);
+
+    /* find the largest packets the path carries. */
+    if (server->features & PACKET_F_PROBE)
+        send_probe(worker, pmtu_start(&server->pmtu));
+
+    pthread_mutex_unlock(&server->lock);
 
-    /* fork and run as a daemon if needed. */
+    /* fork and run as a daemon if needed, only once and before the
+     * other workers start as threads do not survive fork().
+     */
     if (opts.daemon) {
         if (daemon() != 0)
             return;
+        opts.daemon = 0;
     }
 
+    /* the other workers forward packets from now on. */
+    start_workers(server);
+
     /* send the initial punch-thru packets. */
-    send_punchthru(server);
+    struct control topup = { server, server->nextid, CONTROL_PUNCHTHRU, 0, 0,
+                                 server->window.size };
+
+    post_control(worker, &topup);
 }
 
 void handle_server_full(struct peer *server)
@@ -124,12 +200,18 @@ void handle_server_full(struct peer *server)
     fprintf(stderr, "unable to connect: server is full, retrying.\n");
 }
 
-int send_message(struct peer *server, int pkttype, int flags, int size)
+/* write the headers of a message to the server. */
+static void build_message(struct worker *worker, int pkttype, int flags)
 {
-    struct echo_skt *skt = &server->skt;
+    struct peer *server = worker->peer;
+    struct echo_skt *skt = &worker->skt;
+    uint16_t seq;
 
+    /* workers share the sequence, which is kept in host order. */
     if (!opts.emulation)
-        server->nextseq = htons(ntohs(server->nextseq) + 1);
+        seq = __atomic_add_fetch(&server->hot->nextseq, 1, __ATOMIC_RELAXED);
+    else
+        seq = server->hot->nextseq;
 
     /* write a connection request packet. */
     struct packet_header *pkth = &skt->buf->pkth;
@@ -140,19 +222,105 @@ int send_message(struct peer *server, int pkttype, int flags, int size)
     /* send packet. */
     struct icmphdr *icmph = &skt->buf->icmph;
     icmph->un.echo.id = server->nextid;
-    icmph->un.echo.sequence = server->nextseq;
+    icmph->un.echo.sequence = htons(seq);
+
+    /* time the round trip of requests the server replies to right away,
+     * which are sent by one thread at a time.
+     */
+    if (pkttype == PACKET_KEEP_ALIVE || pkttype == PACKET_PROBE ||
+        pkttype == PACKET_CONNECTION_REQUEST)
+        window_ping(&server->window, icmph->un.echo.sequence);
+}
+
+int send_message(struct worker *worker, int pkttype, int flags, int size)
+{
+    build_message(worker, pkttype, flags);
 
-    return send_echo(skt, server->linkip, size);
+    return send_echo(&worker->skt, worker->peer->linkip, size);
 }
 
-void send_connection_request(struct peer *server)
+/* write a probe that tells the server our payload limit. */
+static void build_probe(struct worker *worker, unsigned int size)
 {
-    unsigned int flags = opts.emulation ? PACKET_F_ICMP_SEQ_EMULATION : 0;
+    struct echo_skt *skt = &worker->skt;
+    uint16_t payload = htons(worker->peer->payload);
+
+    build_message(worker, PACKET_PROBE, 0);
+    memset(skt->buf->payload, 0, size);
+    memcpy(skt->buf->payload, &payload, sizeof(payload));
+}
+
+/* use the result once a search is over. */
+static void probe_done(struct worker *worker)
+{
+    struct peer *server = worker->peer;
+    char ip[sizeof("255.255.255.255")];
+
+    if (server->pmtu.searching || server->pmtu.lo == server->payload)
+        return;
+
+    __atomic_store_n(&server->payload, server->pmtu.lo, __ATOMIC_RELAXED);
+
+    inet_ntop(AF_INET, &server->linkip, ip, sizeof(ip));
+    fprintf(stderr, "path to %s carries %u byte packets.\n", ip, server->pmtu.lo);
+
+    /* the replies came back the same way, so the server can use it too. */
+    build_probe(worker, sizeof(uint16_t));
+    send_echo(&worker->skt, server->linkip, sizeof(uint16_t));
+}
+
+void send_probe(struct worker *worker, unsigned int size)
+{
+    struct peer *server = worker->peer;
+
+    /* a probe too large for the local link fails at once. */
+    while (size) {
+        build_probe(worker, size);
+
+        if (probe_echo(&worker->skt, server->linkip, size) >= 0)
+            break;
+
+        size = pmtu_failure(&server->pmtu);
+    }
+
+    probe_done(worker);
+}
+
+void handle_probe_reply(struct worker *worker, int size)
+{
+    struct peer *server = worker->peer;
+
+    if (!server->connected)
+        return;
+
+    peer_alive(server);
+
+    pthread_mutex_lock(&server->lock);
+    window_pong(&server->window, worker->skt.buf->icmph.un.echo.sequence);
+    send_probe(worker, pmtu_success(&server->pmtu, size));
+    pthread_mutex_unlock(&server->lock);
+}
+
+void send_connection_request(struct worker *worker)
+{
+    struct peer *server = worker->peer;
+    /* the emulation option is raised while connecting, see build_message. */
+    unsigned int flags = opts.emulation > 1 ? PACKET_F_ICMP_SEQ_EMULATION : 0;
+    uint32_t addr;
+
+    /* we can always split bundles, reassemble fragments and clear a
+     * backlog of frames.
+     */
+    flags |= PACKET_F_BUNDLE | PACKET_F_FRAGMENT | PACKET_F_CREDITS;
 
-    /* do not touch nextseq until connection established. */
-    opts.emulation++;
+    /* tell the server our tunnel address, so it can route to us before we
+     * send anything.
+     */
+    addr = tun_device_addr(&worker->device);
 
     fprintf(stderr, "trying to connect using id %d ...\n",
             htons(server->nextid));
-    send_message(server, PACKET_CONNECTION_REQUEST, flags, 0);
+    build_message(worker, PACKET_CONNECTION_REQUEST, flags);
+    memcpy(worker->skt.buf->payload, &addr, sizeof(addr));
+    send_echo(&worker->skt, server->linkip, addr ? sizeof(addr) : 0);
 }
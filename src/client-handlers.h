@@ -28,38 +28,53 @@
 #define ICMPTUNNEL_CLIENT_HANDLERS_H
 
 #include "options.h"
+#include "latency.h"
 
 struct peer;
+struct worker;
 
 /* handle a data packet. */
-void handle_client_data(struct peer *server, int framesize);
+void handle_client_data(struct worker *worker, int framesize);
 
 /* handle a keep-alive packet. */
-void handle_keep_alive_response(struct peer *server);
+void handle_keep_alive_response(struct worker *worker, int size);
 
 /* handle a connection accept packet. */
-void handle_connection_accept(struct peer *server);
+void handle_connection_accept(struct worker *worker);
 
 /* handle a server full packet. */
 void handle_server_full(struct peer *server);
 
 /* send a message to the server. */
-int send_message(struct peer *server, int pkttype, int flags, int size);
+int send_message(struct worker *worker, int pkttype, int flags, int size);
+
+/* handle the reply to a path mtu probe. */
+void handle_probe_reply(struct worker *worker, int size);
+
+/* send a path mtu probe of the given size, if any, with the server lock
+ * held.
+ */
+void send_probe(struct worker *worker, unsigned int size);
 
 /* send a connection request to the server. */
-void send_connection_request(struct peer *server);
+void send_connection_request(struct worker *worker);
 
 /* send a punchthru packet. */
-static inline void send_punchthru(struct peer *server)
+static inline void send_punchthru(struct worker *worker)
 {
     if (!opts.emulation)
-        send_message(server, PACKET_PUNCHTHRU, 0, 0);
+        send_message(worker, PACKET_PUNCHTHRU, 0, write_timestamp(worker, 0));
 }
 
+/* note the server used some sequence numbers, and send punch-thrus until
+ * it has a window of them or a burst was sent.
+ */
+void send_punchthrus(struct worker *worker, unsigned int used, unsigned int window);
+
 /* send a keep-alive request to the server. */
-static inline void send_keep_alive(struct peer *server)
+static inline void send_keep_alive(struct worker *worker)
 {
-    send_message(server, PACKET_KEEP_ALIVE, 0, 0);
+    send_message(worker, PACKET_KEEP_ALIVE, 0, write_timestamp(worker, 1));
 }
 
 #endif
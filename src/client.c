@@ -34,6 +34,7 @@
 #include "options.h"
 #include "client.h"
 #include "peer.h"
+#include "worker.h"
 #include "resolve.h"
 #include "privs.h"
 #include "protocol.h"
@@ -43,165 +44,316 @@
 #include "forwarder.h"
 #include "client-handlers.h"
 
-static void handle_icmp_packet(struct peer *server)
+static void handle_icmp_packet(struct worker *worker, int size)
 {
-    struct echo_skt *skt = &server->skt;
-    int size;
-
-    /* receive the packet. */
-    if ((size = receive_echo(skt)) < 0)
-        return;
+    struct peer *server = worker->peer;
+    struct echo_skt *skt = &worker->skt;
 
     /* we're only expecting packets from the server ... */
-    if (server->linkip != skt->buf->iph.saddr)
+    if (server->linkip != skt->buf->iph.saddr) {
+        worker->stats.counts[STAT_DROP_SOURCE]++;
         return;
+    }
 
     /* ... and with our id that is used to connect to the server. */
-    if (server->nextid != skt->buf->icmph.un.echo.id)
+    if (server->nextid != skt->buf->icmph.un.echo.id) {
+        worker->stats.counts[STAT_DROP_ID]++;
         return;
+    }
 
     /* check the header magic. */
     const struct packet_header *pkth = &skt->buf->pkth;
 
-    if (memcmp(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic)))
+    if (memcmp(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic))) {
+        worker->stats.counts[STAT_DROP_MAGIC]++;
         return;
+    }
 
     switch (pkth->type) {
     case PACKET_DATA:
+    case PACKET_DATA_BUNDLE:
+    case PACKET_FRAGMENT:
         /* handle a data packet. */
-        handle_client_data(server, size);
+        handle_client_data(worker, size);
         break;
 
     case PACKET_KEEP_ALIVE:
         /* handle a keep-alive packet. */
-        handle_keep_alive_response(server);
+        handle_keep_alive_response(worker, size);
         break;
 
     case PACKET_CONNECTION_ACCEPT:
         /* handle a connection accept packet. */
-        handle_connection_accept(server);
+        handle_connection_accept(worker);
         break;
 
     case PACKET_SERVER_FULL:
         /* handle a server full packet. */
         handle_server_full(server);
         break;
+
+    case PACKET_PROBE:
+        /* handle a path mtu probe reply. */
+        handle_probe_reply(worker, size);
+        break;
     }
 }
 
-static void handle_tunnel_data(struct peer *server)
+static void handle_tunnel_data(struct worker *worker, int pkttype, int size)
 {
-    struct echo_skt *skt = &server->skt;
-    struct tun_device *device = &server->device;
-    int framesize;
-
-    /* read the frame. */
-    if ((framesize = read_tun_device(device, skt->buf->payload)) <= 0)
-        return;
+    struct peer *server = worker->peer;
 
     /* if we're not connected then drop the frame. */
-    if (!server->connected)
+    if (!server->connected) {
+        worker->stats.counts[STAT_DROP_UNROUTED]++;
         return;
+    }
 
     /* write a data packet. */
-    if (send_message(server, PACKET_DATA, 0, framesize) < 0)
+    if (send_message(worker, pkttype, 0, size) < 0)
         return;
 
-    if (device->iopkts > 0)
-        device->iopkts--;
+    /* the server may reply to it too. */
+    if (__atomic_load_n(&server->credits, __ATOMIC_RELAXED) < ICMPTUNNEL_MAX_WINDOW)
+        __atomic_add_fetch(&server->credits, 1, __ATOMIC_RELAXED);
 }
 
-static void handle_timeout(struct peer *server)
+/* start connecting, sending the request again until the server replies. */
+static void start_connecting(struct worker *worker)
 {
-    /* send a punch-thru packet. */
-    if (server->connected) {
-        send_punchthru(server);
+    struct peer *server = worker->peer;
+
+    /* do not touch nextseq until connection established. */
+    opts.emulation++;
+
+    send_connection_request(worker);
+
+    server->backoff = ICMPTUNNEL_CONNECT_TIMEOUT;
+    add_timer(server->timers, &server->retransmit, server->backoff);
+}
+
+static void handle_retransmit_timer(struct timer *timer)
+{
+    struct worker *worker = timer->data;
+    struct peer *server = worker->peer;
 
-        if (server->device.iopkts > 0)
-            server->device.iopkts--;
+    pthread_mutex_lock(&server->lock);
+
+    /* back off up to the keep-alive interval, which resends it too. */
+    if (!server->connected) {
+        send_connection_request(worker);
+
+        server->backoff *= 2;
+        if (server->backoff < opts.keepalive * 1000)
+            add_timer(server->timers, timer, server->backoff);
     }
 
-    /* has the peer timeout elapsed? */
-    if (++server->seconds == opts.keepalive) {
-        unsigned int retries =
-            opts.retries ? opts.retries : ICMPTUNNEL_RETRIES;
+    pthread_mutex_unlock(&server->lock);
+}
 
-        server->seconds = 0;
+static void handle_keepalive_timer(struct timer *timer)
+{
+    struct worker *worker = timer->data;
+    struct peer *server = worker->peer;
+    unsigned int interval = opts.keepalive * 1000;
+    unsigned int retries = opts.retries ? opts.retries : ICMPTUNNEL_RETRIES;
+    uint64_t idle;
+
+    pthread_mutex_lock(&server->lock);
+
+    /* has the keep-alive interval elapsed since the server was heard? */
+    idle = timer_now() - __atomic_load_n(&server->hot->alive, __ATOMIC_RELAXED);
+    if (server->connected && idle < interval) {
+        add_timer(server->timers, timer, interval - idle);
+        goto out;
+    }
 
-        /* have we reached the max number of retries? */
-        if (++server->timeouts == retries) {
-            fprintf(stderr, "connection timed out.\n");
+    /* have we reached the max number of retries? */
+    if (++server->hot->timeouts == retries) {
+        fprintf(stderr, "connection timed out.\n");
 
-            server->connected = 0;
-            server->timeouts = 0;
+        server->hot->timeouts = 0;
 
-            if (opts.retries) {
-                /* stop the packet forwarding loop. */
-                stop();
-                return;
-            }
+        if (opts.retries) {
+            /* stop the packet forwarding loop. */
+            server->connected = 0;
+            stop();
+            goto out;
         }
 
         if (server->connected) {
-            /* otherwise, send a keep-alive request. */
-            send_keep_alive(server);
-        } else {
-            /* if we're still connecting, resend the connection request. */
-            send_connection_request(server);
+            server->connected = 0;
+            start_connecting(worker);
         }
     }
+
+    if (server->connected) {
+        /* otherwise, send a keep-alive request, and a punch-thru
+         * as the sequence numbers the server has may have expired
+         * in a firewall by now.
+         */
+        send_keep_alive(worker);
+        send_punchthru(worker);
+    } else if (!timer_pending(&server->retransmit)) {
+        /* if we're still connecting, resend the connection request. */
+        send_connection_request(worker);
+    }
+
+    add_timer(server->timers, timer, interval);
+
+out:
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void handle_punchthru_timer(struct timer *timer)
+{
+    struct worker *worker = timer->data;
+    struct peer *server = worker->peer;
+    uint64_t idle;
+
+    if (!server->connected || !__atomic_load_n(&server->stalled, __ATOMIC_RELAXED))
+        return;
+
+    idle = timer_now() - __atomic_load_n(&server->hot->alive, __ATOMIC_RELAXED);
+
+    /* the server has frames waiting but nothing arrives, so the punch-thrus
+     * were lost or used up: send a window of them again, until it has been
+     * quiet for a whole tick.
+     */
+    if (idle >= ICMPTUNNEL_TICK) {
+        __atomic_store_n(&server->stalled, 0, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (idle >= ICMPTUNNEL_PUNCHTHRU_INTERVAL) {
+        struct control starved = { server, server->nextid, CONTROL_STARVED, 0, 0,
+                                   __atomic_load_n(&server->window.size, __ATOMIC_RELAXED) };
+
+        post_control(worker, &starved);
+    }
+
+    add_timer(server->timers, timer, ICMPTUNNEL_PUNCHTHRU_INTERVAL);
+}
+
+static void handle_tick_timer(struct timer *timer)
+{
+    struct worker *worker = timer->data;
+    struct peer *server = worker->peer;
+
+    /* top up the sequence numbers for the downstream rate, which is none
+     * once the link is idle.
+     */
+    if (server->connected) {
+        struct control topup = { server, server->nextid, CONTROL_PUNCHTHRU, 0, 0,
+                                     window_tick(&server->window) };
+
+        post_control(worker, &topup);
+    }
+
+    pthread_mutex_lock(&server->lock);
+
+    /* probe the path, or check it still carries the payload found. */
+    if (server->connected && (server->features & PACKET_F_PROBE))
+        send_probe(worker, pmtu_tick(&server->pmtu));
+
+    pthread_mutex_unlock(&server->lock);
+
+    add_timer(server->timers, timer, ICMPTUNNEL_TICK);
+}
+
+static void handle_control(struct worker *worker, const struct control *ctl)
+{
+    struct peer *server = ctl->peer;
+
+    if (!server->connected)
+        return;
+
+    /* the server ran out of sequence numbers, whatever was counted as
+     * sent.
+     */
+    if (ctl->type == CONTROL_STARVED)
+        __atomic_store_n(&server->credits, 0, __ATOMIC_RELAXED);
+
+    /* top up the sequence numbers the server has, sending the punch-thrus
+     * from the thread sending the data that also uses them up.
+     */
+    send_punchthrus(worker, ctl->count, ctl->window);
 }
 
 static const struct handlers handlers = {
     handle_icmp_packet,
     handle_tunnel_data,
-    handle_timeout,
+    NULL,
+    handle_control,
 };
 
 int client(const char *hostname)
 {
     struct peer server;
-    struct echo_skt *skt = &server.skt;
-    struct tun_device *device = &server.device;
+    struct peer_hot hot;
+    unsigned int i;
     int ret = 1;
 
+    server.workers = NULL;
+    server.hot = &hot;
+    server.features = 0;
+
     /* resolve the server hostname. */
     if (resolve(hostname, &server.linkip) < 0)
         goto err_out;
 
-    /* open an echo socket. */
-    if (open_echo_skt(skt, opts.mtu, opts.ttl, 1) < 0)
-        goto err_out;
-
-    /* open a tunnel interface. */
-    if (open_tun_device(device, opts.mtu) < 0)
-        goto err_close_skt;
+    /* open an echo socket and a tunnel interface queue per worker. */
+    if (open_workers(&server, opts.queues, 1, &handlers, NULL) < 0)
+        goto err_close_workers;
 
     /* drop privileges. */
     if (drop_privs(opts.user) < 0)
-        goto err_close_tun;
+        goto err_close_workers;
+
+    /* publish the counters of every worker. */
+    if (open_stats(server.nworkers) == 0) {
+        for (i = 0; i < server.nworkers; i++)
+            attach_stats(&server.workers[i].stats);
+    }
 
     /* choose initial icmp id and sequence numbers. */
     server.nextid = htons(opts.id > UINT16_MAX ? (uint32_t)rand() : opts.id);
-    server.nextseq = htons(rand());
+    server.hot->nextseq = rand();
+
+    /* let the kernel drop everything but replies from the server. */
+    if (1) {
+        struct echo_filter filter = { PACKET_MAGIC_SERVER, 0, 0, 0, 0, 0 };
+
+        filter.linkip = server.linkip;
+        filter.id = server.nextid;
+        filter_echo_skt(&server.workers[0].skt, &filter);
+    }
 
     /* mark as not connected to server. */
     server.connected = 0;
+    server.stalled = 0;
+
+    /* initialize timeout retries and the timers, all run by the first
+     * worker.
+     */
+    server.hot->timeouts = 0;
+    init_timer(&server.hot->keepalive, handle_keepalive_timer, &server.workers[0]);
+    init_timer(&server.retransmit, handle_retransmit_timer, &server.workers[0]);
+    init_timer(&server.punchthru, handle_punchthru_timer, &server.workers[0]);
+    init_timer(&server.tick, handle_tick_timer, &server.workers[0]);
 
-    /* initialize keepalive seconds and timeout retries. */
-    server.seconds = 0;
-    server.timeouts = 0;
+    add_timer(server.timers, &server.hot->keepalive, opts.keepalive * 1000);
+    add_timer(server.timers, &server.tick, ICMPTUNNEL_TICK);
 
     /* send the initial connection request. */
-    send_connection_request(&server);
+    start_connecting(&server.workers[0]);
 
-    /* run the packet forwarding loop. */
-    ret = forward(&server, &handlers) < 0;
+    /* run the packet forwarding loop, other workers start on connect. */
+    ret = forward(&server.workers[0], &handlers) < 0;
 
-err_close_tun:
-    close_tun_device(device);
-err_close_skt:
-    close_echo_skt(skt);
+err_close_workers:
+    close_stats();
+    close_workers(&server);
 err_out:
     return ret;
 }
@@ -39,11 +39,162 @@
 /* default number of retries before a connection is dropped. */
 #define ICMPTUNNEL_RETRIES 5
 
-/* default interval between punch-thru packets. */
-#define ICMPTUNNEL_PUNCHTHRU_INTERVAL 1
+/* milliseconds a forwarding loop waits before checking it should stop. */
+#define ICMPTUNNEL_POLL_TIMEOUT 1000
 
-/* default window size of punch-thru packets. */
-#define ICMPTUNNEL_PUNCHTHRU_WINDOW 8
+/* milliseconds between periodic checks, such as path probes. */
+#define ICMPTUNNEL_TICK 1000
+
+/* milliseconds before a connection request is sent again, doubling each
+ * time up to the keep-alive interval.
+ */
+#define ICMPTUNNEL_CONNECT_TIMEOUT 250
+
+/* milliseconds between punch-thru packets while the server has frames
+ * waiting and none arrive.
+ */
+#define ICMPTUNNEL_PUNCHTHRU_INTERVAL 20
+
+/* milliseconds a downstream frame waits for a sequence number before the
+ * last one is used again.
+ */
+#define ICMPTUNNEL_DOWNSTREAM_WAIT 200
+
+/* default max number of unused sequence numbers the client keeps the
+ * server supplied with.
+ */
+#define ICMPTUNNEL_WINDOW 256
+
+/* bounds of the punch-thru window, the server keeps as many sequence
+ * numbers as the largest one.
+ */
+#define ICMPTUNNEL_MIN_WINDOW 4
+#define ICMPTUNNEL_MAX_WINDOW 1024
+
+/* round trip time in microseconds assumed until one is measured. */
+#define ICMPTUNNEL_WINDOW_RTT 100000
+
+/* microseconds between window updates while packets arrive. */
+#define ICMPTUNNEL_WINDOW_PERIOD 100000
+
+/* max punch-thru packets sent in reply to a single packet. */
+#define ICMPTUNNEL_PUNCHTHRU_BURST 8
+
+/* frames queued for the client while it has no unused sequence numbers. */
+#define ICMPTUNNEL_DOWNSTREAM_QUEUE 64
+
+/* unused queue buffers kept for the next client that needs one. */
+#define ICMPTUNNEL_DOWNSTREAM_SPARE 16
+
+/* number of icmp packets received with a single system call. */
+#define ICMPTUNNEL_RX_BATCH 32
+
+/* number of icmp packets queued before they are sent at once. */
+#define ICMPTUNNEL_TX_BATCH 32
+
+/* packet buffers added to the pool for each socket opened, enough for
+ * its receive ring, both transmit queues, the tunnel reads in flight and
+ * a free list.
+ */
+#define ICMPTUNNEL_PKTBUF_SLAB 256
+
+/* packet buffers moved at once between the pool and a free list. */
+#define ICMPTUNNEL_PKTBUF_BATCH 16
+
+/* max number of packets handled from one fd before polling again. */
+#define ICMPTUNNEL_POLL_BUDGET 64
+
+/* max number of ready fds handled after one poll. */
+#define ICMPTUNNEL_POLL_EVENTS 64
+
+/* build the io_uring forwarding engine. */
+#ifndef ICMPTUNNEL_URING
+#define ICMPTUNNEL_URING 1
+#endif
+
+/* sum buffers with vector instructions where the cpu has them. */
+#ifndef ICMPTUNNEL_SIMD
+#define ICMPTUNNEL_SIMD 1
+#endif
+
+/* time each stage of the forwarding path, printed on SIGUSR1. */
+#ifndef ICMPTUNNEL_PROFILE
+#define ICMPTUNNEL_PROFILE 0
+#endif
+
+/* io_uring submission queue size. */
+#define ICMPTUNNEL_URING_ENTRIES 256
+
+/* io_uring provided buffers for icmp receives, a power of two. */
+#define ICMPTUNNEL_URING_RX_BUFS 64
+
+/* io_uring reads kept posted on the tunnel device. */
+#define ICMPTUNNEL_URING_READS 32
+
+/* default to the epoll forwarding engine. */
+#define ICMPTUNNEL_ENGINE FORWARD_EPOLL
+
+/* default to a single-queue tunnel device forwarded by one thread. */
+#define ICMPTUNNEL_QUEUES 1
+
+/* default to forwarding both directions of a queue in one thread. */
+#define ICMPTUNNEL_PIPELINE 0
+
+/* control events waiting for the thread forwarding the other direction of
+ * a queue, a power of two.
+ */
+#define ICMPTUNNEL_CONTROL_RING 1024
+
+/* max tunnel device queues. */
+#define ICMPTUNNEL_MAX_QUEUES 64
+
+/* default to a server accepting a single client. */
+#define ICMPTUNNEL_CLIENTS 1
+
+/* max clients of a server, each holding a session. */
+#define ICMPTUNNEL_MAX_CLIENTS 1048576
+
+/* max instances a server runs at once, each on a tunnel device. */
+#define ICMPTUNNEL_MAX_INSTANCES 1024
+
+/* sessions allocated at once as the server table fills. */
+#define ICMPTUNNEL_SESSION_SLAB 256
+
+/* max static routes to networks behind the clients of a server. */
+#define ICMPTUNNEL_MAX_ROUTES 64
+
+/* default to reading mtu sized frames, without segmentation offloads. */
+#define ICMPTUNNEL_OFFLOAD 0
+
+/* default to sending every frame in a packet of its own. */
+#define ICMPTUNNEL_BUNDLE_DELAY 0
+
+/* max bundle delay in microseconds. */
+#define ICMPTUNNEL_MAX_BUNDLE_DELAY 1000000
+
+/* largest frame packed into a bundle, larger ones are sent alone. */
+#define ICMPTUNNEL_BUNDLE_FRAME 256
+
+/* frames of the peer being reassembled at once. */
+#define ICMPTUNNEL_REASM_SLOTS 16
+
+/* seconds before a partly reassembled frame is dropped. */
+#define ICMPTUNNEL_REASM_TIMEOUT 2
+
+/* smallest payload probed, what any ipv4 path must carry. */
+#define ICMPTUNNEL_PMTU_MIN (576 - 34)
+
+/* the probe search stops once the bounds are this close. */
+#define ICMPTUNNEL_PMTU_STEP 8
+
+/* ticks to wait for a probe reply. */
+#define ICMPTUNNEL_PMTU_WAIT 2
+
+/* ticks between checks of the path. */
+#define ICMPTUNNEL_PMTU_CHECK 10
+
+/* checks lost in a row before the path is probed again. */
+#define ICMPTUNNEL_PMTU_MISSES 2
 
 /* default to standard linux behaviour, do not emulate windows ping. */
 #define ICMPTUNNEL_EMULATION 0
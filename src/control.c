@@ -0,0 +1,152 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "control.h"
+
+struct control_ring *open_control_ring(unsigned int size)
+{
+    struct control_ring *ring;
+    int err;
+
+    if ((err = posix_memalign((void **)&ring, STATS_ALIGN, sizeof(*ring))) != 0) {
+        fprintf(stderr, "unable to allocate control ring: %s\n", strerror(err));
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = size - 1;
+
+    if (!(ring->events = malloc(size * sizeof(*ring->events)))) {
+        fprintf(stderr, "unable to allocate control ring: %s\n", strerror(errno));
+        goto err_free_ring;
+    }
+
+    if ((ring->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "unable to create control eventfd: %s\n", strerror(errno));
+        goto err_free_events;
+    }
+
+    return ring;
+
+err_free_events:
+    free(ring->events);
+err_free_ring:
+    free(ring);
+    return NULL;
+}
+
+int push_control(struct control_ring *ring, const struct control *ctl)
+{
+    unsigned int tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+        return -1;
+
+    ring->events[tail & ring->mask] = *ctl;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    ring->posted = 1;
+
+    return 0;
+}
+
+void kick_control_ring(struct control_ring *ring)
+{
+    uint64_t one = 1;
+
+    if (!ring->posted)
+        return;
+
+    ring->posted = 0;
+
+    /* pairs with the fence in sleep_control_ring: either the consumer sees
+     * the events, or this sees it asleep.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED) &&
+        write(ring->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "unable to wake control ring: %s\n", strerror(errno));
+}
+
+int pop_control(struct control_ring *ring, struct control *ctl)
+{
+    unsigned int head = ring->head;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return -1;
+
+    *ctl = ring->events[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int sleep_control_ring(struct control_ring *ring)
+{
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+void awake_control_ring(struct control_ring *ring)
+{
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED))
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+}
+
+void clear_control_ring(struct control_ring *ring)
+{
+    uint64_t count;
+
+    if (read(ring->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "unable to read control eventfd: %s\n", strerror(errno));
+}
+
+void close_control_ring(struct control_ring *ring)
+{
+    if (!ring)
+        return;
+
+    close(ring->fd);
+    free(ring->events);
+    free(ring);
+}
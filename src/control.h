@@ -0,0 +1,124 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_CONTROL_H
+#define ICMPTUNNEL_CONTROL_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+struct peer;
+
+/* control events the worker receiving packets for a queue posts to the one
+ * reading frames from it, when each direction has a thread, so the state
+ * of a direction is only touched by the thread forwarding it.
+ */
+enum {
+    /* server: a sequence number to reply to the client with. */
+    CONTROL_CREDIT,
+
+    /* server: a client connected, starting from the sequence number,
+     * queueing frames if count is set.
+     */
+    CONTROL_RESET,
+
+    /* server: send the frames that have waited too long. */
+    CONTROL_EXPIRE,
+
+    /* server: free the sequence numbers of a quiet client. */
+    CONTROL_TRIM,
+
+    /* client: count sequence numbers the server used up, and send
+     * punch-thrus until it has a window of them.
+     */
+    CONTROL_PUNCHTHRU,
+
+    /* client: as above, the server having run out of them. */
+    CONTROL_STARVED
+};
+
+struct control
+{
+    /* the peer the event is about, and its icmp id when posted, as its
+     * session may have been taken by another since.
+     */
+    struct peer *peer;
+    uint16_t id;
+
+    uint16_t type;
+    uint16_t seq;
+    uint16_t count;
+    unsigned int window;
+};
+
+/* lock-free ring with a single producer and a single consumer thread. */
+struct control_ring
+{
+    /* written by the consumer, which is asleep if waiting is set. */
+    unsigned int head __attribute__((aligned(STATS_ALIGN)));
+    unsigned int waiting;
+
+    /* written by the producer, which has posted since the last wake if
+     * posted is set.
+     */
+    unsigned int tail __attribute__((aligned(STATS_ALIGN)));
+    unsigned int posted;
+
+    unsigned int mask __attribute__((aligned(STATS_ALIGN)));
+    struct control *events;
+
+    /* eventfd the consumer polls while asleep. */
+    int fd;
+};
+
+/* allocate a ring of size events, a power of two. */
+struct control_ring *open_control_ring(unsigned int size);
+
+/* add an event, returns -1 if the ring is full. */
+int push_control(struct control_ring *ring, const struct control *ctl);
+
+/* wake the consumer if it is asleep and events were posted. */
+void kick_control_ring(struct control_ring *ring);
+
+/* take the oldest event, returns -1 if there is none. */
+int pop_control(struct control_ring *ring, struct control *ctl);
+
+/* mark the consumer asleep before it polls, returns -1 and leaves it
+ * awake if events are waiting.
+ */
+int sleep_control_ring(struct control_ring *ring);
+
+/* mark the consumer awake once it is done polling. */
+void awake_control_ring(struct control_ring *ring);
+
+/* clear the eventfd once it is readable. */
+void clear_control_ring(struct control_ring *ring);
+
+/* free the ring. */
+void close_control_ring(struct control_ring *ring);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "protocol.h"
+#include "echo-skt.h"
+#include "timer.h"
+#include "downstream.h"
+
+#define NSLOTS (ICMPTUNNEL_DOWNSTREAM_QUEUE + 1)
+
+struct downstream_frames
+{
+    /* next in the pool. */
+    struct downstream_frames *next;
+    unsigned int stride;
+
+    int sizes[NSLOTS];
+    uint16_t sums[NSLOTS];
+    uint8_t types[NSLOTS];
+    uint64_t stamps[NSLOTS];
+    uint8_t data[];
+};
+
+/* queue buffers not in use by any client. */
+static struct
+{
+    pthread_mutex_t lock;
+    struct downstream_frames *spare;
+    unsigned int nspare;
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static struct downstream_frames *get_frames(unsigned int stride)
+{
+    struct downstream_frames *frames;
+
+    pthread_mutex_lock(&pool.lock);
+    if ((frames = pool.spare)) {
+        pool.spare = frames->next;
+        pool.nspare--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (frames && frames->stride != stride) {
+        free(frames);
+        frames = NULL;
+    }
+
+    if (!frames && (frames = malloc(sizeof(*frames) + NSLOTS * stride)))
+        frames->stride = stride;
+
+    return frames;
+}
+
+static void put_frames(struct downstream_frames *frames)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (pool.nspare < ICMPTUNNEL_DOWNSTREAM_SPARE) {
+        frames->next = pool.spare;
+        pool.spare = frames;
+        pool.nspare++;
+        frames = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    free(frames);
+}
+
+void open_downstream(struct downstream *ds, unsigned int payload)
+{
+    pthread_mutex_init(&ds->lock, NULL);
+    ds->credits = NULL;
+    ds->frames = NULL;
+    ds->stride = payload;
+
+    reset_downstream(ds, 0, 0);
+}
+
+void reset_downstream(struct downstream *ds, uint16_t seq, int queue)
+{
+    pthread_mutex_lock(&ds->lock);
+
+    ds->credit_head = 0;
+    ds->ncredits = 0;
+    ds->lastseq = seq;
+    ds->frame_head = 0;
+    ds->nframes = 0;
+    ds->queue = queue != 0;
+    ds->recent = 1;
+
+    if (ds->frames) {
+        put_frames(ds->frames);
+        ds->frames = NULL;
+    }
+
+    pthread_mutex_unlock(&ds->lock);
+}
+
+/* tell the client how many frames wait, as a power of two. */
+static int backlog_flags(const struct downstream *ds)
+{
+    unsigned int level = 0, n = ds->nframes;
+
+    while (n && level < PACKET_BACKLOG_MAX) {
+        level++;
+        n >>= 1;
+    }
+
+    return level << PACKET_BACKLOG_SHIFT;
+}
+
+static void send_frame(struct downstream *ds, struct echo_skt *skt,
+                       uint32_t linkip, uint16_t seq, int size)
+{
+    struct packet_header *pkth = &skt->buf->pkth;
+
+    memcpy(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic));
+    pkth->flags = backlog_flags(ds);
+
+    skt->buf->icmph.un.echo.sequence = seq;
+    ds->lastseq = seq;
+
+    send_echo(skt, linkip, size);
+}
+
+/* copy the frame in the echo buffer to the end of the queue, summing it
+ * on the way so it is not read again when sent.
+ */
+static int push_frame(struct downstream *ds, const struct echo_skt *skt, int size)
+{
+    struct downstream_frames *frames = ds->frames;
+    unsigned int slot;
+
+    if (!frames && !(frames = ds->frames = get_frames(ds->stride)))
+        return -1;
+
+    slot = (ds->frame_head + ds->nframes++) % NSLOTS;
+    frames->sums[slot] = checksum_copy(frames->data + slot * ds->stride,
+                                       skt->buf->payload, size, 0);
+    frames->sizes[slot] = size;
+    frames->types[slot] = skt->buf->pkth.type;
+    frames->stamps[slot] = timer_now();
+
+    return 0;
+}
+
+/* move the oldest queued frame into the echo buffer, returns its size. */
+static int pop_frame(struct downstream *ds, struct echo_skt *skt)
+{
+    struct downstream_frames *frames = ds->frames;
+    unsigned int slot = ds->frame_head;
+    int size = frames->sizes[slot];
+
+    memcpy(skt->buf->payload, frames->data + slot * ds->stride, size);
+    skt->buf->pkth.type = frames->types[slot];
+    sum_echo(skt, skt->buf, frames->sums[slot]);
+
+    ds->frame_head = (slot + 1) % NSLOTS;
+
+    /* the buffers go back to the pool once the queue is empty. */
+    if (!--ds->nframes) {
+        put_frames(frames);
+        ds->frames = NULL;
+        ds->frame_head = 0;
+    }
+
+    return size;
+}
+
+unsigned int send_downstream(struct downstream *ds, struct echo_skt *skt,
+                             uint32_t linkip, int size)
+{
+    unsigned int nframes;
+
+    pthread_mutex_lock(&ds->lock);
+
+    ds->recent = 1;
+
+    if (!ds->nframes && ds->ncredits) {
+        /* reply to the newest request, the least likely to have expired
+         * in a firewall while the link was idle.
+         */
+        ds->ncredits--;
+        send_frame(ds, skt, linkip,
+                   ds->credits[(ds->credit_head + ds->ncredits) % ICMPTUNNEL_MAX_WINDOW],
+                   size);
+    } else if (!ds->queue || (unsigned int)size > ds->stride ||
+               push_frame(ds, skt, size) < 0) {
+        /* the client cannot catch up, so reuse a sequence number. */
+        send_frame(ds, skt, linkip, ds->lastseq, size);
+    } else if (ds->nframes > ICMPTUNNEL_DOWNSTREAM_QUEUE) {
+        /* the queue is full, so the oldest frame goes out anyway. */
+        size = pop_frame(ds, skt);
+        send_frame(ds, skt, linkip, ds->lastseq, size);
+    }
+
+    nframes = ds->nframes;
+
+    pthread_mutex_unlock(&ds->lock);
+
+    return nframes;
+}
+
+void credit_downstream(struct downstream *ds, struct echo_skt *skt,
+                       uint32_t linkip, uint16_t seq)
+{
+    unsigned int slot;
+    int size;
+
+    pthread_mutex_lock(&ds->lock);
+
+    ds->recent = 1;
+
+    if (ds->nframes) {
+        size = pop_frame(ds, skt);
+        send_frame(ds, skt, linkip, seq, size);
+    } else if (ds->credits || (ds->credits = malloc(ICMPTUNNEL_MAX_WINDOW *
+                                                    sizeof(*ds->credits)))) {
+        /* keep the newest sequence numbers. */
+        if (ds->ncredits == ICMPTUNNEL_MAX_WINDOW) {
+            ds->credit_head = (ds->credit_head + 1) % ICMPTUNNEL_MAX_WINDOW;
+            ds->ncredits--;
+        }
+
+        slot = (ds->credit_head + ds->ncredits++) % ICMPTUNNEL_MAX_WINDOW;
+        ds->credits[slot] = seq;
+    }
+
+    pthread_mutex_unlock(&ds->lock);
+}
+
+unsigned int expire_downstream(struct downstream *ds, struct echo_skt *skt,
+                               uint32_t linkip, uint16_t id)
+{
+    uint64_t now = timer_now(), due;
+    unsigned int wait = 0;
+    int size;
+
+    pthread_mutex_lock(&ds->lock);
+
+    while (ds->nframes) {
+        due = ds->frames->stamps[ds->frame_head] + ICMPTUNNEL_DOWNSTREAM_WAIT;
+        if (due > now) {
+            wait = due - now;
+            break;
+        }
+
+        /* the client has stopped asking, so do not hold the frame back. */
+        size = pop_frame(ds, skt);
+
+        /* the buffer last held a packet of whichever client. */
+        skt->buf->icmph.un.echo.id = id;
+        send_frame(ds, skt, linkip, ds->lastseq, size);
+    }
+
+    pthread_mutex_unlock(&ds->lock);
+
+    return wait;
+}
+
+void trim_downstream(struct downstream *ds)
+{
+    pthread_mutex_lock(&ds->lock);
+
+    if (!ds->recent && ds->credits) {
+        free(ds->credits);
+        ds->credits = NULL;
+        ds->credit_head = 0;
+        ds->ncredits = 0;
+    }
+    ds->recent = 0;
+
+    pthread_mutex_unlock(&ds->lock);
+}
+
+void close_downstream(struct downstream *ds)
+{
+    free(ds->credits);
+    free(ds->frames);
+    pthread_mutex_destroy(&ds->lock);
+}
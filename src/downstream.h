@@ -0,0 +1,106 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_DOWNSTREAM_H
+#define ICMPTUNNEL_DOWNSTREAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "config.h"
+
+struct echo_skt;
+struct downstream_frames;
+
+/* frames for a client and the sequence numbers to send them with,
+ * shared by the workers of the peer, or only by those reading frames if
+ * each direction has a thread. a client that is not receiving holds no
+ * buffers, so idle clients stay small.
+ */
+struct downstream
+{
+    pthread_mutex_t lock;
+
+    /* sequence numbers of client requests not yet replied to, allocated
+     * on the first one.
+     */
+    uint16_t *credits;
+    unsigned int credit_head;
+    unsigned int ncredits;
+
+    /* sequence number of the last reply. */
+    uint16_t lastseq;
+
+    /* frames waiting for a sequence number, with a spare slot, in buffers
+     * taken from a pool shared by all clients while any wait.
+     */
+    struct downstream_frames *frames;
+    unsigned int stride;
+    unsigned int frame_head;
+    unsigned int nframes;
+
+    /* queue frames rather than reuse sequence numbers. */
+    unsigned int queue:1;
+
+    /* used since the last trim. */
+    unsigned int recent:1;
+};
+
+/* initialize an empty queue for frames up to the payload size. */
+void open_downstream(struct downstream *ds, unsigned int payload);
+
+/* forget the frames and sequence numbers of a previous client. */
+void reset_downstream(struct downstream *ds, uint16_t seq, int queue);
+
+/* send the frame in the echo buffer, or queue it until a sequence number
+ * arrives, the icmp id and packet type must already be written. returns
+ * the number of frames queued.
+ */
+unsigned int send_downstream(struct downstream *ds, struct echo_skt *skt,
+                             uint32_t linkip, int size);
+
+/* take the sequence number of a client request, sending the oldest queued
+ * frame with it if there is one, the icmp id must already be written.
+ */
+void credit_downstream(struct downstream *ds, struct echo_skt *skt,
+                       uint32_t linkip, uint16_t seq);
+
+/* send the frames that have waited too long with a reused sequence number
+ * and the icmp id of the client, returns the milliseconds until the next
+ * one is due, or zero if none.
+ */
+unsigned int expire_downstream(struct downstream *ds, struct echo_skt *skt,
+                               uint32_t linkip, uint16_t id);
+
+/* free the sequence numbers unless used since the last call, they have
+ * likely expired in a firewall by then.
+ */
+void trim_downstream(struct downstream *ds);
+
+/* free the queue. */
+void close_downstream(struct downstream *ds);
+
+#endif
@@ -24,24 +24,150 @@
  *  SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 
+#include "config.h"
 #include "checksum.h"
+#include "protocol.h"
 #include "echo-skt.h"
+#include "profile.h"
+#include "timer.h"
 
 #ifndef ICMP_FILTER
 #define ICMP_FILTER 1
 #endif
 
+static int alloc_rings(struct echo_skt *skt)
+{
+    unsigned int i;
+
+    skt->rxcount = ICMPTUNNEL_RX_BATCH;
+    skt->txcount = ICMPTUNNEL_TX_BATCH;
+    skt->txlen = 0;
+    skt->cache.free = NULL;
+    skt->cache.nfree = 0;
+
+    /* add buffers for the socket to the pool. */
+    if (open_pktbufs(skt->bufsize, ICMPTUNNEL_PKTBUF_SLAB) < 0)
+        return -1;
+
+    skt->pooled = 1;
+
+    /* allocate the rings and message headers. */
+    skt->scratch = malloc(skt->bufsize);
+    skt->rxbufs = calloc(skt->rxcount, sizeof(*skt->rxbufs));
+    skt->rxmsgs = calloc(skt->rxcount, sizeof(*skt->rxmsgs));
+    skt->rxiovs = calloc(skt->rxcount, sizeof(*skt->rxiovs));
+    skt->rxaddrs = calloc(skt->rxcount, sizeof(*skt->rxaddrs));
+    skt->rxcontrols = malloc(skt->rxcount * ECHO_CONTROL_SIZE);
+    skt->txbufs = calloc(skt->txcount, sizeof(*skt->txbufs));
+    skt->txmsgs = calloc(skt->txcount, sizeof(*skt->txmsgs));
+    skt->txiovs = calloc(skt->txcount, sizeof(*skt->txiovs));
+    skt->txaddrs = calloc(skt->txcount, sizeof(*skt->txaddrs));
+
+    if (!skt->scratch || !skt->rxbufs || !skt->rxmsgs || !skt->rxiovs ||
+        !skt->rxaddrs || !skt->rxcontrols || !skt->txbufs || !skt->txmsgs ||
+        !skt->txiovs || !skt->txaddrs) {
+        fprintf(stderr, "unable to allocate icmp tx/rx buffers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* point each message at a packet buffer the ring keeps. */
+    for (i = 0; i < skt->rxcount; i++) {
+        if (!(skt->rxbufs[i] = get_pktbuf(&skt->cache))) {
+            fprintf(stderr, "unable to allocate icmp rx buffers: pool is empty\n");
+            return -1;
+        }
+
+        skt->rxiovs[i].iov_base = skt->rxbufs[i]->data;
+        skt->rxiovs[i].iov_len = skt->bufsize;
+
+        skt->rxmsgs[i].msg_hdr.msg_iov = &skt->rxiovs[i];
+        skt->rxmsgs[i].msg_hdr.msg_iovlen = 1;
+        skt->rxmsgs[i].msg_hdr.msg_name = &skt->rxaddrs[i];
+        skt->rxmsgs[i].msg_hdr.msg_control = skt->rxcontrols + i * ECHO_CONTROL_SIZE;
+    }
+
+    /* queued packets start at the icmp header of their buffer. */
+    for (i = 0; i < skt->txcount; i++) {
+        skt->txmsgs[i].msg_hdr.msg_iov = &skt->txiovs[i];
+        skt->txmsgs[i].msg_hdr.msg_iovlen = 1;
+        skt->txmsgs[i].msg_hdr.msg_name = &skt->txaddrs[i];
+        skt->txmsgs[i].msg_hdr.msg_namelen = sizeof(skt->txaddrs[i]);
+
+        skt->txaddrs[i].sin_family = AF_INET;
+        skt->txaddrs[i].sin_port = 0;  /* for valgrind. */
+    }
+
+    skt->buf = skt->scratch;
+
+    return 0;
+}
+
+/* open a socket for probes that are never fragmented. */
+static int open_probe_skt(struct echo_skt *skt)
+{
+    int val;
+
+    if ((skt->probefd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
+        fprintf(stderr, "unable to open icmp probe socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* replies are received on the tunnel socket. */
+    val = ~0U;
+    setsockopt(skt->probefd, SOL_RAW, ICMP_FILTER, &val, sizeof(val));
+
+    val = IP_PMTUDISC_PROBE;
+    if (setsockopt(skt->probefd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) < 0) {
+        fprintf(stderr, "unable to set the don't fragment bit on probes: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    val = 255;
+    if (skt->ttl && setsockopt(skt->probefd, IPPROTO_IP, IP_TTL, &val, sizeof(val)) < 0) {
+        fprintf(stderr, "unable to enable ttl security mechanism\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 int open_echo_skt(struct echo_skt *skt, int mtu, int ttl, int client)
 {
+    int on = 1;
+
+    skt->probefd = -1;
+    skt->pooled = 0;
     skt->buf = NULL;
+    skt->scratch = NULL;
+    skt->rxbufs = NULL;
+    skt->rxmsgs = NULL;
+    skt->rxiovs = NULL;
+    skt->rxaddrs = NULL;
+    skt->rxcontrols = NULL;
+    skt->txbufs = NULL;
+    skt->txmsgs = NULL;
+    skt->txiovs = NULL;
+    skt->txaddrs = NULL;
+    skt->txpkt = NULL;
+    skt->sumbuf = NULL;
 
     /* open the icmp socket. */
     if ((skt->fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
@@ -70,44 +196,329 @@ int open_echo_skt(struct echo_skt *skt, int mtu, int ttl, int client)
         }
     }
 
+    /* tell how many packets the kernel dropped with the queue full. */
+    if (setsockopt(skt->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+        fprintf(stderr, "unable to count dropped icmp packets: %s\n", strerror(errno));
+
+    /* time packets as they arrive, keep-alives are timed by the user
+     * space clock otherwise.
+     */
+    on = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(skt->fd, SOL_SOCKET, SO_TIMESTAMPING, &on, sizeof(on)) < 0)
+        fprintf(stderr, "unable to time icmp packets: %s\n", strerror(errno));
+
+    /* the client probes the path to the server. */
+    if (client && open_probe_skt(skt) < 0)
+        return -1;
+
     /* calculate the buffer size required to encapsulate this payload. */
     skt->bufsize = mtu + sizeof(*skt->buf);
 
-    /* allocate the buffer. */
-    if ((skt->buf = malloc(skt->bufsize)) == NULL) {
-        fprintf(stderr, "unable to allocate icmp tx/rx buffers: %s\n", strerror(errno));
+    return alloc_rings(skt);
+}
+
+int share_echo_skt(struct echo_skt *skt, const struct echo_skt *orig)
+{
+    *skt = *orig;
+
+    skt->pooled = 0;
+    skt->buf = NULL;
+    skt->scratch = NULL;
+    skt->rxbufs = NULL;
+    skt->rxmsgs = NULL;
+    skt->rxiovs = NULL;
+    skt->rxaddrs = NULL;
+    skt->rxcontrols = NULL;
+    skt->txbufs = NULL;
+    skt->txmsgs = NULL;
+    skt->txiovs = NULL;
+    skt->txaddrs = NULL;
+    skt->txpkt = NULL;
+    skt->sumbuf = NULL;
+
+    /* a descriptor of our own for the same socket. */
+    skt->probefd = -1;
+    if ((skt->fd = dup(orig->fd)) < 0 ||
+        (orig->probefd >= 0 && (skt->probefd = dup(orig->probefd)) < 0)) {
+        fprintf(stderr, "unable to share icmp socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return alloc_rings(skt);
+}
+
+/* jump targets resolved once the filter program is complete. */
+enum {
+    FILTER_NEXT,
+    FILTER_DATA,
+    FILTER_ACCEPT,
+    FILTER_DROP,
+    FILTER_LABELS
+};
+
+#define FILTER_MAX_INSNS 24
+
+struct filter_prog
+{
+    struct sock_filter insns[FILTER_MAX_INSNS];
+    unsigned int len;
+    unsigned int labels[FILTER_LABELS];
+};
+
+static void emit(struct filter_prog *prog, uint16_t code, uint8_t jt, uint8_t jf,
+                 uint32_t k)
+{
+    struct sock_filter insn = { code, jt, jf, k };
+
+    prog->insns[prog->len++] = insn;
+}
+
+static void label(struct filter_prog *prog, int label)
+{
+    prog->labels[label] = prog->len;
+}
+
+/* turn jump labels into offsets relative to the next instruction. */
+static void resolve(struct filter_prog *prog)
+{
+    struct sock_filter *insn;
+    unsigned int i;
+
+    for (i = 0; i < prog->len; i++) {
+        insn = &prog->insns[i];
+
+        if (BPF_CLASS(insn->code) != BPF_JMP)
+            continue;
+
+        if (insn->jt != FILTER_NEXT)
+            insn->jt = prog->labels[insn->jt] - i - 1;
+        if (insn->jf != FILTER_NEXT)
+            insn->jf = prog->labels[insn->jf] - i - 1;
+    }
+}
+
+int filter_echo_skt(struct echo_skt *skt, const struct echo_filter *filter)
+{
+    struct filter_prog prog;
+    struct sock_fprog fprog;
+    uint32_t magic;
+    int type = skt->client ? ICMP_ECHOREPLY : ICMP_ECHO;
+
+    /* packets reach raw sockets with their ip header. */
+    const unsigned int echo_id = offsetof(struct icmphdr, un.echo.id);
+    const unsigned int pkt_magic = sizeof(struct icmphdr);
+    const unsigned int pkt_type = pkt_magic + offsetof(struct packet_header, type);
+
+    memcpy(&magic, filter->magic, sizeof(magic));
+    prog.len = 0;
+
+    /* x = ip header length. */
+    emit(&prog, BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0);
+
+    /* match the icmp type, code and packet magic. */
+    emit(&prog, BPF_LD | BPF_B | BPF_IND, 0, 0, offsetof(struct icmphdr, type));
+    emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_NEXT, FILTER_DROP, type);
+    emit(&prog, BPF_LD | BPF_B | BPF_IND, 0, 0, offsetof(struct icmphdr, code));
+    emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_NEXT, FILTER_DROP, 0);
+    emit(&prog, BPF_LD | BPF_W | BPF_IND, 0, 0, pkt_magic);
+    emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_NEXT, FILTER_DROP, ntohl(magic));
+
+    /* connection requests may come from anyone. */
+    if (filter->requests) {
+        emit(&prog, BPF_LD | BPF_B | BPF_IND, 0, 0, pkt_type);
+        emit(&prog, BPF_JMP | BPF_JEQ | BPF_K,
+             filter->strict ? FILTER_NEXT : FILTER_ACCEPT, FILTER_DATA,
+             PACKET_CONNECTION_REQUEST);
+
+        if (filter->strict) {
+            emit(&prog, BPF_LD | BPF_H | BPF_IND, 0, 0, echo_id);
+            emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_ACCEPT, FILTER_DROP,
+                 ntohs(filter->id));
+        }
+    }
+
+    /* everything else only from the peer, with its id. */
+    label(&prog, FILTER_DATA);
+    if (filter->linkip) {
+        emit(&prog, BPF_LD | BPF_W | BPF_ABS, 0, 0, offsetof(struct iphdr, saddr));
+        emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_NEXT, FILTER_DROP,
+             ntohl(filter->linkip));
+        emit(&prog, BPF_LD | BPF_H | BPF_IND, 0, 0, echo_id);
+        emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_ACCEPT, FILTER_DROP,
+             ntohs(filter->id));
+    } else if (filter->anyone) {
+        emit(&prog, BPF_LD | BPF_H | BPF_IND, 0, 0, echo_id);
+        emit(&prog, BPF_JMP | BPF_JEQ | BPF_K, FILTER_ACCEPT,
+             filter->strict ? FILTER_DROP : FILTER_ACCEPT, ntohs(filter->id));
+    }
+
+    /* nothing else is expected before the peer is known. */
+    label(&prog, FILTER_DROP);
+    emit(&prog, BPF_RET | BPF_K, 0, 0, 0);
+    label(&prog, FILTER_ACCEPT);
+    emit(&prog, BPF_RET | BPF_K, 0, 0, 0xFFFFFFFF);
+
+    resolve(&prog);
+
+    fprog.len = prog.len;
+    fprog.filter = prog.insns;
+
+    if (setsockopt(skt->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        fprintf(stderr, "unable to attach kernel packet filter: %s\n", strerror(errno));
         return -1;
     }
 
     return 0;
 }
 
+/* write the icmp header of the current packet, or of its copy in buf,
+ * returns the size of the icmp packet.
+ */
+static ssize_t seal_echo(struct echo_skt *skt, struct echo_buf *buf, int size)
+{
+    ssize_t xfer = sizeof(buf->icmph) + sizeof(buf->pkth) + size;
+
+    struct icmphdr *icmph = (struct icmphdr *)((char *)buf +
+                                               offsetof(struct echo_buf, icmph));
+    icmph->type = skt->client ? ICMP_ECHO : ICMP_ECHOREPLY;
+    icmph->code = 0;
+    icmph->checksum = 0;
+
+    /* only the headers are left to sum if the payload sum is known. */
+    PROFILE_START(start);
+    if (skt->sumbuf == skt->buf)
+        icmph->checksum = checksum_fold(checksum_partial(icmph, xfer - size, skt->paysum));
+    else
+        icmph->checksum = checksum(icmph, xfer);
+    PROFILE_END(PROFILE_CHECKSUM, start);
+
+    skt->sumbuf = NULL;
+
+    return xfer;
+}
+
+struct echo_buf *build_echo(struct echo_skt *skt)
+{
+    struct pktbuf *pkt = skt->txpkt;
+
+    /* a buffer still queued is left to the queue. */
+    if (pkt && pktbuf_shared(pkt)) {
+        put_pktbuf(&skt->cache, pkt);
+        pkt = NULL;
+    }
+
+    if (!pkt && !(pkt = get_pktbuf(&skt->cache))) {
+        skt->stats->counts[STAT_DROP_NOBUF]++;
+        skt->txpkt = NULL;
+        return NULL;
+    }
+
+    skt->txpkt = pkt;
+    skt->buf = (struct echo_buf *)pkt->data;
+
+    return skt->buf;
+}
+
 int send_echo(struct echo_skt *skt, uint32_t targetip, int size)
 {
+    struct pktbuf *pkt = skt->txpkt;
+    struct echo_buf *buf = skt->buf;
+    unsigned int slot;
     ssize_t xfer;
 
+    /* make room in the transmit queue. */
+    if (skt->txlen == skt->txcount)
+        flush_echo(skt);
+
+    PROFILE_START(start);
+
+    /* queue the buffer the packet was built in, unless it is queued
+     * already, or a copy in one from the pool.
+     */
+    if (pkt && buf == (struct echo_buf *)pkt->data && !pktbuf_shared(pkt)) {
+        hold_pktbuf(pkt);
+    } else if ((pkt = get_pktbuf(&skt->cache))) {
+        buf = (struct echo_buf *)pkt->data;
+        memcpy(&buf->icmph, &skt->buf->icmph,
+               sizeof(buf->icmph) + sizeof(buf->pkth) + size);
+    } else {
+        skt->stats->counts[STAT_DROP_NOBUF]++;
+        return -1;
+    }
+
+    /* write the icmp header. */
+    xfer = seal_echo(skt, buf, size);
+
+    /* queue the packet, it is sent on the next flush. */
+    slot = skt->txlen++;
+    skt->txbufs[slot] = pkt;
+    skt->txiovs[slot].iov_base = &buf->icmph;
+    skt->txiovs[slot].iov_len = xfer;
+    skt->txaddrs[slot].sin_addr.s_addr = targetip;
+
+    skt->stats->counts[STAT_ICMP_TX_PACKETS]++;
+    skt->stats->counts[STAT_ICMP_TX_BYTES] += xfer;
+
+    PROFILE_END(PROFILE_BUILD, start);
+
+    return size;
+}
+
+int probe_echo(struct echo_skt *skt, uint32_t targetip, int size)
+{
     struct sockaddr_in dest;
+    ssize_t xfer;
+
+    if (skt->probefd < 0)
+        return -1;
+
+    xfer = seal_echo(skt, skt->buf, size);
+
+    memset(&dest, 0, sizeof(dest));
     dest.sin_family = AF_INET;
     dest.sin_addr.s_addr = targetip;
-    dest.sin_port = 0;  /* for valgrind. */
 
-    xfer = sizeof(skt->buf->icmph) + sizeof(skt->buf->pkth) + size;
+    /* too large for the local link is reported right away. */
+    if (sendto(skt->probefd, &skt->buf->icmph, xfer, 0,
+               (struct sockaddr *)&dest, sizeof(dest)) != xfer)
+        return -1;
 
-    /* write the icmp header. */
-    struct icmphdr *icmph = &skt->buf->icmph;
-    icmph->type = skt->client ? ICMP_ECHO : ICMP_ECHOREPLY;
-    icmph->code = 0;
-    icmph->checksum = 0;
-    icmph->checksum = checksum(icmph, xfer);
+    return size;
+}
 
-    /* send the packet. */
-    if (sendto(skt->fd, icmph, xfer, 0,
-               (struct sockaddr *)&dest, sizeof(dest)) != xfer) {
-        fprintf(stderr, "unable to send icmp packet: %s\n", strerror(errno));
-        return -1;
+int flush_echo(struct echo_skt *skt)
+{
+    unsigned int sent = 0;
+    int n;
+
+    /* send the queue, skipping any packet the kernel refuses. */
+    while (sent < skt->txlen) {
+        PROFILE_START(start);
+        n = sendmmsg(skt->fd, skt->txmsgs + sent, skt->txlen - sent, 0);
+        PROFILE_END(PROFILE_SEND, start);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            skt->stats->counts[STAT_ICMP_TX_ERRORS]++;
+            fprintf(stderr, "unable to send icmp packet: %s\n", strerror(errno));
+            n = 1;
+        }
+        sent += n;
     }
 
-    return size;
+    clear_echo(skt);
+
+    return sent;
+}
+
+void clear_echo(struct echo_skt *skt)
+{
+    unsigned int i;
+
+    for (i = 0; i < skt->txlen; i++)
+        put_pktbuf(&skt->cache, skt->txbufs[i]);
+
+    skt->txlen = 0;
 }
 
 static inline int echo_supported(struct echo_skt *skt, int type)
@@ -116,6 +527,61 @@ static inline int echo_supported(struct echo_skt *skt, int type)
            (type == ICMP_ECHO && !skt->client);
 }
 
+static int parse_echo(struct echo_skt *skt, ssize_t xfer,
+                      const struct sockaddr_in *source)
+{
+    struct stats *stats = skt->stats;
+
+    stats->counts[STAT_ICMP_RX_PACKETS]++;
+    stats->counts[STAT_ICMP_RX_BYTES] += xfer;
+
+    if (xfer < (int)sizeof(*skt->buf)) {
+        stats->counts[STAT_DROP_SIZE]++;
+        return -1; /* bad packet size. */
+    }
+
+    /* parse ip header. */
+    const struct iphdr *iph = &skt->buf->iph;
+
+    if (iph->ttl < skt->ttl) {
+        stats->counts[STAT_DROP_TTL]++;
+        return -1; /* far away than number of hops specified. */
+    }
+
+    if (iph->saddr != source->sin_addr.s_addr) {
+        stats->counts[STAT_DROP_SOURCE]++;
+        return -1; /* never happens. */
+    }
+
+    /* parse the icmp header. */
+    const struct icmphdr *icmph = &skt->buf->icmph;
+
+    if (skt->filter && !echo_supported(skt, icmph->type)) {
+        stats->counts[STAT_DROP_TYPE]++;
+        return -1; /* unexpected packet type. */
+    }
+
+    if (icmph->code != 0) {
+        stats->counts[STAT_DROP_CODE]++;
+        return -1; /* unexpected packet code. */
+    }
+
+    return xfer - sizeof(*skt->buf);
+}
+
+/* check a received packet, timed as a stage of its own. */
+static inline int classify_echo(struct echo_skt *skt, ssize_t xfer,
+                                const struct sockaddr_in *source)
+{
+    int size;
+
+    PROFILE_START(start);
+    size = parse_echo(skt, xfer, source);
+    PROFILE_END(PROFILE_CLASSIFY, start);
+
+    return size;
+}
+
 int receive_echo(struct echo_skt *skt)
 {
     ssize_t xfer;
@@ -124,44 +590,142 @@ int receive_echo(struct echo_skt *skt)
     socklen_t source_size = sizeof(source);
 
     /* receive a packet. */
+    PROFILE_START(start);
     xfer = recvfrom(skt->fd, skt->buf, skt->bufsize, 0,
                     (struct sockaddr *)&source, &source_size);
+    PROFILE_END(PROFILE_RECV, start);
     if (xfer < 0) {
         fprintf(stderr, "unable to receive icmp packet: %s\n", strerror(errno));
         return -1;
     }
 
-    if (xfer < (int)sizeof(*skt->buf))
-        return -1; /* bad packet size. */
+    return classify_echo(skt, xfer, &source);
+}
 
-    /* parse ip header. */
-    const struct iphdr *iph = &skt->buf->iph;
+int receive_echo_batch(struct echo_skt *skt)
+{
+    unsigned int i;
+    int n;
 
-    if (iph->ttl < skt->ttl)
-        return -1; /* far away than number of hops specified. */
+    /* reset the message headers clobbered by the previous batch. */
+    for (i = 0; i < skt->rxcount; i++) {
+        skt->rxmsgs[i].msg_hdr.msg_namelen = sizeof(skt->rxaddrs[i]);
+        skt->rxmsgs[i].msg_hdr.msg_controllen = ECHO_CONTROL_SIZE;
+    }
 
-    if (iph->saddr != source.sin_addr.s_addr)
-        return -1; /* never happens. */
+    /* receive as many packets as are queued, without blocking. */
+    PROFILE_START(start);
+    n = recvmmsg(skt->fd, skt->rxmsgs, skt->rxcount, MSG_DONTWAIT, NULL);
+    PROFILE_END(PROFILE_RECV, start);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        fprintf(stderr, "unable to receive icmp packets: %s\n", strerror(errno));
+        return -1;
+    }
 
-    /* parse the icmp header. */
-    const struct icmphdr *icmph = &skt->buf->icmph;
+    return n;
+}
 
-    if (skt->filter && !echo_supported(skt, icmph->type))
-        return -1; /* unexpected packet type. */
+int select_echo(struct echo_skt *skt, int idx)
+{
+    control_echo(skt, skt->rxmsgs[idx].msg_hdr.msg_control,
+                 skt->rxmsgs[idx].msg_hdr.msg_controllen);
 
-    if (icmph->code != 0)
-        return -1; /* unexpected packet code. */
+    return load_echo(skt, skt->rxiovs[idx].iov_base,
+                     skt->rxmsgs[idx].msg_len, &skt->rxaddrs[idx]);
+}
 
-    return xfer - sizeof(*skt->buf);
+int load_echo(struct echo_skt *skt, void *buf, int size,
+              const struct sockaddr_in *source)
+{
+    /* make the buffer current for the handlers. */
+    skt->buf = buf;
+
+    return classify_echo(skt, size, source);
+}
+
+void control_echo(struct echo_skt *skt, void *control, size_t size)
+{
+    struct scm_timestamping stamps;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    uint32_t drops;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = size;
+
+    skt->rxstamp = 0;
+
+    /* the count is that of the whole socket, so it is kept as is. */
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            skt->stats->counts[STAT_DROP_KERNEL] = drops;
+        } else if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            skt->rxstamp = (uint64_t)stamps.ts[0].tv_sec * 1000000000 + stamps.ts[0].tv_nsec;
+        }
+    }
+}
+
+uint64_t echo_arrival(const struct echo_skt *skt)
+{
+    uint64_t now = timer_now_us(), real, age;
+    struct timespec ts;
+
+    if (!skt->rxstamp)
+        return now;
+
+    /* the stamp is of the real time clock, so only how long ago the
+     * packet arrived is taken from it.
+     */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    real = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    if (real < skt->rxstamp)
+        return now;
+
+    age = (real - skt->rxstamp) / 1000;
+
+    return age < now ? now - age : now;
 }
 
 void close_echo_skt(struct echo_skt *skt)
 {
-    /* dispose of the buffer. */
-    if (skt->buf)
-        free(skt->buf);
+    unsigned int i;
+
+    /* give the packet buffers back before the pool goes. */
+    for (i = 0; skt->rxbufs && i < skt->rxcount; i++)
+        put_pktbuf(&skt->cache, skt->rxbufs[i]);
+    if (skt->txbufs)
+        clear_echo(skt);
+    put_pktbuf(&skt->cache, skt->txpkt);
+
+    if (skt->pooled) {
+        drain_pktbufs(&skt->cache);
+        close_pktbufs();
+    }
 
-    /* close the icmp socket. */
+    /* dispose of the rings. */
+    free(skt->scratch);
+    free(skt->rxbufs);
+    free(skt->rxmsgs);
+    free(skt->rxiovs);
+    free(skt->rxaddrs);
+    free(skt->rxcontrols);
+    free(skt->txbufs);
+    free(skt->txmsgs);
+    free(skt->txiovs);
+    free(skt->txaddrs);
+
+    /* close the icmp sockets. */
     if (skt->fd >= 0)
         close(skt->fd);
+    if (skt->probefd >= 0)
+        close(skt->probefd);
 }
@@ -27,12 +27,23 @@
 #ifndef ICMPTUNNEL_ECHOSKT_H
 #define ICMPTUNNEL_ECHOSKT_H
 
+#include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "protocol.h"
+#include "pktbuf.h"
+#include "stats.h"
+
+/* room for the socket drop count and the time stamps received along with
+ * a packet, three of them with 64 bit seconds at most.
+ */
+#define ECHO_CONTROL_SIZE \
+    (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(3 * 2 * sizeof(uint64_t)))
 
 struct echo_buf
 {
@@ -46,23 +57,139 @@ struct echo_skt
 {
     int fd;
 
+    /* send-only socket for path mtu probes, -1 if none. */
+    int probefd;
+
     unsigned int ttl:8;
     unsigned int client:1;
     unsigned int filter:1;
+    unsigned int pooled:1;
 
-    unsigned int bufsize:16;
+    /* current buffer, packets are built in scratch when no other is. */
+    unsigned int bufsize;
     struct echo_buf *buf;
+    struct echo_buf *scratch;
+
+    /* packet buffers free for the thread using the socket, which the
+     * tunnel queue of the worker takes from as well.
+     */
+    struct pktbuf_cache cache;
+
+    /* batched receive ring of packet buffers, buf points into them. */
+    unsigned int rxcount;
+    struct pktbuf **rxbufs;
+    struct mmsghdr *rxmsgs;
+    struct iovec *rxiovs;
+    struct sockaddr_in *rxaddrs;
+    char *rxcontrols;
+
+    /* transmit queue of packet buffers ready to be sent. */
+    unsigned int txcount;
+    unsigned int txlen;
+    struct pktbuf **txbufs;
+    struct mmsghdr *txmsgs;
+    struct iovec *txiovs;
+    struct sockaddr_in *txaddrs;
+
+    /* buffer frames are read into and packets built in to be sent, which
+     * is queued as is rather than copied, and replaced once it is.
+     */
+    struct pktbuf *txpkt;
+
+    /* buffer whose payload is known to add up to paysum, found while
+     * it was copied, so sending it needs no pass over the payload.
+     */
+    const struct echo_buf *sumbuf;
+    uint32_t paysum;
+
+    /* when the kernel received the current buffer, in nanoseconds of the
+     * real time clock, 0 if it did not say.
+     */
+    uint64_t rxstamp;
+
+    /* counters of the worker the socket belongs to. */
+    struct stats *stats;
+};
+
+/* packets passed by the kernel filter. */
+struct echo_filter
+{
+    /* magic of packets sent by the peer. */
+    const char *magic;
+
+    /* only packets from the peer with its id, once connected. */
+    uint32_t linkip;
+    uint16_t id;
+
+    /* also pass connection requests, only with the id if strict. */
+    unsigned int requests:1;
+    unsigned int strict:1;
+
+    /* pass everything else from any address, only with the id if strict. */
+    unsigned int anyone:1;
 };
 
 /* open an icmp echo socket. */
 int open_echo_skt(struct echo_skt *skt, int mtu, int ttl, int client);
 
-/* send an echo packet. */
+/* open another set of buffers on the same icmp socket. */
+int share_echo_skt(struct echo_skt *skt, const struct echo_skt *orig);
+
+/* attach a kernel socket filter, replacing any previous one. */
+int filter_echo_skt(struct echo_skt *skt, const struct echo_filter *filter);
+
+/* note the running sum of the payload in the current buffer, valid until
+ * the next packet is sent or sum_echo(skt, NULL, 0).
+ */
+static inline void sum_echo(struct echo_skt *skt, const struct echo_buf *buf,
+                            uint32_t sum)
+{
+    skt->sumbuf = buf;
+    skt->paysum = sum;
+}
+
+/* make the buffer to build a packet in to be sent current, a fresh one
+ * if the last has been queued, returns NULL if the pool is empty.
+ */
+struct echo_buf *build_echo(struct echo_skt *skt);
+
+/* queue an echo packet for sending, the buffer itself if it was built in
+ * the one from build_echo, a copy otherwise.
+ */
 int send_echo(struct echo_skt *skt, uint32_t targetip, int size);
 
+/* send an echo packet with the don't fragment bit set right away. */
+int probe_echo(struct echo_skt *skt, uint32_t targetip, int size);
+
+/* send all queued echo packets. */
+int flush_echo(struct echo_skt *skt);
+
+/* release the queued packets, once sent by other means. */
+void clear_echo(struct echo_skt *skt);
+
 /* receive an echo packet. */
 int receive_echo(struct echo_skt *skt);
 
+/* receive a batch of echo packets, returns the number received. */
+int receive_echo_batch(struct echo_skt *skt);
+
+/* make a packet from the batch current, returns its payload size. */
+int select_echo(struct echo_skt *skt, int idx);
+
+/* make a packet received elsewhere current, returns its payload size. */
+int load_echo(struct echo_skt *skt, void *buf, int size,
+              const struct sockaddr_in *source);
+
+/* note the drop count of the socket and the time stamp, received with a
+ * packet.
+ */
+void control_echo(struct echo_skt *skt, void *control, size_t size);
+
+/* when the current buffer arrived, in microseconds of the monotonic
+ * clock, now if the kernel did not say.
+ */
+uint64_t echo_arrival(const struct echo_skt *skt);
+
 /* close the socket. */
 void close_echo_skt(struct echo_skt *skt);
 
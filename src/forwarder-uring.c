@@ -0,0 +1,793 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "peer.h"
+#include "worker.h"
+#include "handlers.h"
+#include "echo-skt.h"
+#include "tun-device.h"
+#include "bundle.h"
+#include "control.h"
+#include "gso.h"
+#include "profile.h"
+#include "forwarder.h"
+#include "forwarder-uring.h"
+
+#if ICMPTUNNEL_URING
+
+#include <linux/io_uring.h>
+
+/* operations tagged in the completion user data. */
+enum {
+    URING_RECV,
+    URING_READ,
+    URING_SEND,
+    URING_WRITE,
+    URING_TIMER,
+    URING_POLL
+};
+
+/* timerfds, and the eventfd of the control ring, polled by the ring. */
+enum {
+    URING_TIMER_BUNDLE,
+    URING_TIMER_WHEEL,
+    URING_TIMER_CONTROL
+};
+
+#define URING_TAG(op, idx)  ((uint64_t)(op) << 32 | (idx))
+#define URING_OP(data)      ((unsigned int)((data) >> 32))
+#define URING_IDX(data)     ((unsigned int)(data))
+
+/* provided buffer group used for icmp receives. */
+#define URING_BGID 0
+
+struct uring
+{
+    int fd;
+
+    /* submission queue. */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int to_submit;
+    struct io_uring_sqe *sqes;
+
+    /* completion queue. */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* ring mappings. */
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+
+    /* receives and reads put aside until the sends are complete. */
+    struct io_uring_cqe *pending;
+    unsigned int npending;
+    unsigned int maxpending;
+
+    /* sends and writes still owned by the kernel. */
+    unsigned int inflight;
+
+    /* provided buffers for multishot icmp receives. */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    char *rxbufs;
+    unsigned int rxstride;
+    unsigned int rxcount;
+    struct msghdr rxmsg;
+
+    /* packet buffers tunnel frames are read into, NULL while a slot has
+     * none to read into, or super-frame buffers with a virtio-net header.
+     */
+    struct pktbuf **rdpkts;
+    char *rdbufs;
+    unsigned int rdstride;
+    unsigned int rdcount;
+    unsigned int unarmed;
+    struct pktbuf_cache *cache;
+
+    /* slabs registered as fixed buffers, followed by the super-frame
+     * buffers, reads and writes in others are plain ones.
+     */
+    unsigned int nslabs;
+    int fixed;
+
+    /* counters of the worker driven by the ring. */
+    struct stats *stats;
+};
+
+static inline int uring_enter(struct uring *ring, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t argsz)
+{
+    int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                      min_complete, flags, arg, argsz);
+
+    return ret < 0 ? -errno : ret;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    /* make room by submitting what is queued so far. */
+    if (tail - head == ring->sq_entries) {
+        if (uring_enter(ring, ring->to_submit, 0, 0, NULL, 0) < 0)
+            return NULL;
+        ring->to_submit = 0;
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+static void arm_recv(struct uring *ring, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = get_sqe(ring)))
+        return;
+
+    /* keep receiving into provided buffers until told otherwise. */
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&ring->rxmsg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_TAG(URING_RECV, 0);
+}
+
+/* set up a read or write of buf, in fixed buffer index unless negative. */
+static void prep_rw(struct uring *ring, struct io_uring_sqe *sqe, int op,
+                    void *buf, unsigned int len, int index)
+{
+    int fixed = ring->fixed && index >= 0;
+
+    if (op == IORING_OP_READ)
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    else
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = fixed ? index : 0;
+}
+
+/* fixed buffer index of a packet buffer, negative if not registered. */
+static inline int pktbuf_index(const struct uring *ring, const struct pktbuf *pkt)
+{
+    return pkt->slab < ring->nslabs ? (int)pkt->slab : -1;
+}
+
+static void arm_read(struct uring *ring, const struct tun_device *device,
+                     unsigned int idx, int wait)
+{
+    struct io_uring_sqe *sqe, *poll = NULL;
+    struct pktbuf *pkt = NULL;
+
+    /* a slot left without a buffer is armed again once there is one. */
+    if (!device->vnethdr && !(pkt = ring->rdpkts[idx]) &&
+        !(pkt = ring->rdpkts[idx] = get_pktbuf(ring->cache))) {
+        ring->unarmed = 1;
+        return;
+    }
+
+    /* the device is shared nonblocking, a kernel that does not wait for
+     * it on its own is told to poll before reading again.
+     */
+    if (wait && (poll = get_sqe(ring))) {
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = device->fd;
+        poll->poll32_events = POLLIN;
+        poll->flags = IOSQE_IO_LINK;
+        poll->user_data = URING_TAG(URING_POLL, idx);
+    }
+
+    if (!(sqe = get_sqe(ring))) {
+        /* nothing to link to, the poll completes alone. */
+        if (poll)
+            poll->flags = 0;
+        return;
+    }
+
+    /* read the frame straight into the echo payload of a packet buffer,
+     * or a super-frame into a slot of its own when it still needs
+     * splitting.
+     */
+    if (device->vnethdr)
+        prep_rw(ring, sqe, IORING_OP_READ, ring->rdbufs + idx * ring->rdstride,
+                GSO_MAX_FRAME, ring->nslabs);
+    else
+        prep_rw(ring, sqe, IORING_OP_READ, ((struct echo_buf *)pkt->data)->payload,
+                device->mtu, pktbuf_index(ring, pkt));
+    sqe->fd = device->fd;
+    sqe->user_data = URING_TAG(URING_READ, idx);
+}
+
+static void arm_timer(struct uring *ring, int fd, unsigned int idx)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = get_sqe(ring)))
+        return;
+
+    /* wait for the deadline along with everything else. */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TAG(URING_TIMER, idx);
+}
+
+static void recycle_rxbuf(struct uring *ring, unsigned int bid)
+{
+    struct io_uring_buf *buf;
+    unsigned short tail = ring->br->tail;
+
+    buf = &ring->br->bufs[tail & (ring->rxcount - 1)];
+    buf->addr = (uintptr_t)(ring->rxbufs + bid * ring->rxstride);
+    buf->len = ring->rxstride;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* move the socket and device transmit queues into the submission queue. */
+static void queue_tx(struct uring *ring, struct echo_skt *skt,
+                     struct tun_device *device)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int i;
+
+    /* a coalesced frame does not fit a registered slot, so it is written
+     * directly along with the frames queued ahead of it.
+     */
+    flush_tun_coalesced(device);
+
+    for (i = 0; i < skt->txlen; i++) {
+        if (!(sqe = get_sqe(ring)))
+            break;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = skt->fd;
+        sqe->addr = (uintptr_t)&skt->txmsgs[i].msg_hdr;
+        sqe->user_data = URING_TAG(URING_SEND, i);
+        ring->inflight++;
+    }
+
+    for (i = 0; i < device->txlen; i++) {
+        if (!(sqe = get_sqe(ring)))
+            break;
+
+        prep_rw(ring, sqe, IORING_OP_WRITE, device->txiovs[i].iov_base,
+                device->txiovs[i].iov_len, pktbuf_index(ring, device->txbufs[i]));
+        sqe->fd = device->fd;
+        sqe->user_data = URING_TAG(URING_WRITE, i);
+        ring->inflight++;
+    }
+}
+
+/* retire send and write completions, keep the rest for dispatch. */
+static void reap(struct uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    for (; head != tail; head++) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+
+        switch (URING_OP(cqe->user_data)) {
+        case URING_SEND:
+            if (cqe->res < 0) {
+                ring->stats->counts[STAT_ICMP_TX_ERRORS]++;
+                fprintf(stderr, "unable to send icmp packet: %s\n", strerror(-cqe->res));
+            }
+            ring->inflight--;
+            break;
+
+        case URING_WRITE:
+            if (cqe->res < 0) {
+                ring->stats->counts[STAT_TUN_TX_ERRORS]++;
+                fprintf(stderr, "unable to write to tunnel device: %s\n", strerror(-cqe->res));
+            }
+            ring->inflight--;
+            break;
+
+        case URING_POLL:
+            /* the read linked to it completes on its own. */
+            break;
+
+        default:
+            /* the rest stays queued for the next pass, which the size
+             * of the array keeps from happening.
+             */
+            if (ring->npending == ring->maxpending)
+                goto out;
+            ring->pending[ring->npending++] = *cqe;
+            break;
+        }
+    }
+
+out:
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void dispatch_recv(struct uring *ring, struct worker *worker,
+                          const struct handlers *handlers,
+                          const struct io_uring_cqe *cqe)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct io_uring_recvmsg_out *out;
+    unsigned int bid;
+    char *buf;
+    int size;
+
+    /* the multishot receive stopped, e.g. out of buffers: rearm it. */
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_recv(ring, skt->fd);
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res < 0 && cqe->res != -ENOBUFS)
+            fprintf(stderr, "unable to receive icmp packet: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = ring->rxbufs + bid * ring->rxstride;
+    out = (struct io_uring_recvmsg_out *)buf;
+
+    /* the packet follows the header, the source address and the drop
+     * count of the socket.
+     */
+    if (cqe->res >= 0 && !(out->flags & MSG_TRUNC)) {
+        control_echo(skt, buf + sizeof(*out) + ring->rxmsg.msg_namelen, out->controllen);
+        size = load_echo(skt, buf + sizeof(*out) + ring->rxmsg.msg_namelen +
+                         ring->rxmsg.msg_controllen,
+                         out->payloadlen,
+                         (struct sockaddr_in *)(buf + sizeof(*out)));
+        if (size >= 0)
+            handlers->icmp(worker, size);
+    }
+
+    /* do not let handlers build packets in a buffer the kernel owns. */
+    skt->buf = skt->scratch;
+
+    recycle_rxbuf(ring, bid);
+}
+
+static void dispatch_read(struct uring *ring, struct worker *worker,
+                          const struct handlers *handlers,
+                          const struct io_uring_cqe *cqe)
+{
+    struct echo_skt *skt = &worker->skt;
+    unsigned int idx = URING_IDX(cqe->user_data);
+    struct pktbuf *pkt;
+
+    if (cqe->res > 0) {
+        worker->stats.counts[STAT_TUN_RX_FRAMES]++;
+        worker->stats.counts[STAT_TUN_RX_BYTES] += cqe->res;
+    }
+
+    if (cqe->res > 0 && worker->device.vnethdr) {
+        forward_gso(worker, handlers, ring->rdbufs + idx * ring->rdstride, cqe->res);
+    } else if (cqe->res > 0) {
+        /* make the read buffer current for the handlers, who queue it as
+         * is, the slot reading into the next unless it was.
+         */
+        pkt = skt->txpkt;
+        skt->txpkt = ring->rdpkts[idx];
+        skt->buf = (struct echo_buf *)skt->txpkt->data;
+        ring->rdpkts[idx] = NULL;
+
+        forward_frame(worker, handlers, cqe->res);
+
+        if (skt->txpkt && !pktbuf_shared(skt->txpkt))
+            ring->rdpkts[idx] = skt->txpkt;
+        else
+            put_pktbuf(ring->cache, skt->txpkt);
+
+        skt->txpkt = pkt;
+        skt->buf = skt->scratch;
+    } else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        fprintf(stderr, "unable to read from tunnel device: %s\n", strerror(-cqe->res));
+    }
+
+    arm_read(ring, &worker->device, idx, cqe->res == -EAGAIN);
+}
+
+static int setup_rings(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        fprintf(stderr, "unable to set up io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "unable to set up io_uring: kernel too old\n");
+        return -1;
+    }
+
+    /* map the submission and completion rings in one go. */
+    ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (ring->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        ring->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        ring->ring_ptr = NULL;
+        fprintf(stderr, "unable to map io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        fprintf(stderr, "unable to map io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ring->sq_head = (unsigned int *)((char *)ring->ring_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->ring_ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned int *)((char *)ring->ring_ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned int *)((char *)ring->ring_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+
+    ring->cq_head = (unsigned int *)((char *)ring->ring_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->ring_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)((char *)ring->ring_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->ring_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+static int setup_buffers(struct uring *ring, struct worker *worker)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct tun_device *device = &worker->device;
+    struct io_uring_buf_reg reg;
+    struct iovec iovs[PKTBUF_MAX_SLABS + 1];
+    unsigned int i;
+
+    /* icmp receive buffers: recvmsg header, source address, packet. */
+    ring->rxcount = ICMPTUNNEL_URING_RX_BUFS;
+    ring->rxstride = (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) +
+                      ECHO_CONTROL_SIZE + skt->bufsize + 63) & ~63U;
+    ring->br_size = ring->rxcount * sizeof(struct io_uring_buf);
+
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->rxbufs = malloc(ring->rxcount * ring->rxstride);
+
+    /* tunnel read buffers, packet buffers of the worker unless they hold
+     * super-frames.
+     */
+    ring->rdcount = ICMPTUNNEL_URING_READS;
+    ring->cache = &skt->cache;
+    if (device->vnethdr) {
+        ring->rdstride = (GSO_MAX_FRAME + 63) & ~63U;
+        ring->rdbufs = malloc(ring->rdcount * ring->rdstride);
+    } else {
+        ring->rdpkts = calloc(ring->rdcount, sizeof(*ring->rdpkts));
+    }
+
+    /* a completion for every receive buffer and the one that ends the
+     * multishot receive once they run out, every read and poll.
+     */
+    ring->maxpending = ring->rxcount + 1 + ring->rdcount + 3;
+    ring->pending = calloc(ring->maxpending, sizeof(*ring->pending));
+
+    if (ring->br == MAP_FAILED || !ring->rxbufs || (!ring->rdbufs && !ring->rdpkts) ||
+        !ring->pending || queue_tun_device(device, ICMPTUNNEL_TX_BATCH) < 0) {
+        if (ring->br == MAP_FAILED)
+            ring->br = NULL;
+        fprintf(stderr, "unable to allocate io_uring buffers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* hand the receive buffers to the kernel. */
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = ring->rxcount;
+    reg.bgid = URING_BGID;
+
+    if (syscall(__NR_io_uring_register, ring->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "unable to register io_uring buffer ring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    ring->br->tail = 0;
+    for (i = 0; i < ring->rxcount; i++)
+        recycle_rxbuf(ring, i);
+
+    /* pin the slabs of the pool and the super-frame buffers, the slabs
+     * of workers opened later are read and written plainly.
+     */
+    ring->nslabs = pktbuf_slabs(iovs, PKTBUF_MAX_SLABS);
+    i = ring->nslabs;
+    if (ring->rdbufs) {
+        iovs[i].iov_base = ring->rdbufs;
+        iovs[i++].iov_len = ring->rdcount * ring->rdstride;
+    }
+
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+                          IORING_REGISTER_BUFFERS, iovs, i) == 0;
+
+    /* receive the source address along with each packet. */
+    memset(&ring->rxmsg, 0, sizeof(ring->rxmsg));
+    ring->rxmsg.msg_namelen = sizeof(struct sockaddr_in);
+    ring->rxmsg.msg_controllen = ECHO_CONTROL_SIZE;
+
+    return 0;
+}
+
+struct uring *open_uring(struct worker *worker)
+{
+    struct uring *ring;
+    unsigned int i;
+
+    if (!(ring = calloc(1, sizeof(*ring)))) {
+        fprintf(stderr, "unable to allocate io_uring: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    ring->fd = -1;
+    ring->stats = &worker->stats;
+
+    if (setup_rings(ring, ICMPTUNNEL_URING_ENTRIES) < 0 ||
+        setup_buffers(ring, worker) < 0) {
+        close_uring(ring, worker);
+        return NULL;
+    }
+
+    /* post the initial receive and reads. */
+    if (worker->icmp)
+        arm_recv(ring, worker->skt.fd);
+    for (i = 0; worker->tunnel && i < ring->rdcount; i++)
+        arm_read(ring, &worker->device, i, 0);
+    if (worker->bundle.buf)
+        arm_timer(ring, worker->bundle.timerfd, URING_TIMER_BUNDLE);
+    if (worker->index == 0)
+        arm_timer(ring, worker->peer->timers->fd, URING_TIMER_WHEEL);
+    if (worker->controls && !worker->icmp)
+        arm_timer(ring, worker->controls->fd, URING_TIMER_CONTROL);
+
+    return ring;
+}
+
+int forward_uring(struct uring *ring, struct worker *worker,
+                  const struct handlers *handlers, const int *running)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct tun_device *device = &worker->device;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned int i;
+    int ret;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t)&ts;
+
+    /* loop and push packets between the tunnel device and peer. */
+    while (__atomic_load_n(running, __ATOMIC_RELAXED)) {
+        /* handle the events of the other direction of the queue first,
+         * which may send queued frames.
+         */
+        if (worker->controls && !worker->icmp)
+            receive_controls(worker, handlers);
+
+        /* submit everything queued during the previous iteration, and let
+         * others see what was counted.
+         */
+        queue_tx(ring, skt, device);
+        publish_stats(&worker->stats);
+        poll_profile();
+
+        ts.tv_sec = ICMPTUNNEL_POLL_TIMEOUT / 1000;
+        ts.tv_nsec = ICMPTUNNEL_POLL_TIMEOUT % 1000 * 1000000;
+
+        /* tell the other direction of the queue what was posted, or look
+         * again at once should more have been posted to us.
+         */
+        if (worker->controls && worker->icmp) {
+            kick_control_ring(worker->controls);
+        } else if (worker->controls && sleep_control_ring(worker->controls) < 0) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = 0;
+        }
+
+        /* submit and wait for some completions in one system call. */
+        ret = uring_enter(ring, ring->to_submit, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+        if (ret >= 0)
+            ring->to_submit -= ret;
+
+        if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+            fprintf(stderr, "unable to wait for io_uring: %s\n", strerror(-ret));
+            return -1;
+        }
+
+        if (worker->controls && !worker->icmp)
+            awake_control_ring(worker->controls);
+
+        reap(ring);
+
+        /* the transmit queues are reused as soon as the kernel is done. */
+        while (ring->inflight) {
+            if ((ret = uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0 &&
+                ret != -EINTR) {
+                fprintf(stderr, "unable to wait for io_uring: %s\n", strerror(-ret));
+                return -1;
+            }
+            reap(ring);
+        }
+
+        clear_echo(skt);
+        clear_tun_device(device);
+
+        for (i = 0; i < ring->npending; i++) {
+            switch (URING_OP(ring->pending[i].user_data)) {
+            case URING_RECV:
+                /* handle a packet from the echo socket. */
+                dispatch_recv(ring, worker, handlers, &ring->pending[i]);
+                break;
+
+            case URING_READ:
+                /* handle data from the tunnel device. */
+                dispatch_read(ring, worker, handlers, &ring->pending[i]);
+                break;
+
+            case URING_TIMER:
+                if (URING_IDX(ring->pending[i].user_data) == URING_TIMER_WHEEL) {
+                    /* run the timers that are due. */
+                    run_timers(worker->peer->timers);
+                    arm_timer(ring, worker->peer->timers->fd, URING_TIMER_WHEEL);
+                    break;
+                }
+
+                if (URING_IDX(ring->pending[i].user_data) == URING_TIMER_CONTROL) {
+                    /* handle the events posted while asleep. */
+                    clear_control_ring(worker->controls);
+                    receive_controls(worker, handlers);
+                    arm_timer(ring, worker->controls->fd, URING_TIMER_CONTROL);
+                    break;
+                }
+
+                /* send the bundle when its deadline is up. */
+                expire_bundle(&worker->bundle);
+                flush_bundle(worker, handlers);
+                arm_timer(ring, worker->bundle.timerfd, URING_TIMER_BUNDLE);
+                break;
+            }
+        }
+
+        ring->npending = 0;
+
+        /* read again in slots that ran out of packet buffers. */
+        if (ring->unarmed) {
+            ring->unarmed = 0;
+            for (i = 0; i < ring->rdcount; i++) {
+                if (!ring->rdpkts[i])
+                    arm_read(ring, device, i, 0);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void close_uring(struct uring *ring, struct worker *worker)
+{
+    unsigned int i;
+
+    /* flush anything still queued for the device. */
+    flush_tun_device(&worker->device);
+
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_ptr)
+        munmap(ring->ring_ptr, ring->ring_size);
+    if (ring->br)
+        munmap(ring->br, ring->br_size);
+
+    /* the reads are cancelled along with the ring. */
+    for (i = 0; ring->rdpkts && i < ring->rdcount; i++)
+        put_pktbuf(ring->cache, ring->rdpkts[i]);
+
+    free(ring->rxbufs);
+    free(ring->rdbufs);
+    free(ring->rdpkts);
+    free(ring->pending);
+    free(ring);
+}
+
+#else
+
+struct uring *open_uring(struct worker *worker)
+{
+    (void)worker;
+
+    fprintf(stderr, "io_uring support is not built in\n");
+    return NULL;
+}
+
+int forward_uring(struct uring *ring, struct worker *worker,
+                  const struct handlers *handlers, const int *running)
+{
+    (void)ring;
+    (void)worker;
+    (void)handlers;
+    (void)running;
+
+    return -1;
+}
+
+void close_uring(struct uring *ring, struct worker *worker)
+{
+    (void)ring;
+    (void)worker;
+}
+
+#endif
@@ -25,72 +25,432 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
-#include <sys/select.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
 
 #include "config.h"
+#include "options.h"
 #include "peer.h"
+#include "protocol.h"
+#include "worker.h"
 #include "handlers.h"
 #include "echo-skt.h"
 #include "tun-device.h"
+#include "bundle.h"
+#include "control.h"
+#include "checksum.h"
+#include "gso.h"
+#include "profile.h"
 #include "forwarder.h"
+#include "forwarder-uring.h"
 
-/* are we still running? */
+/* event sources registered with epoll. */
+enum {
+    EVENT_ICMP,
+    EVENT_TUNNEL,
+    EVENT_BUNDLE,
+    EVENT_TIMERS,
+    EVENT_CONTROL,
+    EVENT_MAX
+};
+
+/* are we still running? cleared by a signal handler or any thread, and
+ * read by every worker thread.
+ */
 static int running = 1;
 
-int forward(struct peer *peer, const struct handlers *handlers)
+/* receive a batch of icmp packets, returns the number received. */
+static int receive_icmp(struct worker *worker, const struct handlers *handlers)
 {
-    struct echo_skt *skt = &peer->skt;
-    struct tun_device *device = &peer->device;
-    int maxfd = skt->fd > device->fd ? skt->fd : device->fd;
+    struct echo_skt *skt = &worker->skt;
+    int i, n, size;
 
-    /* loop and push packets between the tunnel device and peer. */
-    while (running) {
-        struct timeval timeout;
-        int ret;
-        fd_set fs;
+    /* receive all queued packets at once. */
+    if ((n = receive_echo_batch(skt)) <= 0)
+        return n;
+
+    for (i = 0; i < n; i++) {
+        /* parse and dispatch each packet in turn. */
+        if ((size = select_echo(skt, i)) >= 0)
+            handlers->icmp(worker, size);
+    }
 
-        /* fill fd set */
-        FD_ZERO(&fs);
-        FD_SET(skt->fd, &fs);
-        FD_SET(device->fd, &fs);
+    return n;
+}
 
-        /* set the timeout. */
-        timeout.tv_sec = ICMPTUNNEL_PUNCHTHRU_INTERVAL;
-        timeout.tv_usec = 0;
+void flush_bundle(struct worker *worker, const struct handlers *handlers)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct bundle *bundle = &worker->bundle;
+    struct echo_buf *buf = skt->buf;
+    const struct echo_buf *sumbuf = skt->sumbuf;
+    uint32_t paysum = skt->paysum;
 
-        /* wait for some data. */
-        ret = select(maxfd + 1, &fs, NULL, NULL, &timeout);
+    if (!bundle->frames)
+        return;
 
-        if (ret < 0) {
-            if (!running)
-                break;
-            fprintf(stderr, "unable to select() on fds: %s\n", strerror(errno));
-            return -1;
+    /* send the bundle as if it had been read into the echo buffer, the
+     * frame in the echo buffer keeps its sum for when it goes next.
+     */
+    skt->buf = bundle->buf;
+    sum_echo(skt, skt->buf, bundle->sum);
+    handlers->tunnel(worker, PACKET_DATA_BUNDLE, bundle->size);
+    sum_echo(skt, sumbuf, paysum);
+    skt->buf = buf;
+
+    reset_bundle(bundle);
+}
+
+/* send a frame in parts of at most the payload limit. */
+static void forward_fragments(struct worker *worker, const struct handlers *handlers,
+                              int framesize, int payload)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct echo_buf *buf = skt->buf;
+    struct pktbuf *pkt = skt->txpkt;
+    struct fragment_header *fh;
+    int chunk = payload - sizeof(*fh);
+    int count = (framesize + chunk - 1) / chunk;
+    int i, len, offset = 0;
+    uint32_t sum;
+    uint16_t id;
+
+    /* the fragments of a frame are counted in a byte. */
+    if (count > FRAGMENT_MAX_COUNT) {
+        worker->stats.counts[STAT_DROP_OVERSIZE]++;
+        return;
+    }
+
+    id = __atomic_fetch_add(&worker->peer->nextfrag, 1, __ATOMIC_RELAXED);
+
+    /* build each fragment in a buffer of its own, queued as is, the frame
+     * staying in the one it was read into.
+     */
+    skt->txpkt = NULL;
+
+    for (i = 0; i < count && build_echo(skt); i++, offset += len) {
+        len = framesize - offset < chunk ? framesize - offset : chunk;
+        fh = (struct fragment_header *)skt->buf->payload;
+
+        fh->id = htons(id);
+        fh->offset = htons(offset);
+        fh->index = i;
+        fh->count = count;
+        sum = checksum_copy(fh + 1, buf->payload + offset, len, 0);
+        sum_echo(skt, skt->buf, checksum_partial(fh, sizeof(*fh), sum));
+
+        handlers->tunnel(worker, PACKET_FRAGMENT, sizeof(*fh) + len);
+    }
+
+    sum_echo(skt, NULL, 0);
+
+    put_pktbuf(&skt->cache, skt->txpkt);
+    skt->txpkt = pkt;
+    skt->buf = buf;
+}
+
+void forward_frame(struct worker *worker, const struct handlers *handlers,
+                   int framesize)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct bundle *bundle = &worker->bundle;
+    struct peer *peer;
+    int payload;
+
+    if (handlers->route) {
+        if (!(peer = handlers->route(worker, skt->buf->payload, framesize))) {
+            worker->stats.counts[STAT_DROP_UNROUTED]++;
+            return;
+        }
+
+        /* frames bundled for another peer go first. */
+        if (peer != worker->peer) {
+            flush_bundle(worker, handlers);
+            worker->peer = peer;
+        }
+    }
+
+    payload = __atomic_load_n(&worker->peer->payload, __ATOMIC_RELAXED);
+
+    /* pack small frames if the peer is able to split them again. */
+    bundle->max = payload;
+    if (bundle->buf && framesize <= ICMPTUNNEL_BUNDLE_FRAME &&
+        (worker->peer->features & PACKET_F_BUNDLE)) {
+        if (bundle_frame(bundle, skt->buf->payload, framesize) == 0)
+            return;
+
+        flush_bundle(worker, handlers);
+
+        if (bundle_frame(bundle, skt->buf->payload, framesize) == 0)
+            return;
+    }
+
+    /* frames packed earlier go first. */
+    flush_bundle(worker, handlers);
+
+    /* split large frames if the peer is able to reassemble them. */
+    if (framesize > payload && (worker->peer->features & PACKET_F_FRAGMENT)) {
+        forward_fragments(worker, handlers, framesize, payload);
+        return;
+    }
+
+    handlers->tunnel(worker, PACKET_DATA, framesize);
+}
+
+int forward_gso(struct worker *worker, const struct handlers *handlers,
+                void *frame, int size)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct echo_buf *buf = skt->buf;
+    struct gso_iter it;
+    int segsize;
+
+    if (gso_start(&it, frame, size, worker->device.mtu) < 0) {
+        fprintf(stderr, "dropping unsupported frame from tunnel device.\n");
+        return -1;
+    }
+
+    /* build each segment in a packet buffer and hand it on, the buffer is
+     * queued as is once the segment is sent, with the sum of the segment
+     * added up as it was copied.
+     */
+    while (build_echo(skt) && (segsize = gso_next(&it, skt->buf->payload)) > 0) {
+        sum_echo(skt, skt->buf, it.sum);
+        forward_frame(worker, handlers, segsize);
+    }
+
+    sum_echo(skt, NULL, 0);
+
+    skt->buf = buf;
+
+    return 0;
+}
+
+/* read a frame from the tunnel device, returns the number read. */
+static int receive_tunnel(struct worker *worker, const struct handlers *handlers)
+{
+    struct echo_skt *skt = &worker->skt;
+    struct echo_buf *buf = skt->buf;
+    struct tun_device *device = &worker->device;
+    int framesize;
+
+    /* super-frames are split up after reading them whole. */
+    if (device->vnethdr) {
+        if ((framesize = read_tun_device(device, device->gsobuf)) <= 0)
+            return 0;
+
+        forward_gso(worker, handlers, device->gsobuf, framesize);
+        return 1;
+    }
+
+    /* read the frame straight into the payload of a packet buffer, so
+     * sending it queues the buffer without copying the frame.
+     */
+    if (!build_echo(skt))
+        return 0;
+
+    framesize = read_tun_device(device, skt->buf->payload);
+    if (framesize > 0)
+        forward_frame(worker, handlers, framesize);
+
+    /* packets built for other reasons go elsewhere. */
+    skt->buf = buf;
+
+    return framesize > 0;
+}
+
+void receive_controls(struct worker *worker, const struct handlers *handlers)
+{
+    struct control ctl;
+
+    while (pop_control(worker->controls, &ctl) == 0)
+        handlers->control(worker, &ctl);
+}
+
+/* receive from an fd until it is drained or the budget is spent. */
+static inline void drain(int (*receive)(struct worker *, const struct handlers *),
+                         struct worker *worker, const struct handlers *handlers)
+{
+    int budget = ICMPTUNNEL_POLL_BUDGET;
+    int ret;
+
+    while (budget > 0 && __atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        if ((ret = receive(worker, handlers)) <= 0)
+            break;
+        budget -= ret;
+    }
+}
+
+static int watch(int epfd, int fd, unsigned int source)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.u32 = source;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "unable to watch fd %d: %s\n", fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* watch the fds of a worker, tagged with its place among the siblings. */
+static int watch_worker(int epfd, struct worker *worker, unsigned int place)
+{
+    unsigned int tag = place * EVENT_MAX;
+
+    /* the socket is shared, so only the first sibling receives from it. */
+    if ((worker->icmp && place == 0 &&
+         watch(epfd, worker->skt.fd, tag + EVENT_ICMP) < 0) ||
+        (worker->tunnel && watch(epfd, worker->device.fd, tag + EVENT_TUNNEL) < 0) ||
+        (worker->bundle.buf && watch(epfd, worker->bundle.timerfd, tag + EVENT_BUNDLE) < 0) ||
+        (worker->index == 0 && watch(epfd, worker->peer->timers->fd, tag + EVENT_TIMERS) < 0) ||
+        (worker->controls && !worker->icmp &&
+         watch(epfd, worker->controls->fd, tag + EVENT_CONTROL) < 0))
+        return -1;
+
+    return 0;
+}
+
+int forward(struct worker *worker, const struct handlers *handlers)
+{
+    struct epoll_event events[ICMPTUNNEL_POLL_EVENTS];
+    struct worker **siblings, *sibling;
+    unsigned int count = 0, place;
+    struct uring *ring;
+    int epfd, timeout, ret = 0;
+
+    /* use io_uring when asked for and supported by the kernel, it drives
+     * the workers of a single peer only.
+     */
+    if (opts.engine == FORWARD_URING) {
+        if (!worker->sibling && (ring = open_uring(worker)) != NULL) {
+            ret = forward_uring(ring, worker, handlers, &running);
+            close_uring(ring, worker);
+            return ret;
         }
-        /* did we time out? */
-        if (ret == 0) {
-            handlers->timeout(peer);
-            continue;
+
+        fprintf(stderr, "falling back to the epoll forwarding engine.\n");
+    }
+
+    for (sibling = worker; sibling; sibling = sibling->sibling)
+        count++;
+
+    if (!(siblings = malloc(count * sizeof(*siblings)))) {
+        fprintf(stderr, "unable to allocate workers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "unable to create epoll instance: %s\n", strerror(errno));
+        free(siblings);
+        return -1;
+    }
+
+    for (place = 0, sibling = worker; sibling; sibling = sibling->sibling, place++) {
+        siblings[place] = sibling;
+
+        if (watch_worker(epfd, sibling, place) < 0) {
+            ret = -1;
+            goto out;
         }
+    }
 
-        /* handle a packet from the echo socket. */
-        if (FD_ISSET(skt->fd, &fs)) {
-            handlers->icmp(peer);
+    /* loop and push packets between the tunnel devices and peers. */
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        int i, n;
+
+        /* send everything queued during the previous iteration, and let
+         * others see what was counted.
+         */
+        timeout = ICMPTUNNEL_POLL_TIMEOUT;
+
+        for (place = 0; place < count; place++) {
+            sibling = siblings[place];
+
+            /* handle the events of the other direction of the queue
+             * first, which may send queued frames.
+             */
+            if (sibling->controls && !sibling->icmp)
+                receive_controls(sibling, handlers);
+
+            flush_echo(&sibling->skt);
+            flush_tun_device(&sibling->device);
+            publish_stats(&sibling->stats);
+
+            /* tell the other direction of the queue what was posted, or
+             * look again at once should more have been posted to us.
+             */
+            if (sibling->controls && sibling->icmp)
+                kick_control_ring(sibling->controls);
+            else if (sibling->controls && sleep_control_ring(sibling->controls) < 0)
+                timeout = 0;
         }
+        poll_profile();
+
+        /* wait for some data. */
+        n = epoll_wait(epfd, events, ICMPTUNNEL_POLL_EVENTS, timeout);
 
-        /* handle data from the tunnel device. */
-        if (FD_ISSET(device->fd, &fs)) {
-            handlers->tunnel(peer);
+        for (place = 0; place < count; place++) {
+            if (siblings[place]->controls && !siblings[place]->icmp)
+                awake_control_ring(siblings[place]->controls);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "unable to wait for fds: %s\n", strerror(errno));
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            worker = siblings[events[i].data.u32 / EVENT_MAX];
+
+            switch (events[i].data.u32 % EVENT_MAX) {
+            case EVENT_ICMP:
+                /* handle packets from the echo socket. */
+                drain(receive_icmp, worker, handlers);
+                break;
+
+            case EVENT_TUNNEL:
+                /* handle data from the tunnel device. */
+                drain(receive_tunnel, worker, handlers);
+                break;
+
+            case EVENT_BUNDLE:
+                /* send the bundle when its deadline is up. */
+                expire_bundle(&worker->bundle);
+                flush_bundle(worker, handlers);
+                break;
+
+            case EVENT_TIMERS:
+                /* run the timers that are due. */
+                run_timers(worker->peer->timers);
+                break;
+
+            case EVENT_CONTROL:
+                /* handle the events posted while asleep. */
+                clear_control_ring(worker->controls);
+                receive_controls(worker, handlers);
+                break;
+            }
         }
     }
 
-    return 0;
+out:
+    close(epfd);
+    free(siblings);
+    return ret;
 }
 
 void stop()
 {
-    running = 0;
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
 }
@@ -27,11 +27,36 @@
 #ifndef ICMPTUNNEL_FORWARDER_H
 #define ICMPTUNNEL_FORWARDER_H
 
-struct peer;
+struct worker;
 struct handlers;
 
+/* packet forwarding engines. */
+enum FORWARD_ENGINE
+{
+    FORWARD_EPOLL,
+    FORWARD_URING
+};
+
 /* loop and forward packets between the tunnel interface and peer. */
-int forward(struct peer *peer, const struct handlers *handlers);
+int forward(struct worker *worker, const struct handlers *handlers);
+
+/* forward a frame read into the echo payload to its peer, bundling small
+ * ones.
+ */
+void forward_frame(struct worker *worker, const struct handlers *handlers,
+                   int framesize);
+
+/* send the frames bundled so far. */
+void flush_bundle(struct worker *worker, const struct handlers *handlers);
+
+/* split a frame read with a virtio-net header and forward each segment. */
+int forward_gso(struct worker *worker, const struct handlers *handlers,
+                void *frame, int size);
+
+/* handle the control events posted to a worker reading frames from the
+ * tunnel queue.
+ */
+void receive_controls(struct worker *worker, const struct handlers *handlers);
 
 /* stop the forwarding loop. */
 void stop();
@@ -0,0 +1,195 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "timer.h"
+#include "tun-device.h"
+#include "fragment.h"
+
+void open_reassembly(struct reassembly *reasm)
+{
+    pthread_mutex_init(&reasm->lock, NULL);
+    reasm->slots = NULL;
+}
+
+/* find the slot of a frame, or take a free, expired or the oldest one. */
+static struct reasm_slot *lookup(struct reassembly *reasm, uint16_t id,
+                                 uint8_t count, uint64_t stamp)
+{
+    struct reasm_slot *slot, *victim = NULL;
+    unsigned int i;
+
+    if (!reasm->slots &&
+        !(reasm->slots = calloc(ICMPTUNNEL_REASM_SLOTS, sizeof(*reasm->slots))))
+        return NULL;
+
+    for (i = 0; i < ICMPTUNNEL_REASM_SLOTS; i++) {
+        slot = &reasm->slots[i];
+
+        if (slot->used && stamp - slot->stamp > ICMPTUNNEL_REASM_TIMEOUT * 1000)
+            slot->used = 0; /* give up on the lost fragments. */
+
+        if (slot->used && slot->id == id && slot->count == count)
+            return slot;
+
+        if (!victim || (victim->used && (!slot->used || slot->stamp < victim->stamp)))
+            victim = slot;
+    }
+
+    if (!victim->buf && !(victim->buf = malloc(FRAGMENT_MAX_FRAME)))
+        return NULL;
+
+    victim->used = 1;
+    victim->id = id;
+    victim->count = count;
+    victim->received = 0;
+    victim->size = -1;
+    victim->stamp = stamp;
+    memset(victim->have, 0, sizeof(victim->have));
+
+    return victim;
+}
+
+/* do the fragments follow each other in order from the start of the frame
+ * to its end, without gaps or overlaps? anything else would write stale
+ * bytes of an earlier frame.
+ */
+static int tiled(const struct reasm_slot *slot)
+{
+    int i, at = 0;
+
+    for (i = 0; i < slot->count; i++) {
+        if (slot->start[i] != at)
+            return 0;
+        at = slot->end[i];
+    }
+
+    return at == slot->size;
+}
+
+int reassemble(struct reassembly *reasm, struct tun_device *device,
+               const uint8_t *payload, int size)
+{
+    struct fragment_header fh;
+    struct reasm_slot *slot;
+    uint64_t bit;
+    int len, offset, ret = 0;
+
+    if (size <= (int)sizeof(fh))
+        return -1;
+
+    memcpy(&fh, payload, sizeof(fh));
+    payload += sizeof(fh);
+    len = size - sizeof(fh);
+    offset = ntohs(fh.offset);
+
+    if (!fh.count || fh.index >= fh.count || offset + len > FRAGMENT_MAX_FRAME)
+        return -1; /* bad fragment. */
+
+    pthread_mutex_lock(&reasm->lock);
+
+    if (!(slot = lookup(reasm, ntohs(fh.id), fh.count, timer_now()))) {
+        ret = -1;
+        goto out;
+    }
+
+    /* ignore duplicates. */
+    bit = 1ULL << (fh.index % 64);
+    if (slot->have[fh.index / 64] & bit)
+        goto out;
+
+    slot->have[fh.index / 64] |= bit;
+    slot->received++;
+    slot->start[fh.index] = offset;
+    slot->end[fh.index] = offset + len;
+    memcpy(slot->buf + offset, payload, len);
+
+    /* the last fragment tells the size of the frame. */
+    if (fh.index == fh.count - 1)
+        slot->size = offset + len;
+
+    if (slot->received == slot->count) {
+        slot->used = 0;
+
+        if (!tiled(slot)) {
+            ret = -1;
+            goto out;
+        }
+
+        write_tun_device(device, slot->buf, slot->size);
+        ret = slot->size;
+    }
+
+out:
+    pthread_mutex_unlock(&reasm->lock);
+    return ret;
+}
+
+static void free_slots(struct reassembly *reasm)
+{
+    unsigned int i;
+
+    if (!reasm->slots)
+        return;
+
+    for (i = 0; i < ICMPTUNNEL_REASM_SLOTS; i++)
+        free(reasm->slots[i].buf);
+
+    free(reasm->slots);
+    reasm->slots = NULL;
+}
+
+void trim_reassembly(struct reassembly *reasm)
+{
+    uint64_t stamp = timer_now();
+    unsigned int i;
+
+    pthread_mutex_lock(&reasm->lock);
+
+    for (i = 0; reasm->slots && i < ICMPTUNNEL_REASM_SLOTS; i++) {
+        if (reasm->slots[i].used &&
+            stamp - reasm->slots[i].stamp <= ICMPTUNNEL_REASM_TIMEOUT * 1000)
+            break;
+    }
+
+    if (i == ICMPTUNNEL_REASM_SLOTS)
+        free_slots(reasm);
+
+    pthread_mutex_unlock(&reasm->lock);
+}
+
+void close_reassembly(struct reassembly *reasm)
+{
+    free_slots(reasm);
+    pthread_mutex_destroy(&reasm->lock);
+}
@@ -0,0 +1,87 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_FRAGMENT_H
+#define ICMPTUNNEL_FRAGMENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "config.h"
+
+struct tun_device;
+
+/* largest frame that can be reassembled. */
+#define FRAGMENT_MAX_FRAME 0xFFFF
+
+/* max fragments of a frame. */
+#define FRAGMENT_MAX_COUNT 255
+
+struct reasm_slot
+{
+    uint8_t *buf;
+    int size;
+
+    /* frame id and the fragments seen so far. */
+    uint16_t id;
+    uint8_t count;
+    uint8_t received;
+    uint64_t have[(FRAGMENT_MAX_COUNT + 64) / 64];
+
+    /* where each fragment starts and ends, by index. */
+    uint16_t start[FRAGMENT_MAX_COUNT];
+    uint16_t end[FRAGMENT_MAX_COUNT];
+
+    /* when the first fragment arrived, in milliseconds. */
+    uint64_t stamp;
+    unsigned int used:1;
+};
+
+/* frames being reassembled, shared by the workers of a peer. */
+struct reassembly
+{
+    pthread_mutex_t lock;
+
+    /* allocated with the first fragment. */
+    struct reasm_slot *slots;
+};
+
+/* initialize an empty reassembly table. */
+void open_reassembly(struct reassembly *reasm);
+
+/* add a fragment and write the frame to the device once complete,
+ * returns the frame size, 0 if more fragments are needed or -1.
+ */
+int reassemble(struct reassembly *reasm, struct tun_device *device,
+               const uint8_t *payload, int size);
+
+/* free the slots and their buffers once no frame is being reassembled. */
+void trim_reassembly(struct reassembly *reasm);
+
+/* free the reassembly table. */
+void close_reassembly(struct reassembly *reasm);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "checksum.h"
+#include "gso.h"
+
+/* tcp flags only carried by the first or the last segment. */
+#define TCP_FLAGS_LAST  (TH_FIN | TH_PUSH)
+#define TCP_FLAGS_FIRST 0x80 /* cwr */
+
+int gso_start(struct gso_iter *it, void *buf, int size, int mtu)
+{
+    const struct virtio_net_hdr *vh = buf;
+
+    if (size < (int)sizeof(*vh))
+        return -1;
+
+    it->frame = (uint8_t *)buf + sizeof(*vh);
+    it->size = size - sizeof(*vh);
+    it->flags = vh->flags;
+    it->type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    it->csum_start = vh->csum_start;
+    it->csum_offset = vh->csum_offset;
+    it->offset = 0;
+    it->index = 0;
+
+    /* a plain frame is passed on as one segment. */
+    if (it->type == VIRTIO_NET_HDR_GSO_NONE) {
+        it->mss = it->size;
+        it->hdrlen = 0;
+
+        if (it->size > mtu)
+            return -1;
+        if ((it->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+            it->csum_start + it->csum_offset + 2 > it->size)
+            return -1;
+
+        return 0;
+    }
+
+    /* the kernel always asks for the transport checksum on gso frames. */
+    if (!(it->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+        return -1;
+
+    it->l4off = it->csum_start;
+
+    switch (it->type) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        if (it->l4off + (int)sizeof(struct tcphdr) > it->size)
+            return -1;
+        it->hdrlen = it->l4off +
+            ((const struct tcphdr *)(it->frame + it->l4off))->th_off * 4;
+        break;
+
+    case VIRTIO_NET_HDR_GSO_UDP_L4:
+        it->hdrlen = it->l4off + sizeof(struct udphdr);
+        break;
+
+    default:
+        return -1; /* unsupported offload. */
+    }
+
+    it->mss = vh->gso_size;
+
+    if (it->hdrlen > it->size || !it->mss || it->hdrlen + it->mss > mtu)
+        return -1;
+
+    return 0;
+}
+
+/* sum of the ipv4 or ipv6 pseudo header. */
+static uint32_t pseudo_sum(const uint8_t *pkt, int proto, int len)
+{
+    uint32_t sum;
+
+    if ((pkt[0] >> 4) == 4) {
+        const struct iphdr *iph = (const struct iphdr *)pkt;
+        sum = checksum_partial(&iph->saddr, 2 * sizeof(iph->saddr), 0);
+    } else {
+        const struct ip6_hdr *ip6h = (const struct ip6_hdr *)pkt;
+        sum = checksum_partial(&ip6h->ip6_src, 2 * sizeof(ip6h->ip6_src), 0);
+    }
+
+    return sum + htons(proto) + htons(len);
+}
+
+int gso_next(struct gso_iter *it, uint8_t *out)
+{
+    int chunk, size, last, l4len;
+    uint32_t l4sum;
+    uint16_t old, sum;
+
+    if (it->offset >= it->size - it->hdrlen)
+        return 0;
+
+    /* a plain frame only needs its checksum completed, the part it covers
+     * is summed while it is copied.
+     */
+    if (it->type == VIRTIO_NET_HDR_GSO_NONE) {
+        it->offset = it->size;
+
+        if (!(it->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            it->sum = checksum_copy(out, it->frame, it->size, 0);
+            return it->size;
+        }
+
+        memcpy(out, it->frame, it->csum_start);
+        l4sum = checksum_copy(out + it->csum_start, it->frame + it->csum_start,
+                              it->size - it->csum_start, 0);
+
+        /* the field held the pseudo header sum, which the checksum takes
+         * the place of in the sum of the frame.
+         */
+        memcpy(&old, out + it->csum_start + it->csum_offset, sizeof(old));
+        sum = checksum_fold(l4sum);
+        memcpy(out + it->csum_start + it->csum_offset, &sum, sizeof(sum));
+
+        l4sum = checksum_replace(l4sum, checksum_at(old, it->csum_offset),
+                                 checksum_at(sum, it->csum_offset));
+        l4sum = (uint16_t)~checksum_fold(l4sum);
+        it->sum = checksum_partial(out, it->csum_start, checksum_at(l4sum, it->csum_start));
+        return it->size;
+    }
+
+    chunk = it->size - it->hdrlen - it->offset;
+    if (chunk > it->mss)
+        chunk = it->mss;
+
+    last = it->offset + chunk == it->size - it->hdrlen;
+    size = it->hdrlen + chunk;
+    l4len = size - it->l4off;
+
+    /* reuse the headers of the super-frame as a template, and sum the
+     * payload while it is copied, for the transport checksum and that
+     * of the whole segment.
+     */
+    memcpy(out, it->frame, it->hdrlen);
+    l4sum = checksum_copy(out + it->hdrlen, it->frame + it->hdrlen + it->offset, chunk, 0);
+
+    /* fix up the network header. */
+    if ((out[0] >> 4) == 4) {
+        struct iphdr *iph = (struct iphdr *)out;
+
+        iph->tot_len = htons(size);
+        iph->id = htons(ntohs(iph->id) + it->index);
+        iph->check = 0;
+        iph->check = checksum(iph, iph->ihl * 4);
+    } else {
+        struct ip6_hdr *ip6h = (struct ip6_hdr *)out;
+
+        ip6h->ip6_plen = htons(size - sizeof(*ip6h));
+    }
+
+    /* fix up the transport header and checksum. */
+    if (it->type == VIRTIO_NET_HDR_GSO_UDP_L4) {
+        struct udphdr *udph = (struct udphdr *)(out + it->l4off);
+
+        udph->uh_ulen = htons(l4len);
+        udph->uh_sum = 0;
+        udph->uh_sum = checksum_fold(
+            checksum_partial(udph, it->hdrlen - it->l4off,
+                             pseudo_sum(out, IPPROTO_UDP, l4len) +
+                             checksum_at(l4sum, it->hdrlen - it->l4off)));
+        if (!udph->uh_sum)
+            udph->uh_sum = 0xffff;
+    } else {
+        struct tcphdr *th = (struct tcphdr *)(out + it->l4off);
+
+        th->th_seq = htonl(ntohl(th->th_seq) + it->offset);
+        if (!last)
+            th->th_flags &= ~TCP_FLAGS_LAST;
+        if (it->index)
+            th->th_flags &= ~TCP_FLAGS_FIRST;
+
+        th->th_sum = 0;
+        th->th_sum = checksum_fold(
+            checksum_partial(th, it->hdrlen - it->l4off,
+                             pseudo_sum(out, IPPROTO_TCP, l4len) +
+                             checksum_at(l4sum, it->hdrlen - it->l4off)));
+    }
+
+    it->sum = checksum_partial(out, it->hdrlen, checksum_at(l4sum, it->hdrlen));
+
+    it->offset += chunk;
+    it->index++;
+
+    return size;
+}
+
+int gro_check(const void *buf, int size)
+{
+    const uint8_t *frame = buf;
+    const struct iphdr *iph = (const struct iphdr *)frame;
+    const struct tcphdr *th;
+    int hdrlen;
+
+    if (size < (int)(sizeof(*iph) + sizeof(*th)) || iph->version != 4 ||
+        iph->ihl != 5 || iph->protocol != IPPROTO_TCP ||
+        ntohs(iph->tot_len) != size || (ntohs(iph->frag_off) & ~IP_DF))
+        return 0;
+
+    th = (const struct tcphdr *)(frame + sizeof(*iph));
+    hdrlen = sizeof(*iph) + th->th_off * 4;
+
+    /* only plain data segments, pushed ones end a frame. */
+    if (th->th_off < 5 || hdrlen >= size ||
+        (th->th_flags & ~TH_PUSH) != TH_ACK)
+        return 0;
+
+    /* the kernel will not check the checksum of a merged segment. */
+    if (checksum_fold(checksum_partial(th, size - sizeof(*iph),
+                      pseudo_sum(frame, IPPROTO_TCP, size - sizeof(*iph)))))
+        return 0;
+
+    return hdrlen;
+}
+
+int gro_append(struct gro *gro, const void *frame, int size, int hdrlen)
+{
+    const struct iphdr *iph = frame;
+    const struct tcphdr *th = (const struct tcphdr *)(iph + 1);
+    uint8_t *first = gro->buf + sizeof(struct virtio_net_hdr);
+    const struct iphdr *giph = (const struct iphdr *)first;
+    struct tcphdr *gth = (struct tcphdr *)(giph + 1);
+    int len;
+
+    if (!gro->segs || gro->closed)
+        return 0;
+
+    len = size - hdrlen;
+
+    /* same flow, in order, and the same headers apart from the sequence. */
+    if (iph->saddr != giph->saddr || iph->daddr != giph->daddr ||
+        iph->tos != giph->tos || iph->ttl != giph->ttl ||
+        th->th_off != gth->th_off || th->th_sport != gth->th_sport ||
+        th->th_dport != gth->th_dport || th->th_ack != gth->th_ack ||
+        ntohl(th->th_seq) != gro->seq || len > gro->mss ||
+        gro->size + len > 0xFFFF ||
+        memcmp(th + 1, gth + 1, hdrlen - sizeof(*iph) - sizeof(*th)))
+        return 0;
+
+    memcpy(first + gro->size, (const uint8_t *)frame + hdrlen, len);
+    gro->size += len;
+    gro->seq += len;
+    gro->segs++;
+
+    /* keep the latest window, and the push flag of the last segment. */
+    gth->th_win = th->th_win;
+    if (th->th_flags & TH_PUSH) {
+        gth->th_flags |= TH_PUSH;
+        gro->closed = 1;
+    }
+    if (len < gro->mss)
+        gro->closed = 1;
+
+    return 1;
+}
+
+int gro_start(struct gro *gro, const void *frame, int size, int hdrlen)
+{
+    const struct tcphdr *th =
+        (const struct tcphdr *)((const uint8_t *)frame + sizeof(struct iphdr));
+
+    /* nothing will follow a pushed segment. */
+    if (th->th_flags & TH_PUSH)
+        return 0;
+
+    memcpy(gro->buf + sizeof(struct virtio_net_hdr), frame, size);
+    gro->size = size;
+    gro->segs = 1;
+    gro->mss = size - hdrlen;
+    gro->seq = ntohl(th->th_seq) + gro->mss;
+    gro->closed = 0;
+
+    return 1;
+}
+
+int gro_finish(struct gro *gro)
+{
+    struct virtio_net_hdr *vh = (struct virtio_net_hdr *)gro->buf;
+    uint8_t *frame = gro->buf + sizeof(*vh);
+    struct iphdr *iph = (struct iphdr *)frame;
+    struct tcphdr *th = (struct tcphdr *)(iph + 1);
+    int size = gro->size, l4len = size - sizeof(*iph);
+
+    memset(vh, 0, sizeof(*vh));
+
+    if (!gro->segs)
+        return 0;
+
+    /* a lone segment is written untouched. */
+    if (gro->segs > 1) {
+        iph->tot_len = htons(size);
+        iph->check = 0;
+        iph->check = checksum(iph, sizeof(*iph));
+
+        /* leave the pseudo header sum for the kernel to complete. */
+        th->th_sum = ~checksum_fold(pseudo_sum(frame, IPPROTO_TCP, l4len));
+
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vh->hdr_len = sizeof(*iph) + th->th_off * 4;
+        vh->gso_size = gro->mss;
+        vh->csum_start = sizeof(*iph);
+        vh->csum_offset = offsetof(struct tcphdr, th_sum);
+    }
+
+    gro->segs = 0;
+    gro->size = 0;
+
+    return sizeof(*vh) + size;
+}
@@ -0,0 +1,110 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_GSO_H
+#define ICMPTUNNEL_GSO_H
+
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+/* largest frame read from a tunnel device with offloads enabled. */
+#define GSO_MAX_FRAME (sizeof(struct virtio_net_hdr) + 0xFFFF)
+
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+struct gso_iter
+{
+    /* frame following the virtio-net header. */
+    uint8_t *frame;
+    int size;
+
+    /* offload request from the virtio-net header. */
+    uint8_t flags;
+    uint8_t type;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+
+    /* headers copied in front of each segment. */
+    int l4off;
+    int hdrlen;
+    int mss;
+
+    /* payload bytes and segments already produced. */
+    int offset;
+    unsigned int index;
+
+    /* running sum of the last segment, as checksum_partial() adds it. */
+    uint32_t sum;
+};
+
+/* start splitting a frame read with a virtio-net header into segments
+ * of at most mtu bytes.
+ */
+int gso_start(struct gso_iter *it, void *buf, int size, int mtu);
+
+/* write the next segment to out, returns its size or 0 when done. */
+int gso_next(struct gso_iter *it, uint8_t *out);
+
+struct gro
+{
+    /* virtio-net header followed by the coalesced frame. */
+    uint8_t *buf;
+    int size;
+
+    /* segments merged so far and their payload size. */
+    unsigned int segs;
+    int mss;
+
+    /* sequence number expected from the next segment. */
+    uint32_t seq;
+
+    /* a short or pushed segment ends the frame. */
+    unsigned int closed:1;
+};
+
+/* check for a tcpv4 data segment with a valid checksum that may be
+ * coalesced, returns the length of its headers or 0.
+ */
+int gro_check(const void *frame, int size);
+
+/* merge an in-order segment into the frame being coalesced,
+ * returns 1 if it was merged.
+ */
+int gro_append(struct gro *gro, const void *frame, int size, int hdrlen);
+
+/* start coalescing a new frame, returns 1 if the segment was copied in
+ * to be merged with later ones.
+ */
+int gro_start(struct gro *gro, const void *frame, int size, int hdrlen);
+
+/* complete the headers of the coalesced frame and reset, returns the
+ * bytes to write from gro->buf, or 0 if there is nothing to write.
+ */
+int gro_finish(struct gro *gro);
+
+#endif
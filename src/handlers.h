@@ -27,18 +27,29 @@
 #ifndef ICMPTUNNEL_HANDLERS_H
 #define ICMPTUNNEL_HANDLERS_H
 
+struct worker;
 struct peer;
+struct control;
 
 struct handlers
 {
-    /* handle an icmp packet. */
-    void (*icmp)(struct peer *peer);
+    /* handle an icmp packet received into the current buffer. */
+    void (*icmp)(struct worker *worker, int size);
 
-    /* handle data from the tunnel interface. */
-    void (*tunnel)(struct peer *peer);
+    /* send the payload, a frame read from the tunnel interface or a
+     * bundle of them, as a packet of the given type.
+     */
+    void (*tunnel)(struct worker *worker, int pkttype, int size);
 
-    /* handle a timeout. */
-    void (*timeout)(struct peer *peer);
+    /* pick the peer a frame read from the tunnel interface is sent to,
+     * NULL to drop it, or unset if the workers have a single peer.
+     */
+    struct peer *(*route)(struct worker *worker, const void *frame, int size);
+
+    /* handle an event posted by the worker receiving packets for the
+     * queue, or by the timers.
+     */
+    void (*control)(struct worker *worker, const struct control *ctl);
 };
 
 #endif
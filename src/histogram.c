@@ -0,0 +1,69 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include "histogram.h"
+
+uint64_t histogram_value(unsigned int bucket)
+{
+    unsigned int group = bucket / HISTOGRAM_SUB, sub = bucket % HISTOGRAM_SUB;
+
+    if (!group)
+        return sub;
+
+    /* one less than where the next bucket starts. */
+    return ((uint64_t)(HISTOGRAM_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+uint64_t histogram_quantile(const uint64_t *counts, double q)
+{
+    uint64_t total = 0, rank, seen = 0;
+    unsigned int i;
+    double x;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += counts[i];
+
+    if (!total)
+        return 0;
+
+    /* the rank of the value counting from one, rounded up, though not for
+     * the error of a product such as 0.99 * 100.
+     */
+    x = q * total;
+    rank = x;
+    if (x - rank > x * 1e-9)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            break;
+    }
+
+    return histogram_value(i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+}
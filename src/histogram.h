@@ -0,0 +1,69 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_HISTOGRAM_H
+#define ICMPTUNNEL_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* log-linear buckets: values below 2^HISTOGRAM_SUB_BITS each have one,
+ * and every power of two above is split in 2^HISTOGRAM_SUB_BITS, so a
+ * value is known to about 3% at any scale.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+
+/* values up to 2^27, over two minutes in microseconds, larger ones are
+ * counted as the largest.
+ */
+#define HISTOGRAM_BITS 27
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+/* the bucket a value is counted in. */
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+    unsigned int shift;
+
+    if (value >= (1ULL << HISTOGRAM_BITS))
+        value = (1ULL << HISTOGRAM_BITS) - 1;
+
+    if (value < HISTOGRAM_SUB)
+        return value;
+
+    shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB + (value >> shift) - HISTOGRAM_SUB;
+}
+
+/* the largest value counted in a bucket. */
+uint64_t histogram_value(unsigned int bucket);
+
+/* the smallest value at least the fraction q of the counts are at or
+ * below, 0 if there are none.
+ */
+uint64_t histogram_quantile(const uint64_t *counts, double q);
+
+#endif
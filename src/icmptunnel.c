@@ -42,6 +42,12 @@
 #include "options.h"
 #include "forwarder.h"
 #include "echo-skt.h"
+#include "fragment.h"
+#include "protocol.h"
+#include "route.h"
+#include "checksum.h"
+#include "stats.h"
+#include "profile.h"
 
 /* default tunnel mtu in bytes; assume the size of an ethernet frame
  * minus ip, icmp and packet header sizes.
@@ -65,7 +71,8 @@ static void help(const char *program)
 {
     fprintf(stderr,
 "icmptunnel %s.\n"
-"usage: %s [options] -s|server\n\n"
+"usage: %s [options] -s|server\n"
+"       %s stats [pid]\n\n"
 "  -v               print version and exit.\n"
 "  -h               print help and exit.\n"
 "  -u <user>        user to switch after opening tun device and socket.\n"
@@ -76,6 +83,9 @@ static void help(const char *program)
 "                   the default is %i retries.\n"
 "  -m <mtu>         max frame size of the tunnel interface.\n"
 "                   the default tunnel mtu is %i bytes.\n"
+"  -f <size>        largest payload of a single packet, larger frames\n"
+"                   are sent in fragments if the peer supports it.\n"
+"                   the default is %i bytes.\n"
 "  -e               emulate the microsoft ping utility.\n"
 "                   will be negotiated with peer via protocol, default is off.\n"
 "  -d               run in the background as a daemon.\n"
@@ -84,14 +94,45 @@ static void help(const char *program)
 "                   the default is to not use this mode.\n"
 "  -i <id>          set instance id used in ICMP request/reply id field.\n"
 "                   the default is to use generated on startup.\n"
+"                   a server may be given more ids, or a first-last range,\n"
+"                   serving each on a tunnel device of its own.\n"
+"  -E <engine>      packet forwarding engine, epoll or uring.\n"
+"                   the default is epoll.\n"
+"  -q <queues>      open a multi-queue tunnel device and forward each\n"
+"                   queue in a thread of its own pinned to a cpu.\n"
+"                   the default is %i queue.\n"
+"  -p               forward each direction of a queue in a thread of its\n"
+"                   own, one receiving from the socket and one reading\n"
+"                   from the tunnel device.\n"
+"  -g               read large segmentation offload frames from the tunnel\n"
+"                   device and split them into mtu sized packets, and\n"
+"                   merge received tcp segments before writing them.\n"
+"                   the default is off.\n"
+"  -a <usecs>       pack small frames into one packet, sending it when full\n"
+"                   or at most usecs after the first frame.\n"
+"                   the default is to not bundle frames.\n"
+"  -w <window>      max punch-thru packets the client keeps outstanding so\n"
+"                   the server has sequence numbers to reply with, the\n"
+"                   window follows the downstream rate and round trip time.\n"
+"                   the default is %i packets.\n"
+"  -c <clients>     max clients the server accepts at once, each in a\n"
+"                   session of its own sharing the tunnel device, and\n"
+"                   sent the frames for the tunnel address it uses.\n"
+"                   the default is %i client.\n"
+"  -R <net/len:via> send the frames for a network to the client using the\n"
+"                   tunnel address via, can be given up to %i times.\n"
 "  server           run in client-mode, using the server ip/hostname.\n"
+"  stats [pid]      print the packet counters of a running tunnel, or of\n"
+"                   every one.\n"
 "\n"
 "Note that process requires CAP_NET_RAW to open ICMP raw sockets\n"
 "and CAP_NET_ADMIN to manage tun devices. You should run either\n"
 "as root or grant above capabilities (e.g. via POSIX file capabilities)\n"
 "\n",
-            ICMPTUNNEL_VERSION, program, ICMPTUNNEL_USER,
-            ICMPTUNNEL_TIMEOUT, ICMPTUNNEL_RETRIES, ICMPTUNNEL_MTU
+            ICMPTUNNEL_VERSION, program, program, ICMPTUNNEL_USER,
+            ICMPTUNNEL_TIMEOUT, ICMPTUNNEL_RETRIES, ICMPTUNNEL_MTU, ICMPTUNNEL_MTU,
+            ICMPTUNNEL_QUEUES, ICMPTUNNEL_WINDOW, ICMPTUNNEL_CLIENTS,
+            ICMPTUNNEL_MAX_ROUTES
     );
     exit(0);
 }
@@ -129,7 +170,6 @@ static void signalhandler(int sig)
 
 static unsigned int nr_keepalives(const char *s)
 {
-    const unsigned int poll_secs = ICMPTUNNEL_PUNCHTHRU_INTERVAL;
     const unsigned int max_secs = 30;
     unsigned int k = atoi(s);
 
@@ -140,8 +180,7 @@ static unsigned int nr_keepalives(const char *s)
     if (!k || k > max_secs)
         optrange('k', "interval", 1, max_secs);
 
-    /* compiler shall optimize this. */
-    return k / poll_secs + (poll_secs > 1) * (k % poll_secs >= poll_secs / 2);
+    return k;
 }
 
 static unsigned int nr_retries(const char *s)
@@ -158,17 +197,56 @@ static unsigned int nr_retries(const char *s)
     return r;
 }
 
+/* storage for the static routes and instance ids. */
+static struct static_route routes[ICMPTUNNEL_MAX_ROUTES];
+static uint16_t ids[ICMPTUNNEL_MAX_INSTANCES];
+
 struct options opts = {
     ICMPTUNNEL_USER,
     ICMPTUNNEL_TIMEOUT,
     ICMPTUNNEL_RETRIES,
     ICMPTUNNEL_MTU,
+    ICMPTUNNEL_MTU,
     ICMPTUNNEL_EMULATION,
     ICMPTUNNEL_DAEMON,
     255,
     UINT16_MAX + 1,
+    NULL,
+    0,
+    ICMPTUNNEL_ENGINE,
+    ICMPTUNNEL_QUEUES,
+    ICMPTUNNEL_PIPELINE,
+    ICMPTUNNEL_OFFLOAD,
+    ICMPTUNNEL_BUNDLE_DELAY,
+    ICMPTUNNEL_WINDOW,
+    ICMPTUNNEL_CLIENTS,
+    NULL,
+    0,
 };
 
+/* add an instance id, or a first-last range of them. */
+static void add_ids(const char *arg)
+{
+    unsigned long first, last;
+    char *end;
+
+    first = last = strtoul(arg, &end, 10);
+    if (end != arg && *end == '-')
+        last = strtoul(end + 1, &end, 10);
+
+    if (end == arg || *end || first > last || last > UINT16_MAX)
+        optrange('i', "id", 0, UINT16_MAX);
+
+    if (last - first >= ICMPTUNNEL_MAX_INSTANCES - opts.nids)
+        fatal("at most %i ids can be given.\n", ICMPTUNNEL_MAX_INSTANCES);
+
+    while (first <= last)
+        ids[opts.nids++] = first++;
+
+    opts.ids = ids;
+    opts.id = ids[0];
+}
+
 int main(int argc, char *argv[])
 {
     char *program = argv[0];
@@ -178,7 +256,7 @@ int main(int argc, char *argv[])
     /* parse the option arguments. */
     opterr = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "vhu:k:r:m:edst:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "vhu:k:r:m:f:edst:i:E:q:pga:w:c:R:")) != -1) {
         switch (opt) {
         case 'v':
             version();
@@ -200,6 +278,11 @@ int main(int argc, char *argv[])
             if (opts.mtu < ETH_MIN_MTU || opts.mtu > ETH_MAX_MTU)
                 optrange('m', "mtu", ETH_MIN_MTU, ETH_MAX_MTU);
             break;
+        case 'f':
+            opts.payload = atoi(optarg);
+            if (opts.payload < ETH_MIN_MTU || opts.payload > ETH_MAX_MTU)
+                optrange('f', "size", ETH_MIN_MTU, ETH_MAX_MTU);
+            break;
         case 'e':
             opts.emulation = 1;
             break;
@@ -215,9 +298,49 @@ int main(int argc, char *argv[])
                 optrange('t', "hops", 0, 254);
             break;
         case 'i':
-            opts.id = atoi(optarg);
-            if (opts.id > UINT16_MAX)
-                optrange('i', "id", 0, UINT16_MAX);
+            add_ids(optarg);
+            break;
+        case 'E':
+            if (!strcmp(optarg, "epoll"))
+                opts.engine = FORWARD_EPOLL;
+            else if (!strcmp(optarg, "uring"))
+                opts.engine = FORWARD_URING;
+            else
+                fatal("for -E option <engine> must be epoll or uring.\n");
+            break;
+        case 'q':
+            opts.queues = atoi(optarg);
+            if (opts.queues < 1 || opts.queues > ICMPTUNNEL_MAX_QUEUES)
+                optrange('q', "queues", 1, ICMPTUNNEL_MAX_QUEUES);
+            break;
+        case 'p':
+            opts.pipeline = 1;
+            break;
+        case 'g':
+            opts.offload = 1;
+            break;
+        case 'a':
+            opts.bundle = atoi(optarg);
+            if (opts.bundle > ICMPTUNNEL_MAX_BUNDLE_DELAY)
+                optrange('a', "usecs", 0, ICMPTUNNEL_MAX_BUNDLE_DELAY);
+            break;
+        case 'w':
+            opts.window = atoi(optarg);
+            if (opts.window < ICMPTUNNEL_MIN_WINDOW || opts.window > ICMPTUNNEL_MAX_WINDOW)
+                optrange('w', "window", ICMPTUNNEL_MIN_WINDOW, ICMPTUNNEL_MAX_WINDOW);
+            break;
+        case 'c':
+            opts.clients = atoi(optarg);
+            if (opts.clients < 1 || opts.clients > ICMPTUNNEL_MAX_CLIENTS)
+                optrange('c', "clients", 1, ICMPTUNNEL_MAX_CLIENTS);
+            break;
+        case 'R':
+            if (opts.nroutes == ICMPTUNNEL_MAX_ROUTES)
+                fatal("at most %i routes can be given.\n", ICMPTUNNEL_MAX_ROUTES);
+            if (parse_route(optarg, &routes[opts.nroutes]) < 0)
+                fatal("for -R option <%s> must be a network/len:address route.\n", optarg);
+            opts.routes = routes;
+            opts.nroutes++;
             break;
         case '?':
             /* fall-through. */
@@ -231,8 +354,21 @@ int main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
+    /* print the counters of running tunnels. */
+    if (!servermode && argc >= 1 && strcmp(argv[0], "stats") == 0) {
+        if (argc > 2) {
+            fprintf(stderr, "unknown option -- '%s'\n", argv[2]);
+            usage(program);
+        }
+
+        return show_stats(argc > 1 ? argv[1] : NULL) < 0;
+    }
+
     /* if we're running in client mode, parse the server hostname. */
     if (!servermode) {
+        if (opts.nids > 1)
+            fatal("for -i option a client uses a single id.\n");
+
         if (argc < 1) {
             fprintf(stderr, "missing server ip/hostname.\n");
             usage(program);
@@ -249,6 +385,16 @@ int main(int argc, char *argv[])
         usage(program);
     }
 
+    /* a frame may be split in a limited number of fragments. */
+    if (opts.mtu > opts.payload) {
+        unsigned int chunk = opts.payload - sizeof(struct fragment_header);
+
+        if ((opts.mtu + chunk - 1) / chunk > FRAGMENT_MAX_COUNT)
+            fatal("for -f option <size> must be at least %u with a %u byte mtu.\n",
+                  (unsigned int)(opts.mtu / FRAGMENT_MAX_COUNT + 1 +
+                                 sizeof(struct fragment_header)), opts.mtu);
+    }
+
     /* check for non-empty user. */
     if (!*opts.user)
         opts.user = ICMPTUNNEL_USER;
@@ -259,6 +405,9 @@ int main(int argc, char *argv[])
 
     srand(getpid() + (time(NULL) % getppid()));
 
+    init_checksum();
+    init_profile();
+
     if (servermode) {
         /* run the server. */
         return server();
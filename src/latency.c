@@ -0,0 +1,103 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "stats.h"
+#include "timer.h"
+#include "worker.h"
+#include "latency.h"
+
+void receive_timestamp(struct worker *worker, int size)
+{
+    struct peer *peer = worker->peer;
+    struct packet_timestamp stamp;
+    uint64_t arrival, sent, echo, held;
+    int64_t transit, last;
+
+    /* older peers send keep-alives and punch-thrus without one. */
+    if (size < (int)sizeof(stamp.sent))
+        return;
+
+    memset(&stamp, 0, sizeof(stamp));
+    memcpy(&stamp, worker->skt.buf->payload, size < (int)sizeof(stamp) ? size : (int)sizeof(stamp));
+
+    arrival = echo_arrival(&worker->skt);
+    sent = be64toh(stamp.sent);
+
+    /* the clocks of the ends differ by as much as they like, which the
+     * change in transit time from one packet to the next cancels out.
+     */
+    transit = (int64_t)(arrival - sent);
+    last = __atomic_exchange_n(&peer->transit, transit, __ATOMIC_RELAXED);
+    if (last)
+        record_latency(&worker->stats, LATENCY_JITTER,
+                       transit > last ? transit - last : last - transit);
+
+    if (size < (int)sizeof(stamp))
+        return;
+
+    /* send the time back with the next keep-alive, or its reply. */
+    __atomic_store_n(&peer->echo, sent, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->echoed, arrival, __ATOMIC_RELAXED);
+
+    /* the round trip is what the time it echoes took to come back, less
+     * what the peer held it for.
+     */
+    echo = be64toh(stamp.echo);
+    held = ntohl(stamp.held);
+    if (echo && arrival >= echo + held)
+        record_latency(&worker->stats, LATENCY_RTT, arrival - echo - held);
+}
+
+int write_timestamp(struct worker *worker, int keepalive)
+{
+    struct peer *peer = worker->peer;
+    struct packet_timestamp stamp;
+    uint64_t now = timer_now_us(), echo, echoed;
+
+    stamp.sent = htobe64(now);
+
+    if (!keepalive) {
+        memcpy(worker->skt.buf->payload, &stamp.sent, sizeof(stamp.sent));
+        return sizeof(stamp.sent);
+    }
+
+    echo = __atomic_load_n(&peer->echo, __ATOMIC_RELAXED);
+    echoed = __atomic_load_n(&peer->echoed, __ATOMIC_RELAXED);
+
+    stamp.echo = htobe64(echo);
+    stamp.held = htonl(echo && now > echoed ? now - echoed : 0);
+
+    memcpy(worker->skt.buf->payload, &stamp, sizeof(stamp));
+
+    return sizeof(stamp);
+}
@@ -0,0 +1,54 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_LATENCY_H
+#define ICMPTUNNEL_LATENCY_H
+
+#include "peer.h"
+
+struct worker;
+
+/* forget the time stamps of a peer that (re)connects, its clock may have
+ * changed.
+ */
+static inline void reset_latency(struct peer *peer)
+{
+    __atomic_store_n(&peer->echo, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->echoed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->transit, 0, __ATOMIC_RELAXED);
+}
+
+/* record the delay variation, and the round trip of a keep-alive, from
+ * the time stamp in the payload of the current buffer, if it has one.
+ */
+void receive_timestamp(struct worker *worker, int size);
+
+/* write the time stamp of a keep-alive to the payload of the current
+ * buffer, or only the time for a punch-thru, and return its size.
+ */
+int write_timestamp(struct worker *worker, int keepalive);
+
+#endif
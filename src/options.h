@@ -27,12 +27,16 @@
 #ifndef ICMPTUNNEL_OPTIONS_H
 #define ICMPTUNNEL_OPTIONS_H
 
+#include <stdint.h>
+
+struct static_route;
+
 struct options
 {
     /* unprivileged user to switch to. */
     const char *user;
 
-    /* number of poll intervals between keep-alive packets. */
+    /* seconds between keep-alive packets. */
     unsigned int keepalive;
 
     /* number of retries before timing out. */
@@ -41,6 +45,9 @@ struct options
     /* tunnel mtu. */
     unsigned int mtu;
 
+    /* largest payload of a single packet, larger frames are fragmented. */
+    unsigned int payload;
+
     /* enable windows ping emulation. */
     unsigned int emulation;
 
@@ -52,6 +59,35 @@ struct options
 
     /* ICMP Echo Id field for multi-instance. */
     unsigned int id;
+
+    /* ids of the instances a server runs at once, the first is id. */
+    const uint16_t *ids;
+    unsigned int nids;
+
+    /* packet forwarding engine. */
+    unsigned int engine;
+
+    /* tunnel queues, each with its own forwarding thread. */
+    unsigned int queues;
+
+    /* forward each direction of a queue in a thread of its own. */
+    unsigned int pipeline;
+
+    /* read gso super-frames from the tunnel device. */
+    unsigned int offload;
+
+    /* microseconds small frames may wait to be bundled, 0 to disable. */
+    unsigned int bundle;
+
+    /* max unused sequence numbers the server is kept supplied with. */
+    unsigned int window;
+
+    /* max clients connected to the server at once. */
+    unsigned int clients;
+
+    /* networks reached through a client, by its tunnel address. */
+    struct static_route *routes;
+    unsigned int nroutes;
 };
 
 extern struct options opts;
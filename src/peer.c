@@ -0,0 +1,52 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include <pthread.h>
+
+#include "config.h"
+#include "options.h"
+#include "peer.h"
+
+void open_peer(struct peer *peer)
+{
+    /* packets may carry whole frames or up to the payload limit. */
+    int payload = opts.mtu > opts.payload ? opts.mtu : opts.payload;
+
+    peer->nextfrag = 0;
+    peer->payload = opts.payload;
+    pmtu_init(&peer->pmtu, ICMPTUNNEL_PMTU_MIN, opts.payload);
+    window_init(&peer->window, opts.window);
+    pthread_mutex_init(&peer->lock, NULL);
+    open_reassembly(&peer->reasm);
+    open_downstream(&peer->hot->downstream, payload);
+}
+
+void close_peer(struct peer *peer)
+{
+    close_downstream(&peer->hot->downstream);
+    close_reassembly(&peer->reasm);
+    pthread_mutex_destroy(&peer->lock);
+}
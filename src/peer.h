@@ -27,53 +27,132 @@
 #ifndef ICMPTUNNEL_PEER_H
 #define ICMPTUNNEL_PEER_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include "config.h"
-#include "echo-skt.h"
-#include "tun-device.h"
+#include "downstream.h"
+#include "fragment.h"
+#include "pmtu.h"
+#include "timer.h"
+#include "window.h"
+
+struct worker;
+
+/* what the packets of a peer read and write besides its address: the
+ * sequence numbers of its replies, when it was last heard from and its
+ * timers. the sessions of a server keep these in arrays of their own,
+ * apart from the rest of the peer.
+ */
+struct peer_hot
+{
+    /* frames sent to the client. */
+    struct downstream downstream;
+
+    /* client or server in emulation mode sequence numbers. */
+    uint16_t nextseq;
+
+    /* when the peer was last heard from, and keep-alive intervals since. */
+    unsigned int timeouts;
+    uint64_t alive;
+
+    /* timers run by the first worker of the peer. */
+    struct timer keepalive;
+
+    /* frames waiting too long for a sequence number, on the server. */
+    struct timer backlog;
+};
 
 struct peer
 {
-    struct echo_skt skt;
-    struct tun_device device;
+    /* workers forwarding packets for this peer. */
+    struct worker *workers;
+    unsigned int nworkers;
 
     /* link address. */
     uint32_t linkip;
 
+    /* state every packet touches, set before the peer is opened. */
+    struct peer_hot *hot;
+
+    /* timers run by the first worker, shared by peers sharing workers. */
+    struct timer_wheel *timers;
+
     /* next icmp id. */
     uint16_t nextid;
 
+    /* protocol features the peer supports. */
+    uint8_t features;
+
     union {
+        struct {
+            uint16_t emulated;
+#define emulated u1.s.emulated
+        } s;
         struct {
             uint16_t connected;
 #define connected u1.c.connected
+            struct timer tick;
+#define tick u1.c.tick
+
+            /* connection request retransmits, and punch-thrus while the
+             * server has frames waiting.
+             */
+            struct timer retransmit;
+#define retransmit u1.c.retransmit
+            unsigned int backoff;
+#define backoff u1.c.backoff
+            struct timer punchthru;
+#define punchthru u1.c.punchthru
+            unsigned int stalled;
+#define stalled u1.c.stalled
         } c;
-        struct {
-            uint16_t strict_nextid;
-#define strict_nextid u1.s.strict_nextid
-        } s;
     } u1;
 
-    union {
-        struct {
-            /* client or server in emulation mode sequence numbers. */
-            uint16_t nextseq;
-#define nextseq u2.c.nextseq
-        } c;
-        struct {
-            /* punch-thru sequence numbers. */
-            uint16_t punchthru[ICMPTUNNEL_PUNCHTHRU_WINDOW];
-            uint16_t punchthru_idx;
-            uint16_t punchthru_write_idx;
-#define punchthru_idx u2.s.punchthru_idx
-#define punchthru_write_idx u2.s.punchthru_write_idx
-#define punchthru u2.s.punchthru
-        } s;
-    } u2;
+    /* serializes connection state changes between workers. */
+    pthread_mutex_t lock;
 
-    /* number of timeout intervals since last activity. */
-    unsigned int seconds;
-    unsigned int timeouts;
+    /* largest payload sent in one packet, probed by the client. */
+    unsigned int payload;
+    struct pmtu pmtu;
+
+    /* id of the next frame sent in fragments. */
+    uint16_t nextfrag;
+
+    /* frames received in fragments. */
+    struct reassembly reasm;
+
+    /* sequence numbers the server has yet to reply to, as far as the
+     * client knows, and how many it should have.
+     */
+    unsigned int credits;
+    struct window window;
+
+    /* the keep-alive time stamp last received from the peer and when it
+     * arrived, and how much later than stamped the last time stamp
+     * arrived, 0 before the first, in microseconds.
+     */
+    uint64_t echo;
+    uint64_t echoed;
+    int64_t transit;
+
+    /* index in the server session table, and the tunnel address of the
+     * client, registered when it connects or learned from its frames.
+     */
+    uint32_t session;
+    uint32_t addr;
 };
 
+/* initialize the state kept about a peer. */
+void open_peer(struct peer *peer);
+
+/* free the state kept about a peer. */
+void close_peer(struct peer *peer);
+
+/* note activity from the peer, may race with the keep-alive timer. */
+static inline void peer_alive(struct peer *peer)
+{
+    __atomic_store_n(&peer->hot->alive, timer_now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->hot->timeouts, 0, __ATOMIC_RELAXED);
+}
+
 #endif
@@ -0,0 +1,192 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "pktbuf.h"
+
+/* buffers not on the free list of any thread, in slabs that are never
+ * moved, so that io_uring may keep them registered.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    struct pktbuf *free;
+
+    unsigned int stride;
+    unsigned int nslabs;
+    unsigned int users;
+    struct iovec slabs[PKTBUF_MAX_SLABS];
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, { { NULL, 0 } } };
+
+int open_pktbufs(unsigned int size, unsigned int count)
+{
+    struct pktbuf *pkt;
+    unsigned int i;
+    char *slab;
+    int err;
+
+    pthread_mutex_lock(&pool.lock);
+
+    if (!pool.users)
+        pool.stride = (sizeof(*pkt) + size + STATS_ALIGN - 1) & ~(STATS_ALIGN - 1);
+
+    if (sizeof(*pkt) + size > pool.stride) {
+        fprintf(stderr, "unable to allocate packet buffers: larger than the pool holds\n");
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+
+    pool.users++;
+
+    /* slabs are added until there is no room to note them, the buffers
+     * already there being shared by more threads then.
+     */
+    if (pool.nslabs == PKTBUF_MAX_SLABS)
+        goto out;
+
+    if ((err = posix_memalign((void **)&slab, STATS_ALIGN, count * pool.stride)) != 0) {
+        fprintf(stderr, "unable to allocate packet buffers: %s\n", strerror(err));
+        pool.users--;
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        pkt = (struct pktbuf *)(slab + i * pool.stride);
+        pkt->refs = 0;
+        pkt->slab = pool.nslabs;
+        pkt->next = pool.free;
+        pool.free = pkt;
+    }
+
+    pool.slabs[pool.nslabs].iov_base = slab;
+    pool.slabs[pool.nslabs].iov_len = count * pool.stride;
+    pool.nslabs++;
+
+out:
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+struct pktbuf *get_pktbuf(struct pktbuf_cache *cache)
+{
+    struct pktbuf *pkt;
+
+    /* refill the free list with a batch from the pool. */
+    if (!cache->free) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.free && cache->nfree < ICMPTUNNEL_PKTBUF_BATCH) {
+            pkt = pool.free;
+            pool.free = pkt->next;
+            pkt->next = cache->free;
+            cache->free = pkt;
+            cache->nfree++;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    if (!(pkt = cache->free))
+        return NULL;
+
+    cache->free = pkt->next;
+    cache->nfree--;
+
+    pkt->refs = 1;
+    return pkt;
+}
+
+/* give a batch of the free list back to the pool. */
+static void spill_pktbufs(struct pktbuf_cache *cache, unsigned int count)
+{
+    struct pktbuf *pkt;
+
+    pthread_mutex_lock(&pool.lock);
+    while (cache->free && count--) {
+        pkt = cache->free;
+        cache->free = pkt->next;
+        cache->nfree--;
+        pkt->next = pool.free;
+        pool.free = pkt;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void put_pktbuf(struct pktbuf_cache *cache, struct pktbuf *pkt)
+{
+    if (!pkt || __atomic_sub_fetch(&pkt->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    pkt->next = cache->free;
+    cache->free = pkt;
+    cache->nfree++;
+
+    /* keep a batch at hand, and let other threads have the rest. */
+    if (cache->nfree >= 2 * ICMPTUNNEL_PKTBUF_BATCH)
+        spill_pktbufs(cache, ICMPTUNNEL_PKTBUF_BATCH);
+}
+
+void drain_pktbufs(struct pktbuf_cache *cache)
+{
+    spill_pktbufs(cache, cache->nfree);
+}
+
+unsigned int pktbuf_slabs(struct iovec *iovs, unsigned int max)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < pool.nslabs && i < max; i++)
+        iovs[i] = pool.slabs[i];
+    pthread_mutex_unlock(&pool.lock);
+
+    return i;
+}
+
+void close_pktbufs(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool.lock);
+
+    /* the buffers are all back once every socket is closed. */
+    if (pool.users && !--pool.users) {
+        for (i = 0; i < pool.nslabs; i++)
+            free(pool.slabs[i].iov_base);
+
+        pool.free = NULL;
+        pool.nslabs = 0;
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+}
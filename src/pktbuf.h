@@ -0,0 +1,101 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_PKTBUF_H
+#define ICMPTUNNEL_PKTBUF_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "stats.h"
+
+/* slabs the pool is carved into at most. */
+#define PKTBUF_MAX_SLABS 64
+
+/* a fixed-size packet buffer from the pool, starting a cache line, with
+ * its data on the next one. the data holds a whole echo packet, so a frame
+ * read into the payload leaves headroom for the headers in front of it.
+ */
+struct pktbuf
+{
+    /* next on a free list. */
+    struct pktbuf *next;
+
+    /* holders of the buffer, which goes back to a free list with the
+     * last one.
+     */
+    unsigned int refs;
+
+    /* slab the buffer was carved from, registered with io_uring under the
+     * same index.
+     */
+    unsigned int slab;
+
+    uint8_t data[] __attribute__((aligned(STATS_ALIGN)));
+};
+
+/* buffers free for one thread, taken from the pool and given back to it
+ * in batches.
+ */
+struct pktbuf_cache
+{
+    struct pktbuf *free;
+    unsigned int nfree;
+};
+
+/* add a slab of count buffers of size bytes to the pool shared by all
+ * threads, the size being that of the first slab.
+ */
+int open_pktbufs(unsigned int size, unsigned int count);
+
+/* take a buffer with a single holder, NULL if the pool is empty. */
+struct pktbuf *get_pktbuf(struct pktbuf_cache *cache);
+
+/* add a holder to the buffer. */
+static inline void hold_pktbuf(struct pktbuf *pkt)
+{
+    __atomic_add_fetch(&pkt->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* is the buffer held by anyone else? */
+static inline int pktbuf_shared(const struct pktbuf *pkt)
+{
+    return __atomic_load_n(&pkt->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* drop a holder, the buffer going to the free list with the last one. */
+void put_pktbuf(struct pktbuf_cache *cache, struct pktbuf *pkt);
+
+/* give the free list back to the pool. */
+void drain_pktbufs(struct pktbuf_cache *cache);
+
+/* describe the slabs for registering them, returns their number. */
+unsigned int pktbuf_slabs(struct iovec *iovs, unsigned int max);
+
+/* remove a slab, freeing the pool once the last is gone. */
+void close_pktbufs(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include "config.h"
+#include "pmtu.h"
+
+void pmtu_init(struct pmtu *pmtu, unsigned int min, unsigned int max)
+{
+    pmtu->min = min < max ? min : max;
+    pmtu->max = max;
+    pmtu->lo = max;
+    pmtu->hi = max;
+    pmtu->probe = 0;
+    pmtu->wait = 0;
+    pmtu->idle = 0;
+    pmtu->misses = 0;
+    pmtu->searching = 0;
+}
+
+/* probe halfway between the bounds until they are close enough. */
+static unsigned int next_probe(struct pmtu *pmtu)
+{
+    pmtu->wait = 0;
+
+    if (pmtu->hi - pmtu->lo < ICMPTUNNEL_PMTU_STEP) {
+        pmtu->searching = 0;
+        pmtu->probe = 0;
+        pmtu->idle = 0;
+        return 0;
+    }
+
+    pmtu->probe = (pmtu->lo + pmtu->hi + 1) / 2;
+
+    return pmtu->probe;
+}
+
+unsigned int pmtu_start(struct pmtu *pmtu)
+{
+    pmtu->lo = pmtu->min;
+    pmtu->hi = pmtu->max;
+    pmtu->misses = 0;
+    pmtu->searching = 1;
+
+    /* most paths carry the largest payload, so try it first. */
+    pmtu->probe = pmtu->hi;
+    pmtu->wait = 0;
+
+    return pmtu->lo < pmtu->hi ? pmtu->probe : next_probe(pmtu);
+}
+
+unsigned int pmtu_success(struct pmtu *pmtu, unsigned int size)
+{
+    /* ignore replies to probes already given up on. */
+    if (!pmtu->probe || size != pmtu->probe)
+        return 0;
+
+    if (!pmtu->searching) {
+        pmtu->probe = 0;
+        pmtu->misses = 0;
+        return 0;
+    }
+
+    pmtu->lo = size;
+
+    return next_probe(pmtu);
+}
+
+unsigned int pmtu_failure(struct pmtu *pmtu)
+{
+    /* a path that stops carrying the payload found is a black hole. */
+    if (!pmtu->searching) {
+        pmtu->probe = 0;
+
+        if (++pmtu->misses < ICMPTUNNEL_PMTU_MISSES)
+            return 0;
+
+        return pmtu_start(pmtu);
+    }
+
+    pmtu->hi = pmtu->probe - 1;
+
+    return next_probe(pmtu);
+}
+
+unsigned int pmtu_tick(struct pmtu *pmtu)
+{
+    /* has the outstanding probe been lost? */
+    if (pmtu->probe) {
+        if (++pmtu->wait < ICMPTUNNEL_PMTU_WAIT)
+            return 0;
+
+        return pmtu_failure(pmtu);
+    }
+
+    /* check the path still carries the payload found. */
+    if (!pmtu->searching && pmtu->lo > pmtu->min &&
+        ++pmtu->idle >= ICMPTUNNEL_PMTU_CHECK) {
+        pmtu->idle = 0;
+        pmtu->wait = 0;
+        pmtu->probe = pmtu->lo;
+        return pmtu->probe;
+    }
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_PMTU_H
+#define ICMPTUNNEL_PMTU_H
+
+/* search for the largest packet payload the path carries. */
+struct pmtu
+{
+    /* payload known to work, and the largest one that may. */
+    unsigned int lo;
+    unsigned int hi;
+
+    /* bounds a new search starts from. */
+    unsigned int min;
+    unsigned int max;
+
+    /* size of the probe awaiting a reply, and ticks spent waiting. */
+    unsigned int probe;
+    unsigned int wait;
+
+    /* ticks since the path was last checked, and checks lost in a row. */
+    unsigned int idle;
+    unsigned int misses;
+
+    unsigned int searching:1;
+};
+
+/* initialize the search bounds, no probes are sent until started. */
+void pmtu_init(struct pmtu *pmtu, unsigned int min, unsigned int max);
+
+/* start a search, returns the size of the first probe. */
+unsigned int pmtu_start(struct pmtu *pmtu);
+
+/* a probe got a reply, returns the size of the next probe or 0. */
+unsigned int pmtu_success(struct pmtu *pmtu, unsigned int size);
+
+/* the outstanding probe was lost, returns the size of the next probe or 0. */
+unsigned int pmtu_failure(struct pmtu *pmtu);
+
+/* called every tick, returns the size of a probe to send or 0. */
+unsigned int pmtu_tick(struct pmtu *pmtu);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "profile.h"
+#include "timer.h"
+
+#if ICMPTUNNEL_PROFILE
+
+/* the histograms of a thread, in clock ticks. */
+struct profile
+{
+    uint64_t counts[PROFILE_MAX][HISTOGRAM_BUCKETS];
+    struct profile *next;
+};
+
+static const char *const names[PROFILE_MAX] = {
+    [PROFILE_TUN_READ] = "tunnel read",
+    [PROFILE_BUILD] = "echo build",
+    [PROFILE_CHECKSUM] = "checksum",
+    [PROFILE_SEND] = "icmp send",
+    [PROFILE_RECV] = "icmp receive",
+    [PROFILE_CLASSIFY] = "classify",
+    [PROFILE_TUN_WRITE] = "tunnel write",
+};
+
+/* every thread that recorded something, and its own. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile *profiles;
+static __thread struct profile *self;
+
+static volatile sig_atomic_t requested;
+static double ns_per_tick = 1;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+uint64_t profile_clock(void)
+{
+    return timer_now_ns();
+}
+#endif
+
+static struct profile *join_profile(void)
+{
+    struct profile *profile;
+
+    if (!(profile = calloc(1, sizeof(*profile))))
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    profile->next = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&lock);
+
+    return profile;
+}
+
+void profile_record(int stage, uint64_t start)
+{
+    uint64_t *bucket;
+
+    if (!self && !(self = join_profile()))
+        return;
+
+    /* only this thread writes the bucket, a reader sees it before or
+     * after the sample.
+     */
+    bucket = &self->counts[stage][histogram_bucket(profile_clock() - start)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+static void profilehandler(int sig)
+{
+    (void)sig;
+
+    requested = 1;
+}
+
+void init_profile(void)
+{
+    struct timespec pause = { 0, 20000000 };
+    uint64_t ns, ticks;
+
+    /* find out how long a tick of the cycle counter is. */
+    ns = timer_now_ns();
+    ticks = profile_clock();
+    nanosleep(&pause, NULL);
+    ns = timer_now_ns() - ns;
+    ticks = profile_clock() - ticks;
+
+    if (ticks)
+        ns_per_tick = (double)ns / ticks;
+
+    signal(SIGUSR1, profilehandler);
+}
+
+void poll_profile(void)
+{
+    uint64_t counts[HISTOGRAM_BUCKETS], total;
+    const struct profile *profile;
+    unsigned int i, last;
+    int stage;
+
+    if (!requested)
+        return;
+    requested = 0;
+
+    fprintf(stderr, "%-14s %12s %10s %10s %10s %10s\n",
+            "stage (ns)", "count", "p50", "p99", "p999", "max");
+
+    pthread_mutex_lock(&lock);
+
+    for (stage = 0; stage < PROFILE_MAX; stage++) {
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+            counts[i] = 0;
+
+        for (profile = profiles; profile; profile = profile->next)
+            for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+                counts[i] += __atomic_load_n(&profile->counts[stage][i], __ATOMIC_RELAXED);
+
+        for (i = 0, total = 0, last = 0; i < HISTOGRAM_BUCKETS; i++) {
+            total += counts[i];
+            if (counts[i])
+                last = i;
+        }
+
+        fprintf(stderr, "%-14s %12llu %10.0f %10.0f %10.0f %10.0f\n", names[stage],
+                (unsigned long long)total,
+                histogram_quantile(counts, 0.5) * ns_per_tick,
+                histogram_quantile(counts, 0.99) * ns_per_tick,
+                histogram_quantile(counts, 0.999) * ns_per_tick,
+                total ? histogram_value(last) * ns_per_tick : 0.0);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+#endif
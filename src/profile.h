@@ -0,0 +1,91 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_PROFILE_H
+#define ICMPTUNNEL_PROFILE_H
+
+#include <stdint.h>
+#include "config.h"
+
+/* stages of the forwarding path that are timed, system calls once per
+ * call, which may carry a batch of packets, and a packet built with its
+ * checksum.
+ */
+enum
+{
+    PROFILE_TUN_READ,
+    PROFILE_BUILD,
+    PROFILE_CHECKSUM,
+    PROFILE_SEND,
+    PROFILE_RECV,
+    PROFILE_CLASSIFY,
+    PROFILE_TUN_WRITE,
+
+    PROFILE_MAX
+};
+
+#if ICMPTUNNEL_PROFILE
+
+/* ticks of the cycle counter, or nanoseconds of the monotonic clock
+ * where there is none.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define profile_clock() __rdtsc()
+#else
+uint64_t profile_clock(void);
+#endif
+
+/* count the time since start in the histogram of the stage, kept by the
+ * calling thread.
+ */
+void profile_record(int stage, uint64_t start);
+
+/* time the clock and print the histograms on SIGUSR1. */
+void init_profile(void);
+
+/* print the histograms if asked to, called by the forwarding loops. */
+void poll_profile(void);
+
+#define PROFILE_START(start) uint64_t start = profile_clock()
+#define PROFILE_END(stage, start) profile_record(stage, start)
+
+#else
+
+#define PROFILE_START(start) (void)0
+#define PROFILE_END(stage, start) (void)0
+
+static inline void init_profile(void)
+{
+}
+
+static inline void poll_profile(void)
+{
+}
+
+#endif
+
+#endif
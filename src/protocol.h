@@ -40,14 +40,27 @@ enum PACKET_TYPE
     PACKET_SERVER_FULL,
     PACKET_DATA,
     PACKET_PUNCHTHRU,
-    PACKET_KEEP_ALIVE
+    PACKET_KEEP_ALIVE,
+    PACKET_DATA_BUNDLE,
+    PACKET_FRAGMENT,
+    PACKET_PROBE
 };
 
 enum PACKET_FLAGS
 {
     PACKET_F_ICMP_SEQ_EMULATION = (1 << 0),
+    PACKET_F_BUNDLE = (1 << 1),
+    PACKET_F_FRAGMENT = (1 << 2),
+    PACKET_F_PROBE = (1 << 3),
+    PACKET_F_CREDITS = (1 << 4),
 };
 
+/* data packets from the server carry the number of frames waiting for a
+ * sequence number in the top flag bits, rounded up to a power of two.
+ */
+#define PACKET_BACKLOG_SHIFT 5
+#define PACKET_BACKLOG_MAX 7
+
 struct packet_header
 {
     uint8_t magic[sizeof(PACKET_MAGIC_SERVER) - 1];
@@ -55,4 +68,25 @@ struct packet_header
     uint8_t type;
 } __attribute__((packed));
 
+/* keep-alives carry the time they were sent in microseconds of the clock
+ * of the sender, the time last received from the other end and how long
+ * ago that arrived, so each end times the round trip on its own clock.
+ * punch-thrus carry only the time they were sent. big endian.
+ */
+struct packet_timestamp
+{
+    uint64_t sent;
+    uint64_t echo;
+    uint32_t held;
+} __attribute__((packed));
+
+/* precedes each part of a frame too large for a single packet. */
+struct fragment_header
+{
+    uint16_t id;
+    uint16_t offset;
+    uint8_t index;
+    uint8_t count;
+} __attribute__((packed));
+
 #endif
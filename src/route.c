@@ -0,0 +1,278 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "route.h"
+
+static uint32_t route_mask(unsigned int len)
+{
+    return len ? ~0U << (32 - len) : 0;
+}
+
+/* level of the trie a prefix is expanded in. */
+static unsigned int route_level(unsigned int len)
+{
+    return len ? (len - 1) / ROUTE_STRIDE : 0;
+}
+
+/* slot of an address in a node of the given level. */
+static unsigned int route_index(uint32_t addr, unsigned int level)
+{
+    return (addr >> (32 - ROUTE_STRIDE * (level + 1))) & (ROUTE_SLOTS - 1);
+}
+
+int open_routes(struct routes *routes)
+{
+    routes->seq = 0;
+    routes->list = NULL;
+    routes->count = 0;
+    routes->max = 0;
+    routes->retired = NULL;
+    routes->nretired = 0;
+
+    if (!(routes->nodes = calloc(1, sizeof(*routes->nodes)))) {
+        fprintf(stderr, "unable to allocate routes: %s\n", strerror(errno));
+        return -1;
+    }
+
+    routes->nnodes = 1;
+    routes->maxnodes = 1;
+
+    return 0;
+}
+
+/* returns the index of a new empty node, or 0 if out of memory. nodes
+ * are never reused, so those not yet taken are still zeroed.
+ */
+static uint32_t new_node(struct routes *routes)
+{
+    struct route_node *nodes, **retired;
+    unsigned int max = routes->maxnodes * 2;
+
+    /* lookups may be reading the nodes, so they move to a copy. */
+    if (routes->nnodes == routes->maxnodes) {
+        retired = realloc(routes->retired, (routes->nretired + 1) * sizeof(*retired));
+        if (!retired)
+            return 0;
+        routes->retired = retired;
+
+        if (!(nodes = calloc(max, sizeof(*nodes))))
+            return 0;
+
+        memcpy(nodes, routes->nodes, routes->nnodes * sizeof(*nodes));
+        routes->retired[routes->nretired++] = routes->nodes;
+        __atomic_store_n(&routes->nodes, nodes, __ATOMIC_RELEASE);
+        routes->maxnodes = max;
+    }
+
+    return routes->nnodes++;
+}
+
+/* find the node a prefix is expanded in, adding the nodes on the way if
+ * asked, returns -1 if there is none.
+ */
+static int find_node(struct routes *routes, uint32_t prefix, unsigned int len, int add)
+{
+    unsigned int level, idx;
+    uint32_t node = 0, child;
+
+    for (level = 0; level < route_level(len); level++) {
+        idx = route_index(prefix, level);
+
+        if (!(child = routes->nodes[node].slots[idx].child)) {
+            if (!add || !(child = new_node(routes)))
+                return -1;
+
+            /* the nodes may have moved. */
+            __atomic_store_n(&routes->nodes[node].slots[idx].child, child,
+                             __ATOMIC_RELAXED);
+        }
+
+        node = child;
+    }
+
+    return node;
+}
+
+int add_route(struct routes *routes, uint32_t prefix, unsigned int len, uint32_t value)
+{
+    struct route_node *node;
+    struct route *list;
+    unsigned int i, first, n, level = route_level(len);
+    int idx;
+
+    prefix &= route_mask(len);
+
+    if ((idx = find_node(routes, prefix, len, 1)) < 0)
+        return -1;
+
+    /* remember the prefix, or its new value. */
+    for (i = 0; i < routes->count; i++) {
+        if (routes->list[i].prefix == prefix && routes->list[i].len == len)
+            break;
+    }
+
+    if (i == routes->count) {
+        if (routes->count == routes->max) {
+            n = routes->max ? routes->max * 2 : 16;
+            if (!(list = realloc(routes->list, n * sizeof(*list))))
+                return -1;
+
+            routes->list = list;
+            routes->max = n;
+        }
+
+        routes->count++;
+    }
+
+    routes->list[i].prefix = prefix;
+    routes->list[i].len = len;
+    routes->list[i].value = value;
+
+    /* fill the slots the prefix covers, unless a longer one has them. */
+    node = &routes->nodes[idx];
+    n = 1U << (ROUTE_STRIDE * (level + 1) - len);
+    first = route_index(prefix, level) & ~(n - 1);
+
+    write_seqbegin(&routes->seq);
+
+    for (i = first; i < first + n; i++) {
+        if (node->lens[i] <= len) {
+            __atomic_store_n(&node->slots[i].value, value, __ATOMIC_RELAXED);
+            node->lens[i] = len;
+        }
+    }
+
+    write_seqend(&routes->seq);
+
+    return 0;
+}
+
+void del_route(struct routes *routes, uint32_t prefix, unsigned int len, uint32_t value)
+{
+    const struct route *best = NULL, *route;
+    struct route_node *node;
+    unsigned int i, first, n, level = route_level(len);
+    int idx;
+
+    prefix &= route_mask(len);
+
+    for (i = 0; i < routes->count; i++) {
+        route = &routes->list[i];
+        if (route->prefix == prefix && route->len == len && route->value == value)
+            break;
+    }
+
+    if (i == routes->count)
+        return;
+
+    routes->list[i] = routes->list[--routes->count];
+
+    if ((idx = find_node(routes, prefix, len, 0)) < 0)
+        return;
+
+    /* the longest shorter prefix expanded in the same node takes over the
+     * slots, those in nodes above are found on the way down.
+     */
+    for (i = 0; i < routes->count; i++) {
+        route = &routes->list[i];
+
+        if (route->len < len && route_level(route->len) == level &&
+            (prefix & route_mask(route->len)) == route->prefix &&
+            (!best || route->len > best->len))
+            best = route;
+    }
+
+    node = &routes->nodes[idx];
+    n = 1U << (ROUTE_STRIDE * (level + 1) - len);
+    first = route_index(prefix, level) & ~(n - 1);
+
+    write_seqbegin(&routes->seq);
+
+    for (i = first; i < first + n; i++) {
+        if (node->lens[i] == len) {
+            __atomic_store_n(&node->slots[i].value, best ? best->value : 0,
+                             __ATOMIC_RELAXED);
+            node->lens[i] = best ? best->len : 0;
+        }
+    }
+
+    write_seqend(&routes->seq);
+}
+
+int parse_route(const char *arg, struct static_route *route)
+{
+    char buf[sizeof("255.255.255.255/32:255.255.255.255")];
+    char *len, *via, *end;
+    struct in_addr addr;
+    unsigned long n;
+
+    if (strlen(arg) >= sizeof(buf))
+        return -1;
+    strcpy(buf, arg);
+
+    if (!(len = strchr(buf, '/')) || !(via = strchr(len, ':')))
+        return -1;
+    *len++ = '\0';
+    *via++ = '\0';
+
+    n = strtoul(len, &end, 10);
+    if (end == len || *end || n > 32)
+        return -1;
+
+    if (inet_pton(AF_INET, via, &addr) != 1)
+        return -1;
+    route->via = addr.s_addr;
+
+    if (inet_pton(AF_INET, buf, &addr) != 1)
+        return -1;
+    route->prefix = ntohl(addr.s_addr) & route_mask(n);
+    route->len = n;
+
+    return 0;
+}
+
+void close_routes(struct routes *routes)
+{
+    unsigned int i;
+
+    for (i = 0; i < routes->nretired; i++)
+        free(routes->retired[i]);
+
+    free(routes->retired);
+    free(routes->nodes);
+    free(routes->list);
+    routes->retired = NULL;
+    routes->nretired = 0;
+    routes->nodes = NULL;
+    routes->list = NULL;
+}
@@ -0,0 +1,141 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_ROUTE_H
+#define ICMPTUNNEL_ROUTE_H
+
+#include <stdint.h>
+#include "seqlock.h"
+
+/* bits of the address each level of the trie looks at. */
+#define ROUTE_STRIDE 8
+#define ROUTE_SLOTS (1 << ROUTE_STRIDE)
+
+struct route_slot
+{
+    /* value of the longest prefix covering the slot, 0 if none. */
+    uint32_t value;
+
+    /* node of the next level, 0 if none. */
+    uint32_t child;
+};
+
+struct route_node
+{
+    struct route_slot slots[ROUTE_SLOTS];
+
+    /* length of the prefix each slot was expanded from. */
+    uint8_t lens[ROUTE_SLOTS];
+};
+
+struct route
+{
+    uint32_t prefix;
+    unsigned int len;
+    uint32_t value;
+};
+
+/* ipv4 prefixes mapped to values by longest match, in a multibit trie
+ * with prefixes expanded to the stride of the level they end in, so a
+ * lookup reads one slot per level and never allocates. lookups take no
+ * lock and may run while one thread at a time changes the table.
+ */
+struct routes
+{
+    /* changes to the slots, for lookups to retry. */
+    uint32_t seq;
+
+    /* the first node is the root. nodes outgrown are kept until the table
+     * is closed, as lookups may still be reading them.
+     */
+    struct route_node *nodes;
+    unsigned int nnodes;
+    unsigned int maxnodes;
+    struct route_node **retired;
+    unsigned int nretired;
+
+    /* the prefixes added, to restore shorter ones as longer are removed. */
+    struct route *list;
+    unsigned int count;
+    unsigned int max;
+};
+
+/* a network, in host order, routed to the client with a tunnel address,
+ * in network order.
+ */
+struct static_route
+{
+    uint32_t prefix;
+    unsigned int len;
+    uint32_t via;
+};
+
+/* open an empty table. */
+int open_routes(struct routes *routes);
+
+/* map a prefix in host order to a non-zero value, replacing any value it
+ * had, returns -1 if out of memory. changes must be serialized.
+ */
+int add_route(struct routes *routes, uint32_t prefix, unsigned int len, uint32_t value);
+
+/* remove a prefix, if it still maps to the value. */
+void del_route(struct routes *routes, uint32_t prefix, unsigned int len, uint32_t value);
+
+/* find the value of the longest prefix matching an address in host order,
+ * 0 if none does.
+ */
+static inline uint32_t lookup_route(const struct routes *routes, uint32_t addr)
+{
+    const struct route_node *nodes, *node;
+    const struct route_slot *slot;
+    uint32_t value, found, child, start;
+    int shift;
+
+    do {
+        start = read_seqbegin(&routes->seq);
+        nodes = node = __atomic_load_n(&routes->nodes, __ATOMIC_ACQUIRE);
+        value = 0;
+
+        for (shift = 32 - ROUTE_STRIDE; ; shift -= ROUTE_STRIDE) {
+            slot = &node->slots[(addr >> shift) & (ROUTE_SLOTS - 1)];
+            if ((found = __atomic_load_n(&slot->value, __ATOMIC_RELAXED)))
+                value = found;
+            if (!(child = __atomic_load_n(&slot->child, __ATOMIC_RELAXED)))
+                break;
+            node = &nodes[child];
+        }
+    } while (read_seqretry(&routes->seq, start));
+
+    return value;
+}
+
+/* parse a route given as network/len:address, returns -1 if invalid. */
+int parse_route(const char *arg, struct static_route *route);
+
+/* free the table. */
+void close_routes(struct routes *routes);
+
+#endif
@@ -33,54 +33,68 @@
 #include <string.h>
 
 #include "peer.h"
+#include "worker.h"
 #include "options.h"
 #include "echo-skt.h"
 #include "tun-device.h"
 #include "protocol.h"
+#include "bundle.h"
+#include "latency.h"
 #include "server-handlers.h"
 
-static void opts_emulation(const struct peer *client)
+static void check_emulation(const struct worker *worker)
 {
-    uint16_t sequence = client->skt.buf->icmph.un.echo.sequence;
+    struct peer *client = worker->peer;
+    uint16_t sequence = worker->skt.buf->icmph.un.echo.sequence;
     char ip[sizeof("255.255.255.255")];
 
-    if (opts.emulation != 1)
+    if (client->emulated != 1)
         return;
 
     /* first data, keepalive or punchthru (client shouldn't send it) received
      * with unchanged sequence number meaning that client accepted emulation
      * option proposal in connection request: make option immutable.
      */
-    opts.emulation = 2;
+    client->emulated = 2;
 
-    if (client->nextseq == sequence)
+    if (client->hot->nextseq == sequence)
         return;
 
     inet_ntop(AF_INET, &client->linkip, ip, sizeof(ip));
     fprintf(stderr, "turn off microsoft ping emulation mode for %s.\n", ip);
 
-    opts.emulation = 0;
+    client->emulated = 0;
 }
 
-void handle_server_data(struct peer *client, int framesize)
+void handle_server_data(struct worker *worker, int framesize)
 {
-    struct echo_skt *skt = &client->skt;
-    struct tun_device *device = &client->device;
+    struct echo_skt *skt = &worker->skt;
+    struct tun_device *device = &worker->device;
 
     /* determine the size of the encapsulated frame. */
     if (!framesize)
         return;
 
-    /* write the frame to the tunnel interface. */
-    write_tun_device(device, skt->buf->payload, framesize);
+    /* write the frame, or each bundled frame, to the tunnel interface. */
+    if (skt->buf->pkth.type == PACKET_DATA_BUNDLE)
+        unbundle(device, skt->buf->payload, framesize);
+    else if (skt->buf->pkth.type == PACKET_FRAGMENT)
+        reassemble(&worker->peer->reasm, device, skt->buf->payload, framesize);
+    else
+        write_tun_device(device, skt->buf->payload, framesize);
 
     /* save the icmp id and sequence numbers for any return traffic. */
-    handle_punchthru(client);
+    handle_punchthru(worker, 0);
 }
 
-void handle_keep_alive_request(struct peer *client)
+void handle_keep_alive_request(struct worker *worker, int size)
 {
-    struct echo_skt *skt = &client->skt;
+    struct peer *client = worker->peer;
+    struct echo_skt *skt = &worker->skt;
+
+    /* time the request, and stamp the response if the client stamped it. */
+    receive_timestamp(worker, size);
+    size = size >= (int)sizeof(struct packet_timestamp) ? write_timestamp(worker, 1) : 0;
 
     /* write a keep-alive response. */
     struct packet_header *pkth = &skt->buf->pkth;
@@ -89,65 +103,93 @@ void handle_keep_alive_request(struct peer *client)
     pkth->type = PACKET_KEEP_ALIVE;
 
     /* send the response to the client. */
-    send_echo(skt, client->linkip, 0);
+    send_echo(skt, client->linkip, size);
 
-    opts_emulation(client);
+    check_emulation(worker);
 
-    client->seconds = 0;
-    client->timeouts = 0;
+    peer_alive(client);
 }
 
-void handle_connection_request(struct peer *client)
+void handle_connection_request(struct worker *worker)
 {
-    struct echo_skt *skt = &client->skt;
+    struct peer *client = worker->peer;
+    struct echo_skt *skt = &worker->skt;
     uint32_t sourceip = skt->buf->iph.saddr;
     uint32_t id = skt->buf->icmph.un.echo.id;
     char *verdict, ip[sizeof("255.255.255.255")];
 
+    /* keep the requested flags before the response is written over them. */
     struct packet_header *pkth = &skt->buf->pkth;
+    uint8_t flags = pkth->flags;
+
     memcpy(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic));
     pkth->flags = 0;
 
     inet_ntop(AF_INET, &sourceip, ip, sizeof(ip));
 
-    /* is a client already connected? */
-    if (client->linkip && client->linkip != sourceip) {
+    /* is every session taken? */
+    if (!client) {
         pkth->type = PACKET_SERVER_FULL;
         verdict = "ignoring";
     } else {
+        pthread_mutex_lock(&client->lock);
+
         pkth->type = PACKET_CONNECTION_ACCEPT;
         verdict = "accepting";
 
-        if (pkth->flags & PACKET_F_ICMP_SEQ_EMULATION) {
+        if (flags & PACKET_F_ICMP_SEQ_EMULATION) {
             /* client requested: cannot be turned off. */
-            opts.emulation = 2;
+            client->emulated = 2;
         } else if (opts.emulation) {
             /* server requested via command line option: can be turned off. */
             fprintf(stderr, "request microsoft ping emulation on %s.\n", ip);
+            client->emulated = 1;
+        } else {
+            client->emulated = 0;
         }
 
-        if (opts.emulation)
+        if (client->emulated)
             pkth->flags |= PACKET_F_ICMP_SEQ_EMULATION;
 
-        /* store the id number. */
-        if (!client->strict_nextid)
-            client->nextid = id;
+        /* bundles and fragments are sent only to clients that can
+         * put them back together, and probes are answered.
+         */
+        client->features = flags & (PACKET_F_BUNDLE | PACKET_F_FRAGMENT |
+                                    PACKET_F_CREDITS);
+        client->payload = opts.payload;
+        reset_latency(client);
+        pkth->flags |= PACKET_F_BUNDLE | PACKET_F_FRAGMENT | PACKET_F_PROBE |
+                       PACKET_F_CREDITS;
+
+        peer_alive(client);
 
-        client->seconds = 0;
-        client->timeouts = 0;
+        /* better to start with used sequence number until punchthru,
+         * clients that cannot clear a backlog get stale ones rather than wait.
+         */
+        client->hot->nextseq = skt->buf->icmph.un.echo.sequence;
 
-        /* better to start with used sequence number until punchthru. */
-        client->nextseq = skt->buf->icmph.un.echo.sequence;
-        client->punchthru_idx = 0;
-        client->punchthru_write_idx = 0;
-        client->linkip = sourceip;
+        struct control reset = { client, client->nextid, CONTROL_RESET,
+                                 client->hot->nextseq,
+                                 (client->features & PACKET_F_CREDITS) != 0, 0 };
+
+        post_control(worker, &reset);
+
+        /* drop the client once it has been silent for all the retries. */
+        if (opts.retries)
+            add_timer(client->timers, &client->hot->keepalive,
+                      opts.keepalive * 1000 * opts.retries);
+
+        pthread_mutex_unlock(&client->lock);
     }
 
     fprintf(stderr, "%s connection from %s with id %d\n",
             verdict, ip, ntohs(id));
 
+    if (client)
+        filter_client(&worker->skt, client);
+
     /* do not respond to non-client IPs to hide from probes. */
-    if (client->strict_nextid && client->linkip != sourceip)
+    if (!client && opts.id <= UINT16_MAX)
         return;
 
     /* send the response. */
@@ -155,17 +197,82 @@ void handle_connection_request(struct peer *client)
 }
 
 /* handle a punch-thru packet. */
-void handle_punchthru(struct peer *client)
+void handle_punchthru(struct worker *worker, int size)
 {
-    opts_emulation(client);
+    struct peer *client = worker->peer;
 
-    if (!opts.emulation) {
-        /* store the sequence number. */
-        client->punchthru[client->punchthru_write_idx++] =
-            client->skt.buf->icmph.un.echo.sequence;
-        client->punchthru_write_idx %= ICMPTUNNEL_PUNCHTHRU_WINDOW;
+    receive_timestamp(worker, size);
+
+    check_emulation(worker);
+
+    /* reply with a waiting frame or store the sequence number. */
+    if (!client->emulated) {
+        struct control credit = { client, client->nextid, CONTROL_CREDIT,
+                                  worker->skt.buf->icmph.un.echo.sequence, 0, 0 };
+
+        post_control(worker, &credit);
+    }
+
+    peer_alive(client);
+}
+
+void handle_probe(struct worker *worker, int size)
+{
+    struct peer *client = worker->peer;
+    struct packet_header *pkth = &worker->skt.buf->pkth;
+    unsigned int least = opts.mtu / FRAGMENT_MAX_COUNT + 1 + sizeof(struct fragment_header);
+    uint16_t payload;
+
+    /* probes carry the payload limit the client found for the path, no
+     * less than any path carries, nor so little a frame takes more
+     * fragments than can be counted.
+     */
+    if (size >= (int)sizeof(payload)) {
+        memcpy(&payload, worker->skt.buf->payload, sizeof(payload));
+        payload = ntohs(payload);
+
+        if (least < ICMPTUNNEL_PMTU_MIN)
+            least = ICMPTUNNEL_PMTU_MIN;
+        if (payload < least)
+            payload = least;
+
+        __atomic_store_n(&client->payload,
+                         payload < opts.payload ? payload : opts.payload,
+                         __ATOMIC_RELAXED);
+    }
+
+    /* reply with the same size, id and sequence. */
+    memcpy(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic));
+    pkth->flags = 0;
+
+    send_echo(&worker->skt, client->linkip, size);
+
+    peer_alive(client);
+}
+
+void filter_client(struct echo_skt *skt, const struct peer *client)
+{
+    struct echo_filter filter = { PACKET_MAGIC_CLIENT, 0, 0, 1, 0, 0 };
+
+    /* with room for one client only its packets are let through, with
+     * more, or more instances, their sessions are found once the packets
+     * are received.
+     */
+    if (opts.clients > 1 || opts.nids > 1) {
+        filter.anyone = 1;
+    } else if (client) {
+        filter.linkip = client->linkip;
+        filter.id = client->nextid;
+    }
+
+    /* accept packets only for given instance, the ids of more are checked
+     * once the packets are received.
+     */
+    if (opts.nids == 1) {
+        filter.strict = 1;
+        filter.id = htons(opts.id);
     }
 
-    client->seconds = 0;
-    client->timeouts = 0;
+    /* the socket is shared, so this applies to every worker. */
+    filter_echo_skt(skt, &filter);
 }
@@ -27,18 +27,30 @@
 #ifndef ICMPTUNNEL_SERVER_HANDLERS_H
 #define ICMPTUNNEL_SERVER_HANDLERS_H
 
+struct worker;
 struct peer;
+struct echo_skt;
 
 /* handle a data packet. */
-void handle_server_data(struct peer *client, int framesize);
+void handle_server_data(struct worker *worker, int framesize);
 
 /* handle a keep-alive request packet. */
-void handle_keep_alive_request(struct peer *client);
+void handle_keep_alive_request(struct worker *worker, int size);
 
-/* handle a connection request packet. */
-void handle_connection_request(struct peer *client);
+/* handle a connection request packet, for the session of the client
+ * or none if the server is full.
+ */
+void handle_connection_request(struct worker *worker);
 
 /* handle a punch-thru packet. */
-void handle_punchthru(struct peer *client);
+void handle_punchthru(struct worker *worker, int size);
+
+/* handle a path mtu probe packet. */
+void handle_probe(struct worker *worker, int size);
+
+/* let the kernel filter packets for the clients, once the given one is
+ * connected or removed, or NULL for none.
+ */
+void filter_client(struct echo_skt *skt, const struct peer *client);
 
 #endif
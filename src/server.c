@@ -24,8 +24,12 @@
  *  SOFTWARE.
  */
 
+#include <arpa/inet.h>
+
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
@@ -33,6 +37,7 @@
 #include "options.h"
 #include "server.h"
 #include "peer.h"
+#include "worker.h"
 #include "privs.h"
 #include "protocol.h"
 #include "echo-skt.h"
@@ -40,163 +45,369 @@
 #include "handlers.h"
 #include "forwarder.h"
 #include "server-handlers.h"
+#include "session.h"
 
-static void handle_icmp_packet(struct peer *client)
+/* a tunnel served for one icmp id, or for any if none was given, with a
+ * device and clients of its own.
+ */
+struct instance
 {
-    struct echo_skt *skt = &client->skt;
-    int size;
+    /* first, so the workers find their instance. */
+    struct peer host;
+    struct peer_hot hot;
 
-    /* receive the packet. */
-    if ((size = receive_echo(skt)) < 0)
-        return;
+    /* clients connected to the instance. */
+    struct sessions *sessions;
+};
 
-    /* check the header magic. */
-    const struct packet_header *pkth = &skt->buf->pkth;
+/* instances sharing the echo socket, and the one serving each id. */
+static struct instance *instances;
+static unsigned int ninstances;
+static struct instance *by_id[UINT16_MAX + 1];
+
+static struct instance *instance_of(const struct worker *worker)
+{
+    return (struct instance *)worker->host;
+}
+
+/* the frames of a client tell its tunnel address, a bundle by its first. */
+static void learn_address(struct worker *worker, int size)
+{
+    const uint8_t *frame = worker->skt.buf->payload;
 
-    if (memcmp(pkth->magic, PACKET_MAGIC_CLIENT, sizeof(pkth->magic)))
+    if (worker->skt.buf->pkth.type == PACKET_DATA_BUNDLE) {
+        frame += sizeof(uint16_t);
+        size -= sizeof(uint16_t);
+    } else if (worker->skt.buf->pkth.type != PACKET_DATA) {
         return;
+    }
 
-    if (pkth->type == PACKET_CONNECTION_REQUEST) {
-        /* we're only expecting packets with specified id. */
-        if (client->strict_nextid &&
-            client->nextid != skt->buf->icmph.un.echo.id)
-            return;
+    learn_session(instance_of(worker)->sessions, worker->peer, frame, size);
+}
 
-        /* handle a connection request packet. */
-        handle_connection_request(client);
-    } else {
-        /* we're only expecting packets from the client ... */
-        if (!client->linkip || skt->buf->iph.saddr != client->linkip)
-            return;
+static void handle_instance_packet(struct worker *worker, int size)
+{
+    struct sessions *sessions = instance_of(worker)->sessions;
+    struct peer *route = worker->peer;
+    struct echo_skt *skt = &worker->skt;
+    uint32_t sourceip = skt->buf->iph.saddr;
+    uint16_t id = skt->buf->icmph.un.echo.id;
+    const struct packet_header *pkth = &skt->buf->pkth;
 
-        /* ... and with id used during connection request. */
-        if (client->nextid != skt->buf->icmph.un.echo.id)
+    if (pkth->type == PACKET_CONNECTION_REQUEST) {
+        /* handle a connection request packet in the session of the client,
+         * a new one if there is room.
+         */
+        worker->peer = add_session(sessions, sourceip, id);
+        handle_connection_request(worker);
+
+        /* newer clients register their tunnel address. */
+        if (worker->peer && size >= (int)sizeof(uint32_t)) {
+            uint32_t addr;
+
+            memcpy(&addr, skt->buf->payload, sizeof(addr));
+            if (addr)
+                address_session(sessions, worker->peer, addr);
+        }
+    } else {
+        /* we're only expecting packets from clients, with the id used
+         * during connection request.
+         */
+        if (!(worker->peer = find_session(sessions, sourceip, id))) {
+            worker->stats.counts[STAT_DROP_SESSION]++;
+            worker->peer = route;
             return;
+        }
 
         switch (pkth->type) {
+        case PACKET_PROBE:
+            /* handle a path mtu probe. */
+            handle_probe(worker, size);
+            break;
+
         case PACKET_DATA:
-            /* handle a data packet. */
-            handle_server_data(client, size);
+        case PACKET_DATA_BUNDLE:
+        case PACKET_FRAGMENT:
+            /* handle a data packet, once its address is noted as the
+             * buffer may carry a queued frame to the client after.
+             */
+            learn_address(worker, size);
+            handle_server_data(worker, size);
             break;
 
         case PACKET_KEEP_ALIVE:
             /* handle a keep-alive request packet. */
-            handle_keep_alive_request(client);
+            handle_keep_alive_request(worker, size);
             break;
 
         case PACKET_PUNCHTHRU:
             /* handle a punch-thru packet. */
-            handle_punchthru(client);
+            handle_punchthru(worker, size);
             break;
         }
     }
+
+    /* frames read from the tunnel device keep going to their own client. */
+    worker->peer = route;
 }
 
-static void handle_tunnel_data(struct peer *client)
+static void handle_icmp_packet(struct worker *worker, int size)
 {
-    struct echo_skt *skt = &client->skt;
-    struct tun_device *device = &client->device;
-    int framesize;
+    struct echo_skt *skt = &worker->skt;
+    const struct packet_header *pkth = &skt->buf->pkth;
+    struct instance *instance;
+    struct worker *target;
+    struct echo_buf *buf;
 
-    /* read the frame. */
-    if ((framesize = read_tun_device(device, skt->buf->payload)) <= 0)
+    /* check the header magic. */
+    if (memcmp(pkth->magic, PACKET_MAGIC_CLIENT, sizeof(pkth->magic))) {
+        worker->stats.counts[STAT_DROP_MAGIC]++;
         return;
+    }
+
+    /* we're only expecting packets with the ids of the instances. */
+    if (opts.id > UINT16_MAX) {
+        instance = &instances[0];
+    } else if (!(instance = by_id[ntohs(skt->buf->icmph.un.echo.id)])) {
+        worker->stats.counts[STAT_DROP_ID]++;
+        return;
+    }
+
+    /* the worker of the instance with the same index runs in this thread,
+     * so it handles the packet in place.
+     */
+    target = &instance->host.workers[worker->index];
+    if (target == worker) {
+        handle_instance_packet(worker, size);
+        return;
+    }
+
+    buf = target->skt.buf;
+    target->skt.buf = skt->buf;
+    target->skt.rxstamp = skt->rxstamp;
+    handle_instance_packet(target, size);
+    target->skt.buf = buf;
+}
+
+static void handle_tunnel_data(struct worker *worker, int pkttype, int size)
+{
+    struct peer *client = worker->peer;
+    struct echo_skt *skt = &worker->skt;
 
     /* if no client is connected then drop the frame. */
-    if (!client->linkip)
+    if (!client->linkip) {
+        worker->stats.counts[STAT_DROP_UNROUTED]++;
         return;
+    }
 
     /* write a data packet. */
     struct packet_header *pkth = &skt->buf->pkth;
     memcpy(pkth->magic, PACKET_MAGIC_SERVER, sizeof(pkth->magic));
     pkth->flags = 0;
-    pkth->type = PACKET_DATA;
+    pkth->type = pkttype;
 
     /* send the encapsulated frame to the client. */
     struct icmphdr *icmph = &skt->buf->icmph;
     icmph->un.echo.id = client->nextid;
-    if (opts.emulation) {
-        icmph->un.echo.sequence = client->nextseq;
-    } else {
-        icmph->un.echo.sequence = client->punchthru[client->punchthru_idx++];
-        client->punchthru_idx %= ICMPTUNNEL_PUNCHTHRU_WINDOW;
+    if (client->emulated) {
+        icmph->un.echo.sequence = client->hot->nextseq;
+        send_echo(skt, client->linkip, size);
+    } else if (send_downstream(&client->hot->downstream, skt, client->linkip, size) == 1) {
+        /* make sure the frame goes out should the client go quiet. */
+        add_timer(client->timers, &client->hot->backlog, ICMPTUNNEL_DOWNSTREAM_WAIT);
     }
+}
 
-    send_echo(skt, client->linkip, framesize);
+static struct peer *handle_route(struct worker *worker, const void *frame, int size)
+{
+    /* send the frame to the client with its destination address. */
+    return route_session(instance_of(worker)->sessions, frame, size);
 }
 
-static void handle_timeout(struct peer *client)
+static void handle_keepalive_timer(struct timer *timer)
 {
+    struct peer *client = timer->data;
+    uint64_t limit = (uint64_t)opts.keepalive * 1000 * opts.retries, idle;
+    char ip[sizeof("255.255.255.255")];
+    uint32_t linkip = client->linkip;
+
+    if (!linkip)
+        return;
+
+    /* give back the buffers a quiet client no longer needs, the frames
+     * being sent by the thread reading them.
+     */
+    struct control trim = { client, client->nextid, CONTROL_TRIM, 0, 0, 0 };
+
+    post_control(&client->workers[0], &trim);
+    trim_reassembly(&client->reasm);
+
+    /* has the peer been silent for all the retries? */
+    idle = timer_now() - __atomic_load_n(&client->hot->alive, __ATOMIC_RELAXED);
+    if (idle < limit) {
+        add_timer(client->timers, timer, limit - idle);
+        return;
+    }
+
+    inet_ntop(AF_INET, &linkip, ip, sizeof(ip));
+    fprintf(stderr, "connection from %s with id %d timed out.\n",
+            ip, ntohs(client->nextid));
+
+    /* the frames still waiting for the client go nowhere. */
+    del_timer(client->timers, &client->hot->backlog);
+    remove_session(instance_of(&client->workers[0])->sessions, client);
+    filter_client(&client->workers[0].skt, NULL);
+}
+
+static void handle_backlog_timer(struct timer *timer)
+{
+    struct peer *client = timer->data;
+    struct control expire = { client, client->nextid, CONTROL_EXPIRE, 0, 0, 0 };
+
     if (!client->linkip)
         return;
 
-    /* has the peer timeout elapsed? */
-    if (++client->seconds == opts.keepalive) {
-        client->seconds = 0;
+    /* the frames are sent by the thread reading them. */
+    post_control(&client->workers[0], &expire);
+}
 
-        /* have we reached the max number of retries? */
-        if (opts.retries && ++client->timeouts == opts.retries) {
-            fprintf(stderr, "client connection timed out.\n");
+static void handle_control(struct worker *worker, const struct control *ctl)
+{
+    struct peer *client = ctl->peer;
+    struct downstream *ds = &client->hot->downstream;
+    struct echo_skt *skt = &worker->skt;
+    unsigned int wait;
+
+    /* the session may have timed out, or been taken by another client,
+     * since the event was posted.
+     */
+    if (!client->linkip || client->nextid != ctl->id)
+        return;
 
-            client->linkip = 0;
-            return;
-        }
+    switch (ctl->type) {
+    case CONTROL_CREDIT:
+        /* reply with a waiting frame or store the sequence number. */
+        skt->buf->icmph.un.echo.id = client->nextid;
+        credit_downstream(ds, skt, client->linkip, ctl->seq);
+        break;
+
+    case CONTROL_RESET:
+        /* forget the frames and sequence numbers of a previous client. */
+        reset_downstream(ds, ctl->seq, ctl->count);
+        break;
+
+    case CONTROL_EXPIRE:
+        /* send the frames that have waited too long. */
+        wait = expire_downstream(ds, skt, client->linkip, client->nextid);
+        if (wait)
+            add_timer(client->timers, &client->hot->backlog, wait);
+        break;
+
+    case CONTROL_TRIM:
+        /* free the sequence numbers of a quiet client. */
+        trim_downstream(ds);
+        break;
     }
 }
 
 static const struct handlers handlers = {
     handle_icmp_packet,
     handle_tunnel_data,
-    handle_timeout,
+    handle_route,
+    handle_control,
 };
 
 int server(void)
 {
-    struct peer client;
-    struct echo_skt *skt = &client.skt;
-    struct tun_device *device = &client.device;
+    struct instance *instance;
+    unsigned int i, j;
     int ret = 1;
 
-    /* open an echo socket. */
-    if (open_echo_skt(skt, opts.mtu, opts.ttl, 0) < 0)
-        goto err_out;
+    /* an instance for each id given, or one for any id. */
+    ninstances = opts.nids ? opts.nids : 1;
 
-    /* open a tunnel interface. */
-    if (open_tun_device(device, opts.mtu) < 0)
-        goto err_close_skt;
+    if (!(instances = calloc(ninstances, sizeof(*instances)))) {
+        fprintf(stderr, "unable to allocate instances: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < opts.nids; i++) {
+        if (by_id[opts.ids[i]]) {
+            fprintf(stderr, "id %u is given more than once.\n", opts.ids[i]);
+            goto err_close_instances;
+        }
+
+        by_id[opts.ids[i]] = &instances[i];
+    }
+
+    for (i = 0; i < ninstances; i++) {
+        instance = &instances[i];
+        instance->host.hot = &instance->hot;
+
+        /* open a tunnel interface queue per worker, and an echo socket the
+         * other instances share.
+         */
+        if (open_workers(&instance->host, opts.queues, 0, &handlers,
+                         i ? &instances[0].host : NULL) < 0)
+            goto err_close_instances;
+
+        /* each client has a session of its own, sharing the workers and
+         * timers, which the first worker runs.
+         */
+        init_timer(&instance->host.hot->keepalive, handle_keepalive_timer, NULL);
+        init_timer(&instance->host.hot->backlog, handle_backlog_timer, NULL);
+
+        if (!(instance->sessions = open_sessions(&instance->host, opts.clients)))
+            goto err_close_instances;
+
+        /* frames are dropped until a client is connected. */
+        instance->host.linkip = 0;
+        instance->host.features = 0;
+
+        if (ninstances == 1)
+            continue;
+
+        fprintf(stderr, "serving id %u on tunnel device %s.\n", opts.ids[i],
+                instance->host.workers[0].device.name);
+
+        /* the threads of the first instance run the workers of all. */
+        for (j = 0; i > 0 && j < instance->host.nworkers; j++)
+            instances[i - 1].host.workers[j].sibling = &instance->host.workers[j];
+    }
 
     /* drop privileges. */
     if (drop_privs(opts.user) < 0)
-        goto err_close_tun;
+        goto err_close_instances;
 
     /* fork and run as a daemon if needed. */
     if (opts.daemon) {
         if (daemon() != 0)
-            goto err_close_tun;
+            goto err_close_instances;
     }
 
-    /* mark as not connected with client. */
-    client.linkip = 0;
-
-    /* accept packets only for given instance. */
-    if (opts.id > UINT16_MAX) {
-        client.strict_nextid = 0;
-    } else {
-        client.strict_nextid = 1;
-        client.nextid = htons(opts.id);
+    /* publish the counters of every worker, once the pid is final. */
+    if (open_stats(ninstances * instances[0].host.nworkers) == 0) {
+        for (i = 0; i < ninstances; i++) {
+            for (j = 0; j < instances[i].host.nworkers; j++)
+                attach_stats(&instances[i].host.workers[j].stats);
+        }
     }
 
-    /* initialize keepalive seconds and timeout retries. */
-    client.seconds = 0;
-    client.timeouts = 0;
+    /* let the kernel drop everything but tunnel packets. */
+    filter_client(&instances[0].host.workers[0].skt, NULL);
 
-    /* run the packet forwarding loop. */
-    ret = forward(&client, &handlers) < 0;
+    /* run the packet forwarding loops. */
+    if (start_workers(&instances[0].host) == 0)
+        ret = forward(&instances[0].host.workers[0], &handlers) < 0;
+
+err_close_instances:
+    /* the first instance stops the threads running the others. */
+    for (i = 0; i < ninstances; i++) {
+        close_workers(&instances[i].host);
+        close_sessions(instances[i].sessions);
+    }
 
-err_close_tun:
-    close_tun_device(device);
-err_close_skt:
-    close_echo_skt(skt);
-err_out:
+    close_stats();
+    free(instances);
     return ret;
 }
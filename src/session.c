@@ -0,0 +1,513 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <netinet/ip.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "options.h"
+#include "peer.h"
+#include "route.h"
+#include "seqlock.h"
+#include "session.h"
+
+/* what a lookup by link address and id reads, kept apart from the rest of
+ * the session so a chain is walked in one or two cache lines.
+ */
+struct session_key
+{
+    uint32_t linkip;
+    uint16_t id;
+
+    /* index plus one of the next session in the hash chain, or of the next
+     * unused one, zero at the end.
+     */
+    uint32_t next;
+};
+
+/* a hash chain, and the count of changes to it lookups check. */
+struct session_bucket
+{
+    uint32_t seq;
+    uint32_t head;
+};
+
+/* the state packets touch, a cache line or more of its own per session. */
+struct hot_session
+{
+    struct peer_hot hot;
+} __attribute__((aligned(64)));
+
+struct sessions
+{
+    /* serializes changes, lookups take no lock. */
+    pthread_mutex_t lock;
+
+    /* the keys of all sessions, and the sessions themselves in slabs
+     * allocated as the table fills, their hot state in slabs of its own.
+     * a session is opened on first use and kept until the server stops,
+     * so a worker may still hold one after it has been removed.
+     */
+    struct session_key *keys;
+    struct peer **slabs;
+    struct hot_session **hots;
+    unsigned int max;
+    unsigned int count;
+
+    /* sessions removed, and the first never used. */
+    uint32_t unused;
+    unsigned int fresh;
+
+    /* the only client, if there is just one. */
+    struct peer *single;
+
+    /* hash chains, indexed by the top bits of the hash. */
+    struct session_bucket *buckets;
+    unsigned int shift;
+
+    /* chains of the sessions of each link address, by the same bits of
+     * its hash, to find one to take over without a scan of all.
+     */
+    uint32_t *neighbours;
+    uint32_t *byaddr;
+
+    /* tunnel addresses of the clients and the networks behind them, mapped
+     * to the index of the session plus one.
+     */
+    struct routes routes;
+
+    /* peer whose workers and timer callbacks the sessions share. */
+    const struct peer *host;
+};
+
+static unsigned int hash(const struct sessions *sessions, uint32_t a, uint32_t b)
+{
+    return ((a ^ b * 0x9E3779B9U) * 0x85EBCA6BU) >> sessions->shift;
+}
+
+static struct peer *session(const struct sessions *sessions, uint32_t index)
+{
+    return &sessions->slabs[index / ICMPTUNNEL_SESSION_SLAB][index % ICMPTUNNEL_SESSION_SLAB];
+}
+
+static struct peer_hot *session_hot(const struct sessions *sessions, uint32_t index)
+{
+    return &sessions->hots[index / ICMPTUNNEL_SESSION_SLAB][index % ICMPTUNNEL_SESSION_SLAB].hot;
+}
+
+struct sessions *open_sessions(const struct peer *host, unsigned int max)
+{
+    struct sessions *sessions;
+    unsigned int bits = 1, nslabs;
+
+    /* keep the chains short with twice as many buckets as sessions. */
+    while ((1U << bits) < 2 * max)
+        bits++;
+
+    if (!(sessions = calloc(1, sizeof(*sessions)))) {
+        fprintf(stderr, "unable to allocate sessions: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    nslabs = (max + ICMPTUNNEL_SESSION_SLAB - 1) / ICMPTUNNEL_SESSION_SLAB;
+    sessions->keys = calloc(max, sizeof(*sessions->keys));
+    sessions->slabs = calloc(nslabs, sizeof(*sessions->slabs));
+    sessions->hots = calloc(nslabs, sizeof(*sessions->hots));
+    sessions->buckets = calloc(1U << bits, sizeof(*sessions->buckets));
+    sessions->neighbours = calloc(max, sizeof(*sessions->neighbours));
+    sessions->byaddr = calloc(1U << bits, sizeof(*sessions->byaddr));
+
+    if (!sessions->keys || !sessions->slabs || !sessions->hots || !sessions->buckets ||
+        !sessions->neighbours || !sessions->byaddr) {
+        fprintf(stderr, "unable to allocate sessions: %s\n", strerror(errno));
+        goto err_free_sessions;
+    }
+
+    if (open_routes(&sessions->routes) < 0)
+        goto err_free_sessions;
+
+    pthread_mutex_init(&sessions->lock, NULL);
+    sessions->max = max;
+    sessions->count = 0;
+    sessions->unused = 0;
+    sessions->fresh = 0;
+    sessions->single = NULL;
+    sessions->shift = 32 - bits;
+    sessions->host = host;
+
+    return sessions;
+
+err_free_sessions:
+    free(sessions->keys);
+    free(sessions->slabs);
+    free(sessions->hots);
+    free(sessions->buckets);
+    free(sessions->neighbours);
+    free(sessions->byaddr);
+    free(sessions);
+    return NULL;
+}
+
+struct peer *find_session(struct sessions *sessions, uint32_t linkip, uint16_t id)
+{
+    const struct session_bucket *bucket = &sessions->buckets[hash(sessions, linkip, id)];
+    const struct session_key *key;
+    uint32_t next, found, start, steps;
+
+    do {
+        start = read_seqbegin(&bucket->seq);
+        found = 0;
+
+        /* a chain changed meanwhile may lead into others, or around in
+         * circles, until the count tells to look again.
+         */
+        next = __atomic_load_n(&bucket->head, __ATOMIC_RELAXED);
+        for (steps = 0; next && steps < sessions->max; steps++) {
+            key = &sessions->keys[next - 1];
+            if (__atomic_load_n(&key->linkip, __ATOMIC_RELAXED) == linkip &&
+                __atomic_load_n(&key->id, __ATOMIC_RELAXED) == id) {
+                found = next;
+                break;
+            }
+            next = __atomic_load_n(&key->next, __ATOMIC_RELAXED);
+        }
+    } while (read_seqretry(&bucket->seq, start));
+
+    return found ? session(sessions, found - 1) : NULL;
+}
+
+static void update_route(struct sessions *sessions, uint32_t prefix,
+                         unsigned int len, uint32_t handle, int add)
+{
+    if (!add)
+        del_route(&sessions->routes, prefix, len, handle);
+    else if (add_route(&sessions->routes, prefix, len, handle) < 0)
+        fprintf(stderr, "unable to add route: %s\n", strerror(errno));
+}
+
+/* route the tunnel address of a client, and the networks behind it, to its
+ * session or no longer.
+ */
+static void route_peer(struct sessions *sessions, struct peer *peer, int add)
+{
+    uint32_t handle = peer->session + 1;
+    unsigned int i;
+
+    if (!peer->addr)
+        return;
+
+    update_route(sessions, ntohl(peer->addr), 32, handle, add);
+
+    for (i = 0; i < opts.nroutes; i++) {
+        if (opts.routes[i].via == peer->addr)
+            update_route(sessions, opts.routes[i].prefix, opts.routes[i].len,
+                         handle, add);
+    }
+}
+
+/* add a session to the chain of its key and that of its address. */
+static void link_session(struct sessions *sessions, uint32_t index,
+                         uint32_t linkip, uint16_t id)
+{
+    struct session_bucket *bucket = &sessions->buckets[hash(sessions, linkip, id)];
+    struct session_key *key = &sessions->keys[index];
+    uint32_t *byaddr = &sessions->byaddr[hash(sessions, linkip, 0)];
+
+    write_seqbegin(&bucket->seq);
+    __atomic_store_n(&key->linkip, linkip, __ATOMIC_RELAXED);
+    __atomic_store_n(&key->id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&key->next, bucket->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->head, index + 1, __ATOMIC_RELAXED);
+    write_seqend(&bucket->seq);
+
+    sessions->neighbours[index] = *byaddr;
+    *byaddr = index + 1;
+}
+
+static void unlink_session(struct sessions *sessions, uint32_t index)
+{
+    struct session_key *key = &sessions->keys[index];
+    struct session_bucket *bucket = &sessions->buckets[hash(sessions, key->linkip, key->id)];
+    uint32_t *next = &bucket->head;
+    struct peer *peer = session(sessions, index);
+
+    while (*next && *next != index + 1)
+        next = &sessions->keys[*next - 1].next;
+
+    if (*next) {
+        write_seqbegin(&bucket->seq);
+        __atomic_store_n(next, key->next, __ATOMIC_RELAXED);
+        write_seqend(&bucket->seq);
+    }
+
+    next = &sessions->byaddr[hash(sessions, key->linkip, 0)];
+    while (*next && *next != index + 1)
+        next = &sessions->neighbours[*next - 1];
+    if (*next)
+        *next = sessions->neighbours[index];
+
+    route_peer(sessions, peer, 0);
+    __atomic_store_n(&peer->addr, 0, __ATOMIC_RELAXED);
+}
+
+/* take over the longest quiet session of a client from the same address,
+ * returns its index plus one or zero if there is none.
+ */
+static uint32_t evict_session(struct sessions *sessions, uint32_t linkip)
+{
+    uint32_t next, victim = 0;
+    uint64_t alive, oldest = 0;
+
+    for (next = sessions->byaddr[hash(sessions, linkip, 0)]; next;
+         next = sessions->neighbours[next - 1]) {
+        if (sessions->keys[next - 1].linkip != linkip)
+            continue;
+
+        alive = __atomic_load_n(&session_hot(sessions, next - 1)->alive, __ATOMIC_RELAXED);
+        if (!victim || alive < oldest) {
+            victim = next;
+            oldest = alive;
+        }
+    }
+
+    if (victim)
+        unlink_session(sessions, victim - 1);
+
+    return victim;
+}
+
+/* take a session never used before, allocating its slabs first. */
+static uint32_t fresh_session(struct sessions *sessions)
+{
+    unsigned int n = sessions->fresh / ICMPTUNNEL_SESSION_SLAB;
+    struct peer **slab = &sessions->slabs[n];
+    struct hot_session **hots = &sessions->hots[n];
+    int err;
+
+    if (sessions->fresh == sessions->max)
+        return 0;
+
+    if (!*hots) {
+        if ((err = posix_memalign((void **)hots, sizeof(**hots),
+                                  ICMPTUNNEL_SESSION_SLAB * sizeof(**hots))) != 0) {
+            fprintf(stderr, "unable to allocate sessions: %s\n", strerror(err));
+            *hots = NULL;
+            return 0;
+        }
+
+        memset(*hots, 0, ICMPTUNNEL_SESSION_SLAB * sizeof(**hots));
+    }
+
+    if (!*slab && !(*slab = calloc(ICMPTUNNEL_SESSION_SLAB, sizeof(**slab)))) {
+        fprintf(stderr, "unable to allocate sessions: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return ++sessions->fresh;
+}
+
+struct peer *add_session(struct sessions *sessions, uint32_t linkip, uint16_t id)
+{
+    const struct peer *host = sessions->host;
+    const struct session_key *key;
+    struct peer *peer = NULL;
+    uint32_t next;
+
+    pthread_mutex_lock(&sessions->lock);
+
+    next = sessions->buckets[hash(sessions, linkip, id)].head;
+    for (; next; next = key->next) {
+        key = &sessions->keys[next - 1];
+        if (key->linkip == linkip && key->id == id) {
+            /* a client connecting again may have another address. */
+            peer = session(sessions, next - 1);
+            route_peer(sessions, peer, 0);
+            __atomic_store_n(&peer->addr, 0, __ATOMIC_RELAXED);
+            goto out;
+        }
+    }
+
+    if ((next = sessions->unused)) {
+        sessions->unused = sessions->keys[next - 1].next;
+        sessions->count++;
+    } else if ((next = fresh_session(sessions))) {
+        sessions->count++;
+    } else if (!(next = evict_session(sessions, linkip))) {
+        goto out;
+    }
+
+    peer = session(sessions, next - 1);
+
+    /* open the session the first time it is used. */
+    if (!peer->workers) {
+        peer->hot = session_hot(sessions, next - 1);
+        open_peer(peer);
+        peer->workers = host->workers;
+        peer->nworkers = host->nworkers;
+        peer->timers = host->timers;
+        peer->session = next - 1;
+        init_timer(&peer->hot->keepalive, host->hot->keepalive.fn, peer);
+        init_timer(&peer->hot->backlog, host->hot->backlog.fn, peer);
+    }
+
+    peer->linkip = linkip;
+    peer->nextid = id;
+    peer->addr = 0;
+
+    link_session(sessions, next - 1, linkip, id);
+
+    __atomic_store_n(&sessions->single, sessions->count == 1 ? peer : NULL,
+                     __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_unlock(&sessions->lock);
+
+    return peer;
+}
+
+void remove_session(struct sessions *sessions, struct peer *peer)
+{
+    struct session_key *key = &sessions->keys[peer->session];
+    struct peer *single = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&sessions->lock);
+
+    if (!key->linkip)
+        goto out;
+
+    unlink_session(sessions, peer->session);
+    __atomic_store_n(&key->linkip, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&key->next, sessions->unused, __ATOMIC_RELAXED);
+    sessions->unused = peer->session + 1;
+    peer->linkip = 0;
+    sessions->count--;
+
+    /* a single client left gets every frame, as before it was joined. */
+    for (i = 0; sessions->count == 1 && !single; i++) {
+        if (sessions->keys[i].linkip)
+            single = session(sessions, i);
+    }
+
+    __atomic_store_n(&sessions->single, single, __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_unlock(&sessions->lock);
+}
+
+/* is the address free to take, not routed to another session? */
+static int address_free(const struct sessions *sessions, const struct peer *peer,
+                        uint32_t addr)
+{
+    uint32_t handle = lookup_route(&sessions->routes, ntohl(addr));
+
+    return !handle || handle == peer->session + 1;
+}
+
+void address_session(struct sessions *sessions, struct peer *peer, uint32_t addr)
+{
+    /* the address is kept until the client connects again, so frames
+     * from the networks behind it do not move it. nor does a client take
+     * the address of another, which is checked without the lock first as
+     * it is refused again and again.
+     */
+    if (!addr || __atomic_load_n(&peer->addr, __ATOMIC_RELAXED) ||
+        !address_free(sessions, peer, addr))
+        return;
+
+    pthread_mutex_lock(&sessions->lock);
+
+    if (peer->linkip && !peer->addr && address_free(sessions, peer, addr)) {
+        __atomic_store_n(&peer->addr, addr, __ATOMIC_RELAXED);
+        route_peer(sessions, peer, 1);
+    }
+
+    pthread_mutex_unlock(&sessions->lock);
+}
+
+void learn_session(struct sessions *sessions, struct peer *peer,
+                   const uint8_t *frame, int size)
+{
+    const struct iphdr *iph = (const struct iphdr *)frame;
+    uint32_t addr;
+
+    if (size < (int)sizeof(*iph) || iph->version != 4)
+        return;
+
+    memcpy(&addr, &iph->saddr, sizeof(addr));
+    if (addr)
+        address_session(sessions, peer, addr);
+}
+
+struct peer *route_session(struct sessions *sessions, const uint8_t *frame, int size)
+{
+    const struct iphdr *iph = (const struct iphdr *)frame;
+    uint32_t addr, handle = 0;
+
+    if (size >= (int)sizeof(*iph) && iph->version == 4) {
+        memcpy(&addr, &iph->daddr, sizeof(addr));
+        handle = lookup_route(&sessions->routes, ntohl(addr));
+    }
+
+    if (handle)
+        return session(sessions, handle - 1);
+
+    return __atomic_load_n(&sessions->single, __ATOMIC_ACQUIRE);
+}
+
+void close_sessions(struct sessions *sessions)
+{
+    unsigned int i;
+
+    if (!sessions)
+        return;
+
+    for (i = 0; i < sessions->fresh; i++) {
+        if (session(sessions, i)->workers)
+            close_peer(session(sessions, i));
+    }
+
+    for (i = 0; i * ICMPTUNNEL_SESSION_SLAB < sessions->fresh; i++) {
+        free(sessions->slabs[i]);
+        free(sessions->hots[i]);
+    }
+
+    pthread_mutex_destroy(&sessions->lock);
+    close_routes(&sessions->routes);
+    free(sessions->keys);
+    free(sessions->slabs);
+    free(sessions->hots);
+    free(sessions->buckets);
+    free(sessions->neighbours);
+    free(sessions->byaddr);
+    free(sessions);
+}
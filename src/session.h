@@ -0,0 +1,75 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_SESSION_H
+#define ICMPTUNNEL_SESSION_H
+
+#include <stdint.h>
+
+struct peer;
+
+/* clients of the server, each a peer sharing the workers of the host,
+ * found by link address and icmp id, or by the routes to its tunnel
+ * address. finding a session takes no lock, changes are serialized.
+ */
+struct sessions;
+
+/* open a table of up to max sessions, returns NULL on failure. */
+struct sessions *open_sessions(const struct peer *host, unsigned int max);
+
+/* find the session of a client, returns NULL if it has none. */
+struct peer *find_session(struct sessions *sessions, uint32_t linkip, uint16_t id);
+
+/* find the session of a client or add one, once the table is full taking
+ * over the longest quiet session from the same address, a client that was
+ * restarted. the address of the client is forgotten either way. returns
+ * NULL if there is no room.
+ */
+struct peer *add_session(struct sessions *sessions, uint32_t linkip, uint16_t id);
+
+/* remove the session of a client that has gone. */
+void remove_session(struct sessions *sessions, struct peer *peer);
+
+/* set the tunnel address of a client that has none, unless it is routed
+ * to another client, routing it and the networks behind it to the
+ * session.
+ */
+void address_session(struct sessions *sessions, struct peer *peer, uint32_t addr);
+
+/* note the tunnel address of a client without one from a frame it sent. */
+void learn_session(struct sessions *sessions, struct peer *peer,
+                   const uint8_t *frame, int size);
+
+/* find the session a frame read from the tunnel device is sent to by the
+ * longest route matching its destination, or the only one if none does.
+ * returns NULL to drop it.
+ */
+struct peer *route_session(struct sessions *sessions, const uint8_t *frame, int size);
+
+/* close the sessions and free the table. */
+void close_sessions(struct sessions *sessions);
+
+#endif
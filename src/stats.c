@@ -0,0 +1,357 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+#define STATS_DIR "/dev/shm"
+#define STATS_PREFIX "icmptunnel."
+#define STATS_MAGIC "icmptunnel stats"
+#define STATS_TRIES 100000
+
+/* the counters of a worker as last published, consistent whenever the
+ * sequence is even and the same before and after reading them, and its
+ * latency histograms, where a sample changes a single bucket.
+ */
+struct stats_slot
+{
+    uint32_t seq;
+    uint32_t used;
+    uint64_t counts[STAT_MAX];
+    uint64_t latency[LATENCY_MAX][HISTOGRAM_BUCKETS];
+} __attribute__((aligned(STATS_ALIGN)));
+
+struct stats_region
+{
+    char magic[sizeof(STATS_MAGIC)];
+    uint32_t nstats;
+    uint32_t nbuckets;
+    uint32_t nslots;
+    struct stats_slot slots[];
+};
+
+static const char *const names[STAT_MAX] = {
+    [STAT_ICMP_RX_PACKETS] = "icmp packets received",
+    [STAT_ICMP_RX_BYTES] = "icmp bytes received",
+    [STAT_ICMP_TX_PACKETS] = "icmp packets sent",
+    [STAT_ICMP_TX_BYTES] = "icmp bytes sent",
+    [STAT_ICMP_TX_ERRORS] = "icmp send errors",
+    [STAT_TUN_RX_FRAMES] = "frames read from tunnel",
+    [STAT_TUN_RX_BYTES] = "bytes read from tunnel",
+    [STAT_TUN_TX_FRAMES] = "frames written to tunnel",
+    [STAT_TUN_TX_BYTES] = "bytes written to tunnel",
+    [STAT_TUN_TX_ERRORS] = "tunnel write errors",
+    [STAT_DROP_SIZE] = "dropped, too short",
+    [STAT_DROP_TTL] = "dropped, too many hops",
+    [STAT_DROP_SOURCE] = "dropped, unexpected source",
+    [STAT_DROP_TYPE] = "dropped, not an echo",
+    [STAT_DROP_CODE] = "dropped, bad icmp code",
+    [STAT_DROP_MAGIC] = "dropped, bad magic",
+    [STAT_DROP_ID] = "dropped, unknown id",
+    [STAT_DROP_SESSION] = "dropped, unknown client",
+    [STAT_DROP_UNROUTED] = "dropped, frame without peer",
+    [STAT_DROP_OVERSIZE] = "dropped, frame too large to fragment",
+    [STAT_DROP_NOBUF] = "dropped, out of packet buffers",
+    [STAT_DROP_KERNEL] = "dropped by kernel, socket full",
+};
+
+static const char *const latency_names[LATENCY_MAX] = {
+    [LATENCY_RTT] = "round trip",
+    [LATENCY_JITTER] = "delay variation",
+};
+
+/* the quantiles shown of each latency. */
+static const struct
+{
+    const char *name;
+    double q;
+} quantiles[] = {
+    { "p50", 0.5 },
+    { "p99", 0.99 },
+    { "p999", 0.999 },
+};
+
+static struct stats_region *region;
+static size_t region_size;
+static unsigned int nattached;
+static char path[64];
+
+int open_stats(unsigned int nslots)
+{
+    int fd;
+
+    snprintf(path, sizeof(path), STATS_DIR "/" STATS_PREFIX "%d", (int)getpid());
+    region_size = sizeof(*region) + nslots * sizeof(region->slots[0]);
+
+    /* readable by anyone, written by us only. the file is always a new
+     * one, a leftover of a process with the same pid is removed first,
+     * and nothing planted in its place is followed.
+     */
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST && unlink(path) == 0)
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "unable to create statistics in %s: %s\n", path, strerror(errno));
+        goto err_out;
+    }
+
+    if (ftruncate(fd, region_size) < 0) {
+        fprintf(stderr, "unable to size statistics: %s\n", strerror(errno));
+        goto err_unlink;
+    }
+
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "unable to map statistics: %s\n", strerror(errno));
+        region = NULL;
+        goto err_unlink;
+    }
+
+    close(fd);
+
+    memcpy(region->magic, STATS_MAGIC, sizeof(region->magic));
+    region->nstats = STAT_MAX;
+    region->nbuckets = HISTOGRAM_BUCKETS;
+    region->nslots = nslots;
+    nattached = 0;
+
+    return 0;
+
+err_unlink:
+    close(fd);
+    unlink(path);
+err_out:
+    path[0] = 0;
+    return -1;
+}
+
+void attach_stats(struct stats *stats)
+{
+    stats->slot = NULL;
+
+    if (!region || nattached == region->nslots)
+        return;
+
+    stats->slot = &region->slots[nattached++];
+    stats->slot->used = 1;
+}
+
+void publish_stats(struct stats *stats)
+{
+    struct stats_slot *slot = stats->slot;
+    uint32_t seq;
+    int i;
+
+    if (!slot)
+        return;
+
+    /* an odd sequence tells readers to wait for the update. */
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (i = 0; i < STAT_MAX; i++)
+        __atomic_store_n(&slot->counts[i], stats->counts[i], __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void record_latency(struct stats *stats, int latency, uint64_t usecs)
+{
+    uint64_t *bucket;
+
+    if (!stats->slot)
+        return;
+
+    /* only this thread writes the slot, readers see the count before or
+     * after the sample.
+     */
+    bucket = &stats->slot->latency[latency][histogram_bucket(usecs)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+void close_stats(void)
+{
+    if (region)
+        munmap(region, region_size);
+    region = NULL;
+
+    if (path[0])
+        unlink(path);
+    path[0] = 0;
+}
+
+/* take a consistent copy of the counters in a slot, or the last try if
+ * the writer died in the middle of an update.
+ */
+static void read_slot(const struct stats_slot *slot, uint64_t *counts)
+{
+    unsigned int tries = 0;
+    uint32_t seq;
+    int i;
+
+    do {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < STAT_MAX; i++)
+            counts[i] = __atomic_load_n(&slot->counts[i], __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (((seq & 1) || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) &&
+             ++tries < STATS_TRIES);
+}
+
+static int show_region(const char *name)
+{
+    const struct stats_region *shared;
+    uint64_t totals[STAT_MAX], counts[STAT_MAX];
+    uint64_t latency[LATENCY_MAX][HISTOGRAM_BUCKETS], samples;
+    char file[sizeof(STATS_DIR) + 1 + NAME_MAX + 1], label[64];
+    unsigned int i, k, nthreads = 0;
+    struct stat st;
+    int fd, j;
+
+    snprintf(file, sizeof(file), STATS_DIR "/%s", name);
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "unable to open statistics in %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*shared)) {
+        fprintf(stderr, "no statistics in %s.\n", file);
+        close(fd);
+        return -1;
+    }
+
+    shared = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "unable to map statistics in %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if (memcmp(shared->magic, STATS_MAGIC, sizeof(shared->magic)) ||
+        shared->nstats != STAT_MAX || shared->nbuckets != HISTOGRAM_BUCKETS ||
+        sizeof(*shared) + shared->nslots * sizeof(shared->slots[0]) > (size_t)st.st_size) {
+        fprintf(stderr, "statistics in %s are from another version.\n", file);
+        munmap((void *)shared, st.st_size);
+        return -1;
+    }
+
+    memset(totals, 0, sizeof(totals));
+    memset(latency, 0, sizeof(latency));
+
+    /* add up the workers, every one of them sees the same socket total. */
+    for (i = 0; i < shared->nslots; i++) {
+        if (!shared->slots[i].used)
+            continue;
+
+        read_slot(&shared->slots[i], counts);
+        nthreads++;
+
+        for (j = 0; j < STAT_MAX; j++) {
+            if (j == STAT_DROP_KERNEL)
+                totals[j] = counts[j] > totals[j] ? counts[j] : totals[j];
+            else
+                totals[j] += counts[j];
+        }
+
+        for (j = 0; j < LATENCY_MAX; j++)
+            for (k = 0; k < HISTOGRAM_BUCKETS; k++)
+                latency[j][k] += __atomic_load_n(&shared->slots[i].latency[j][k], __ATOMIC_RELAXED);
+    }
+
+    munmap((void *)shared, st.st_size);
+
+    printf("icmptunnel %s, %u worker%s:\n", name + sizeof(STATS_PREFIX) - 1, nthreads,
+        nthreads == 1 ? "" : "s");
+    for (j = 0; j < STAT_MAX; j++)
+        printf("  %-32s %llu\n", names[j], (unsigned long long)totals[j]);
+
+    for (j = 0; j < LATENCY_MAX; j++) {
+        for (k = 0, samples = 0; k < HISTOGRAM_BUCKETS; k++)
+            samples += latency[j][k];
+
+        snprintf(label, sizeof(label), "%s samples", latency_names[j]);
+        printf("  %-32s %llu\n", label, (unsigned long long)samples);
+
+        for (k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]); k++) {
+            snprintf(label, sizeof(label), "%s %s (us)", latency_names[j], quantiles[k].name);
+            printf("  %-32s %llu\n", label,
+                   (unsigned long long)histogram_quantile(latency[j], quantiles[k].q));
+        }
+    }
+
+    return 0;
+}
+
+int show_stats(const char *pid)
+{
+    char name[sizeof(STATS_PREFIX) + 16];
+    struct dirent *entry;
+    DIR *dir;
+    int ret = -1;
+
+    if (pid) {
+        snprintf(name, sizeof(name), STATS_PREFIX "%s", pid);
+        return show_region(name);
+    }
+
+    if (!(dir = opendir(STATS_DIR))) {
+        fprintf(stderr, "unable to list %s: %s\n", STATS_DIR, strerror(errno));
+        return -1;
+    }
+
+    /* every running tunnel has a segment of its own. */
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, STATS_PREFIX, sizeof(STATS_PREFIX) - 1))
+            continue;
+
+        if (show_region(entry->d_name) == 0)
+            ret = 0;
+    }
+
+    closedir(dir);
+
+    if (ret < 0)
+        fprintf(stderr, "no running icmptunnel found.\n");
+
+    return ret;
+}
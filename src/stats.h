@@ -0,0 +1,113 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_STATS_H
+#define ICMPTUNNEL_STATS_H
+
+#include <stdint.h>
+#include "histogram.h"
+
+/* what the counters count, per direction and per reason for dropping. */
+enum
+{
+    STAT_ICMP_RX_PACKETS,
+    STAT_ICMP_RX_BYTES,
+    STAT_ICMP_TX_PACKETS,
+    STAT_ICMP_TX_BYTES,
+    STAT_ICMP_TX_ERRORS,
+    STAT_TUN_RX_FRAMES,
+    STAT_TUN_RX_BYTES,
+    STAT_TUN_TX_FRAMES,
+    STAT_TUN_TX_BYTES,
+    STAT_TUN_TX_ERRORS,
+    STAT_DROP_SIZE,
+    STAT_DROP_TTL,
+    STAT_DROP_SOURCE,
+    STAT_DROP_TYPE,
+    STAT_DROP_CODE,
+    STAT_DROP_MAGIC,
+    STAT_DROP_ID,
+    STAT_DROP_SESSION,
+    STAT_DROP_UNROUTED,
+    STAT_DROP_OVERSIZE,
+    STAT_DROP_NOBUF,
+
+    /* packets the kernel dropped with the socket queue full, a total of
+     * the socket rather than a count of the thread.
+     */
+    STAT_DROP_KERNEL,
+
+    STAT_MAX
+};
+
+/* what the latency histograms are of, in microseconds. */
+enum
+{
+    LATENCY_RTT,
+    LATENCY_JITTER,
+
+    LATENCY_MAX
+};
+
+struct stats_slot;
+
+/* cache line size, keeping the counters of threads apart. */
+#define STATS_ALIGN 64
+
+/* counters of a worker, only ever written by the thread running it, and
+ * published for other processes to read now and then.
+ */
+struct stats
+{
+    uint64_t counts[STAT_MAX];
+    struct stats_slot *slot;
+} __attribute__((aligned(STATS_ALIGN)));
+
+/* create a shared memory segment with room for the counters of nslots
+ * workers, named after the process.
+ */
+int open_stats(unsigned int nslots);
+
+/* give the counters a slot in the segment, if there is one. */
+void attach_stats(struct stats *stats);
+
+/* copy the counters to their slot. */
+void publish_stats(struct stats *stats);
+
+/* count a latency in its histogram, samples being few it goes to the
+ * slot at once, if there is one.
+ */
+void record_latency(struct stats *stats, int latency, uint64_t usecs);
+
+/* remove the segment. */
+void close_stats(void);
+
+/* print the counters of the process with the pid, or of every process
+ * if null.
+ */
+int show_stats(const char *pid);
+
+#endif
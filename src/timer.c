@@ -0,0 +1,271 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_BITS)
+#define SLOT(t, level) (((t) >> LEVEL_SHIFT(level)) & (TIMER_SLOTS - 1))
+
+/* furthest deadline the wheel can hold. */
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+uint64_t timer_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t timer_now(void)
+{
+    return timer_now_ns() / 1000000;
+}
+
+uint64_t timer_now_us(void)
+{
+    return timer_now_ns() / 1000;
+}
+
+void init_timer(struct timer *timer, void (*fn)(struct timer *), void *data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+int open_timers(struct timer_wheel *wheel)
+{
+    memset(wheel->pending, 0, sizeof(wheel->pending));
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = timer_now();
+    wheel->armed = 0;
+
+    if ((wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "unable to create timer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_init(&wheel->lock, NULL);
+
+    return 0;
+}
+
+static void unlink_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+    if ((*timer->pprev = timer->next))
+        timer->next->pprev = timer->pprev;
+
+    if (!wheel->slots[timer->level][timer->slot])
+        wheel->pending[timer->level] &= ~(1ULL << timer->slot);
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* put the timer in the slot of the lowest level that reaches its deadline. */
+static void place(struct timer_wheel *wheel, struct timer *timer)
+{
+    uint64_t delta = timer->expires > wheel->now ? timer->expires - wheel->now : 0;
+    struct timer **head;
+
+    if (delta > MAX_DELTA)
+        timer->expires = wheel->now + (delta = MAX_DELTA);
+
+    timer->level = 0;
+    while (timer->level < TIMER_LEVELS - 1 && delta >> LEVEL_SHIFT(timer->level + 1))
+        timer->level++;
+
+    /* anything overdue runs with the next millisecond. */
+    timer->slot = SLOT(delta ? timer->expires : wheel->now, timer->level);
+
+    head = &wheel->slots[timer->level][timer->slot];
+    if ((timer->next = *head))
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+
+    wheel->pending[timer->level] |= 1ULL << timer->slot;
+}
+
+/* move the timers of the current slot of a level to the levels below,
+ * returns the slot so the caller knows when the level turned.
+ */
+static unsigned int cascade(struct timer_wheel *wheel, unsigned int level)
+{
+    unsigned int slot = SLOT(wheel->now, level);
+    struct timer *timer;
+
+    while ((timer = wheel->slots[level][slot])) {
+        unlink_timer(wheel, timer);
+        place(wheel, timer);
+    }
+
+    return slot;
+}
+
+static uint64_t rotate(uint64_t bits, unsigned int n)
+{
+    return n ? bits >> n | bits << (64 - n) : bits;
+}
+
+/* the earliest time a timer may be due, a slot of a level above the
+ * first one is only reached when the levels below turn.
+ */
+static uint64_t next_expiry(const struct timer_wheel *wheel)
+{
+    uint64_t next = 0, start, t;
+    unsigned int level, shift;
+
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        if (!wheel->pending[level])
+            continue;
+
+        shift = LEVEL_SHIFT(level);
+        start = (wheel->now + (1ULL << shift) - 1) >> shift << shift;
+
+        t = start + ((uint64_t)__builtin_ctzll(rotate(wheel->pending[level],
+                                                      SLOT(start, level))) << shift);
+        if (!next || t < next)
+            next = t;
+    }
+
+    return next;
+}
+
+/* set the timerfd for the earliest timer, if it changed. */
+static void rearm(struct timer_wheel *wheel)
+{
+    uint64_t next = next_expiry(wheel);
+    struct itimerspec its;
+
+    if (next == wheel->armed)
+        return;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next / 1000;
+    its.it_value.tv_nsec = next % 1000 * 1000000;
+
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        fprintf(stderr, "unable to set timer: %s\n", strerror(errno));
+        return;
+    }
+
+    wheel->armed = next;
+}
+
+void add_timer(struct timer_wheel *wheel, struct timer *timer, unsigned int msecs)
+{
+    uint64_t expires = timer_now() + msecs;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    if (timer_pending(timer))
+        unlink_timer(wheel, timer);
+
+    /* an empty wheel is not run, so catch up with the clock. */
+    if (!wheel->armed && !next_expiry(wheel))
+        wheel->now = expires - msecs;
+
+    timer->expires = expires;
+    place(wheel, timer);
+
+    /* the timerfd only needs to fire sooner. */
+    if (!wheel->armed || expires < wheel->armed)
+        rearm(wheel);
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void del_timer(struct timer_wheel *wheel, struct timer *timer)
+{
+    pthread_mutex_lock(&wheel->lock);
+
+    /* the timerfd may still fire, finding nothing due. */
+    if (timer_pending(timer))
+        unlink_timer(wheel, timer);
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void run_timers(struct timer_wheel *wheel)
+{
+    uint64_t expirations, now = timer_now();
+    unsigned int level;
+    struct timer *timer;
+
+    if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+        fprintf(stderr, "unable to read timer: %s\n", strerror(errno));
+
+    pthread_mutex_lock(&wheel->lock);
+
+    wheel->armed = 0;
+
+    while (wheel->now <= now) {
+        /* bring the timers of the next turn down a level. */
+        for (level = 1; level < TIMER_LEVELS; level++) {
+            if (SLOT(wheel->now, level - 1) || cascade(wheel, level))
+                break;
+        }
+
+        /* timers may add themselves again while the lock is dropped. */
+        while ((timer = wheel->slots[0][SLOT(wheel->now, 0)])) {
+            unlink_timer(wheel, timer);
+
+            pthread_mutex_unlock(&wheel->lock);
+            timer->fn(timer);
+            pthread_mutex_lock(&wheel->lock);
+        }
+
+        wheel->now++;
+    }
+
+    rearm(wheel);
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void close_timers(struct timer_wheel *wheel)
+{
+    if (wheel->fd >= 0) {
+        close(wheel->fd);
+        pthread_mutex_destroy(&wheel->lock);
+    }
+
+    wheel->fd = -1;
+}
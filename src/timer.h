@@ -0,0 +1,107 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_TIMER_H
+#define ICMPTUNNEL_TIMER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the wheel has levels of 64 slots, each slot of a level as long as a
+ * full turn of the level below it, starting from a millisecond.
+ */
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+struct timer
+{
+    /* other timers due in the same slot. */
+    struct timer *next;
+    struct timer **pprev;
+
+    /* deadline in milliseconds of the monotonic clock, and where in the
+     * wheel the timer waits for it.
+     */
+    uint64_t expires;
+    unsigned int level;
+    unsigned int slot;
+
+    void (*fn)(struct timer *timer);
+    void *data;
+};
+
+/* timers run by the thread polling the timerfd. */
+struct timer_wheel
+{
+    pthread_mutex_t lock;
+    int fd;
+
+    /* next millisecond to run the timers of. */
+    uint64_t now;
+
+    /* deadline the timerfd is set to, 0 if none. */
+    uint64_t armed;
+
+    uint64_t pending[TIMER_LEVELS];
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/* milliseconds of the monotonic clock. */
+uint64_t timer_now(void);
+
+/* microseconds of the same clock. */
+uint64_t timer_now_us(void);
+
+/* nanoseconds of the same clock. */
+uint64_t timer_now_ns(void);
+
+/* initialize a timer that calls fn once due. */
+void init_timer(struct timer *timer, void (*fn)(struct timer *), void *data);
+
+/* is the timer waiting to run? */
+static inline int timer_pending(const struct timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/* open the timerfd of an empty wheel. */
+int open_timers(struct timer_wheel *wheel);
+
+/* run the timer in msecs milliseconds, moving it if already pending. */
+void add_timer(struct timer_wheel *wheel, struct timer *timer, unsigned int msecs);
+
+/* stop the timer if pending. */
+void del_timer(struct timer_wheel *wheel, struct timer *timer);
+
+/* run the timers that are due, once the timerfd is readable. */
+void run_timers(struct timer_wheel *wheel);
+
+/* close the timerfd. */
+void close_timers(struct timer_wheel *wheel);
+
+#endif
@@ -24,6 +24,8 @@
  *  SOFTWARE.
  */
 
+#include <netinet/in.h>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -33,15 +35,88 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 
+#include "gso.h"
+#include "profile.h"
 #include "tun-device.h"
 
-int open_tun_device(struct tun_device *device, int mtu)
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
+
+/* header written in front of frames when offloads are enabled. */
+static const struct virtio_net_hdr vnet_none;
+
+/* ask the kernel for gso super-frames, udp segmentation is optional. */
+static void set_offloads(struct tun_device *device)
+{
+    unsigned long offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+
+    if (ioctl(device->fd, TUNSETOFFLOAD, offloads | TUN_F_USO4 | TUN_F_USO6) == 0)
+        return;
+
+    if (ioctl(device->fd, TUNSETOFFLOAD, offloads) < 0)
+        fprintf(stderr, "unable to enable offloads on tunnel device %s: %s\n",
+                device->name, strerror(errno));
+}
+
+/* allocate buffers for reading and writing super-frames. */
+static int alloc_gsobufs(struct tun_device *device)
+{
+    if (!device->vnethdr)
+        return 0;
+
+    device->gsobuf = malloc(GSO_MAX_FRAME);
+    device->gro.buf = malloc(GSO_MAX_FRAME);
+
+    if (!device->gsobuf || !device->gro.buf) {
+        fprintf(stderr, "unable to allocate tunnel offload buffers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* write out the frames in the write queue. */
+static int write_queue(struct tun_device *device)
+{
+    unsigned int i;
+    ssize_t xfer;
+
+    /* the device takes one frame per write. */
+    for (i = 0; i < device->txlen; i++) {
+        PROFILE_START(start);
+        xfer = write(device->fd, device->txiovs[i].iov_base, device->txiovs[i].iov_len);
+        PROFILE_END(PROFILE_TUN_WRITE, start);
+        if (xfer != (ssize_t)device->txiovs[i].iov_len) {
+            device->stats->counts[STAT_TUN_TX_ERRORS]++;
+            fprintf(stderr, "unable to write to tunnel device: %s\n", strerror(errno));
+        }
+    }
+
+    clear_tun_device(device);
+
+    return i;
+}
+
+int open_tun_device(struct tun_device *device, int mtu, int multiqueue, int offload)
 {
     struct ifreq ifr;
     const char *clonedev = "/dev/net/tun";
 
+    /* frames are written straight through by default. */
+    device->txcount = 0;
+    device->txlen = 0;
+    device->txbufs = NULL;
+    device->txiovs = NULL;
+    device->cache = NULL;
+    device->gsobuf = NULL;
+    device->gro.buf = NULL;
+    device->gro.segs = 0;
+    device->vnethdr = offload ? 1 : 0;
+
     /* open the clone device. */
-    if ((device->fd = open(clonedev, O_RDWR)) < 0) {
+    if ((device->fd = open(clonedev, O_RDWR | O_NONBLOCK)) < 0) {
         fprintf(stderr, "unable to open %s: %s\n", clonedev, strerror(errno));
         fprintf(stderr, "is the tun kernel module loaded?\n");
         return -1;
@@ -49,6 +124,10 @@ int open_tun_device(struct tun_device *device, int mtu)
 
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    if (multiqueue)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    if (device->vnethdr)
+        ifr.ifr_flags |= IFF_VNET_HDR;
 
     /* try to create the device, the kernel will choose a name. */
     if (ioctl(device->fd, TUNSETIFF, &ifr) < 0) {
@@ -75,18 +154,154 @@ int open_tun_device(struct tun_device *device, int mtu)
         close(sk);
     }
 
-    /* initialize packet io statistics. */
-    device->iopkts = 0;
+    if (device->vnethdr) {
+        set_offloads(device);
+        if (alloc_gsobufs(device) < 0)
+            return -1;
+    }
 
-    fprintf(stderr, "opened tunnel device: %s, mtu: %u\n", device->name, mtu);
+    fprintf(stderr, "opened tunnel device: %s, mtu: %u%s\n", device->name, mtu,
+            device->vnethdr ? ", offloads enabled" : "");
 
     return 0;
 }
 
+/* copy the device, without the buffers of the original. */
+static void copy_tun_device(struct tun_device *device, const struct tun_device *orig)
+{
+    *device = *orig;
+    device->txcount = 0;
+    device->txlen = 0;
+    device->txbufs = NULL;
+    device->txiovs = NULL;
+    device->cache = NULL;
+    device->gsobuf = NULL;
+    device->gro.buf = NULL;
+    device->gro.segs = 0;
+}
+
+int open_tun_queue(struct tun_device *device, const struct tun_device *orig)
+{
+    struct ifreq ifr;
+    const char *clonedev = "/dev/net/tun";
+
+    copy_tun_device(device, orig);
+
+    /* open the clone device. */
+    if ((device->fd = open(clonedev, O_RDWR | O_NONBLOCK)) < 0) {
+        fprintf(stderr, "unable to open %s: %s\n", clonedev, strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+    if (device->vnethdr)
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    memcpy(ifr.ifr_name, orig->name, sizeof(ifr.ifr_name));
+
+    /* attach another queue to the existing device. */
+    if (ioctl(device->fd, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "unable to attach a queue to tunnel device %s: %s\n",
+                orig->name, strerror(errno));
+        return -1;
+    }
+
+    return alloc_gsobufs(device);
+}
+
+int share_tun_queue(struct tun_device *device, const struct tun_device *orig)
+{
+    copy_tun_device(device, orig);
+
+    if ((device->fd = dup(orig->fd)) < 0) {
+        fprintf(stderr, "unable to share tunnel queue: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return alloc_gsobufs(device);
+}
+
 int write_tun_device(struct tun_device *device, const void *buf, int size)
 {
+    ssize_t xfer;
+
+    device->stats->counts[STAT_TUN_TX_FRAMES]++;
+    device->stats->counts[STAT_TUN_TX_BYTES] += size;
+
+    /* merge tcp segments so the kernel takes them in one go. */
+    if (device->vnethdr) {
+        int hdrlen = gro_check(buf, size);
+
+        if (hdrlen && gro_append(&device->gro, buf, size, hdrlen))
+            return size;
+
+        flush_tun_coalesced(device);
+
+        if (hdrlen && gro_start(&device->gro, buf, size, hdrlen))
+            return size;
+    }
+
+    /* copy the frame into a packet buffer in the write queue, if there
+     * is one, as the buffer it arrived in is reused for replies.
+     */
+    if (device->txcount) {
+        struct pktbuf *pkt;
+        struct iovec *iov;
+
+        if (device->txlen == device->txcount)
+            flush_tun_device(device);
+
+        if (!(pkt = get_pktbuf(device->cache))) {
+            device->stats->counts[STAT_DROP_NOBUF]++;
+            return -1;
+        }
+
+        device->txbufs[device->txlen] = pkt;
+        iov = &device->txiovs[device->txlen++];
+        iov->iov_base = pkt->data;
+
+        /* with a header that asks for no offloads. */
+        if (device->vnethdr) {
+            memcpy(pkt->data, &vnet_none, sizeof(vnet_none));
+            memcpy(pkt->data + sizeof(vnet_none), buf, size);
+            iov->iov_len = sizeof(vnet_none) + size;
+        } else {
+            memcpy(pkt->data, buf, size);
+            iov->iov_len = size;
+        }
+
+        return size;
+    }
+
+    /* prepend a header that asks for no offloads. */
+    if (device->vnethdr) {
+        struct iovec iov[2];
+
+        iov[0].iov_base = (void *)&vnet_none;
+        iov[0].iov_len = sizeof(vnet_none);
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = size;
+
+        PROFILE_START(start);
+        xfer = writev(device->fd, iov, 2);
+        PROFILE_END(PROFILE_TUN_WRITE, start);
+
+        if (xfer != (ssize_t)(sizeof(vnet_none) + size)) {
+            device->stats->counts[STAT_TUN_TX_ERRORS]++;
+            fprintf(stderr, "unable to write to tunnel device: %s\n", strerror(errno));
+            return -1;
+        }
+
+        return size;
+    }
+
     /* write to the tunnel device. */
-    if (write(device->fd, buf, size) != size) {
+    PROFILE_START(start);
+    xfer = write(device->fd, buf, size);
+    PROFILE_END(PROFILE_TUN_WRITE, start);
+
+    if (xfer != size) {
+        device->stats->counts[STAT_TUN_TX_ERRORS]++;
         fprintf(stderr, "unable to write to tunnel device: %s\n", strerror(errno));
         return -1;
     }
@@ -96,19 +311,111 @@ int write_tun_device(struct tun_device *device, const void *buf, int size)
 
 int read_tun_device(struct tun_device *device, void *buf)
 {
-    int size;
+    int size, len = device->vnethdr ? (int)GSO_MAX_FRAME : (int)device->mtu;
 
     /* read from the tunnel device. */
-    if ((size = read(device->fd, buf, device->mtu)) < 0) {
+    PROFILE_START(start);
+    if ((size = read(device->fd, buf, len)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
         fprintf(stderr, "unable to read from tunnel device: %s\n", strerror(errno));
         return -1;
     }
 
+    PROFILE_END(PROFILE_TUN_READ, start);
+
+    device->stats->counts[STAT_TUN_RX_FRAMES]++;
+    device->stats->counts[STAT_TUN_RX_BYTES] += size;
+
     return size;
 }
 
+int queue_tun_device(struct tun_device *device, unsigned int count)
+{
+    device->txbufs = calloc(count, sizeof(*device->txbufs));
+    device->txiovs = calloc(count, sizeof(*device->txiovs));
+
+    if (!device->txbufs || !device->txiovs) {
+        fprintf(stderr, "unable to allocate tunnel write queue: %s\n", strerror(errno));
+        return -1;
+    }
+
+    device->txcount = count;
+    device->txlen = 0;
+
+    return 0;
+}
+
+int flush_tun_device(struct tun_device *device)
+{
+    int n = write_queue(device);
+
+    return n + flush_tun_coalesced(device);
+}
+
+void clear_tun_device(struct tun_device *device)
+{
+    unsigned int i;
+
+    for (i = 0; i < device->txlen; i++)
+        put_pktbuf(device->cache, device->txbufs[i]);
+
+    device->txlen = 0;
+}
+
+int flush_tun_coalesced(struct tun_device *device)
+{
+    ssize_t xfer;
+    int size;
+
+    if (!device->vnethdr || !device->gro.segs)
+        return 0;
+
+    /* frames queued before it go first. */
+    write_queue(device);
+
+    size = gro_finish(&device->gro);
+
+    PROFILE_START(start);
+    xfer = write(device->fd, device->gro.buf, size);
+    PROFILE_END(PROFILE_TUN_WRITE, start);
+
+    if (xfer != size) {
+        device->stats->counts[STAT_TUN_TX_ERRORS]++;
+        fprintf(stderr, "unable to write to tunnel device: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 1;
+}
+
+uint32_t tun_device_addr(const struct tun_device *device)
+{
+    struct ifreq ifr;
+    uint32_t addr = 0;
+    int sk = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sk < 0)
+        return 0;
+
+    memset(&ifr, 0, sizeof(ifr));
+    memcpy(ifr.ifr_name, device->name, sizeof(ifr.ifr_name));
+
+    if (ioctl(sk, SIOCGIFADDR, &ifr) == 0 && ifr.ifr_addr.sa_family == AF_INET)
+        memcpy(&addr, &((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr, sizeof(addr));
+
+    close(sk);
+    return addr;
+}
+
 void close_tun_device(struct tun_device *device)
 {
+    clear_tun_device(device);
+    free(device->txbufs);
+    free(device->txiovs);
+    free(device->gsobuf);
+    free(device->gro.buf);
+
     if (device->fd >= 0) {
         close(device->fd);
     }
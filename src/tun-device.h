@@ -29,6 +29,11 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+#include "gso.h"
+#include "pktbuf.h"
+#include "stats.h"
 
 #ifndef IF_NAMESIZE
 #ifdef IFNAMSIZ
@@ -43,20 +48,63 @@ struct tun_device
     int fd;
 
     unsigned int mtu:16;
-    unsigned int iopkts:8;
+
+    /* frames carry a virtio-net header for segmentation offloads. */
+    unsigned int vnethdr:1;
+    char *gsobuf;
+
+    /* tcp segments being merged before they are written. */
+    struct gro gro;
 
     char name[IF_NAMESIZE];
+
+    /* optional write queue of packet buffers used by batching engines,
+     * taken from the free list of the worker.
+     */
+    unsigned int txcount;
+    unsigned int txlen;
+    struct pktbuf **txbufs;
+    struct iovec *txiovs;
+    struct pktbuf_cache *cache;
+
+    /* counters of the worker the device belongs to. */
+    struct stats *stats;
 };
 
-/* open a virtual tunnel device. */
-int open_tun_device(struct tun_device *device, int mtu);
+/* open a virtual tunnel device, with multiple queues and offloads if asked. */
+int open_tun_device(struct tun_device *device, int mtu, int multiqueue, int offload);
+
+/* attach another queue to a multi-queue device. */
+int open_tun_queue(struct tun_device *device, const struct tun_device *orig);
+
+/* open another descriptor for the same queue, with buffers of its own. */
+int share_tun_queue(struct tun_device *device, const struct tun_device *orig);
 
 /* write to the device. */
 int write_tun_device(struct tun_device *device, const void *buf, int size);
 
-/* read from the device. */
+/* read from the device, up to GSO_MAX_FRAME bytes with a virtio-net
+ * header when offloads are enabled, otherwise up to the mtu.
+ */
 int read_tun_device(struct tun_device *device, void *buf);
 
+/* queue up to count frames written to the device until flushed. */
+int queue_tun_device(struct tun_device *device, unsigned int count);
+
+/* write all queued and coalesced frames to the device. */
+int flush_tun_device(struct tun_device *device);
+
+/* release the queued frames, once written by other means. */
+void clear_tun_device(struct tun_device *device);
+
+/* write the frame being coalesced, after any frames queued before it. */
+int flush_tun_coalesced(struct tun_device *device);
+
+/* get the ipv4 address of the device in network byte order, or zero if it
+ * has none yet.
+ */
+uint32_t tun_device_addr(const struct tun_device *device);
+
 /* close the device. */
 void close_tun_device(struct tun_device *device);
 
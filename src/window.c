@@ -0,0 +1,130 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "timer.h"
+#include "window.h"
+
+void window_init(struct window *window, unsigned int max)
+{
+    window->size = ICMPTUNNEL_MIN_WINDOW;
+    window->max = max;
+    window->srtt = 0;
+    window->pingstamp = 0;
+    window->rxpkts = 0;
+    window->period = timer_now_us();
+}
+
+void window_ping(struct window *window, uint16_t seq)
+{
+    window->pingseq = seq;
+    window->pingstamp = timer_now_us();
+}
+
+void window_pong(struct window *window, uint16_t seq)
+{
+    uint64_t rtt;
+
+    if (!window->pingstamp || window->pingseq != seq)
+        return;
+
+    rtt = timer_now_us() - window->pingstamp;
+    window->pingstamp = 0;
+
+    /* smooth as tcp does, with a gain of 1/8. */
+    if (!window->srtt)
+        window->srtt = rtt ? rtt : 1;
+    else
+        window->srtt = (7 * (uint64_t)window->srtt + rtt) / 8;
+}
+
+/* size the window for the packets in flight over a round trip, twice over
+ * for bursts, growing at once and shrinking gradually.
+ */
+static unsigned int resize(struct window *window, uint64_t stamp,
+                           uint64_t elapsed, unsigned int rxpkts)
+{
+    unsigned int srtt = window->srtt ? window->srtt : ICMPTUNNEL_WINDOW_RTT;
+    uint64_t need = (uint64_t)rxpkts * srtt / (elapsed ? elapsed : 1);
+    unsigned int size = __atomic_load_n(&window->size, __ATOMIC_RELAXED);
+    unsigned int target = 2 * need + ICMPTUNNEL_MIN_WINDOW;
+
+    if (need > window->max)
+        target = window->max;
+
+    if (target >= size)
+        size = target;
+    else
+        size -= (size - target + 3) / 4;
+
+    if (size > window->max)
+        size = window->max;
+
+    window->period = stamp;
+    __atomic_store_n(&window->size, size, __ATOMIC_RELAXED);
+
+    return size;
+}
+
+unsigned int window_received(struct window *window)
+{
+    unsigned int rxpkts = __atomic_add_fetch(&window->rxpkts, 1, __ATOMIC_RELAXED);
+    uint64_t period = __atomic_load_n(&window->period, __ATOMIC_RELAXED);
+    uint64_t stamp = timer_now_us();
+
+    /* one worker takes the packets counted over the period. */
+    if (stamp - period >= ICMPTUNNEL_WINDOW_PERIOD &&
+        __atomic_compare_exchange_n(&window->period, &period, stamp, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        rxpkts = __atomic_exchange_n(&window->rxpkts, 0, __ATOMIC_RELAXED);
+        return resize(window, stamp, stamp - period, rxpkts);
+    }
+
+    return __atomic_load_n(&window->size, __ATOMIC_RELAXED);
+}
+
+unsigned int window_backlog(struct window *window, unsigned int backlog)
+{
+    unsigned int size = __atomic_load_n(&window->size, __ATOMIC_RELAXED);
+
+    /* cover the frames waiting and as many arriving meanwhile. */
+    if (size < 2 * backlog) {
+        size = 2 * backlog < window->max ? 2 * backlog : window->max;
+        __atomic_store_n(&window->size, size, __ATOMIC_RELAXED);
+    }
+
+    return size;
+}
+
+unsigned int window_tick(struct window *window)
+{
+    uint64_t stamp = timer_now_us();
+    unsigned int rxpkts = __atomic_exchange_n(&window->rxpkts, 0, __ATOMIC_RELAXED);
+
+    return resize(window, stamp, stamp - window->period, rxpkts);
+}
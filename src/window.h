@@ -0,0 +1,72 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_WINDOW_H
+#define ICMPTUNNEL_WINDOW_H
+
+#include <stdint.h>
+
+/* number of unused sequence numbers to keep the server supplied with,
+ * sized from the downstream packet rate and the round trip time.
+ */
+struct window
+{
+    unsigned int size;
+    unsigned int max;
+
+    /* smoothed round trip time in microseconds, 0 until measured. */
+    unsigned int srtt;
+
+    /* the last request the server replies to right away, and when it
+     * was sent.
+     */
+    uint16_t pingseq;
+    uint64_t pingstamp;
+
+    /* downstream packets since the start of the current period. */
+    unsigned int rxpkts;
+    uint64_t period;
+};
+
+/* initialize the smallest window. */
+void window_init(struct window *window, unsigned int max);
+
+/* a request the server replies to right away was sent. */
+void window_ping(struct window *window, uint16_t seq);
+
+/* a reply to such a request was received. */
+void window_pong(struct window *window, uint16_t seq);
+
+/* count a downstream packet, returns the window size. */
+unsigned int window_received(struct window *window);
+
+/* frames wait at the server for sequence numbers, returns the window size. */
+unsigned int window_backlog(struct window *window, unsigned int backlog);
+
+/* called every tick, returns the window size. */
+unsigned int window_tick(struct window *window);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "options.h"
+#include "peer.h"
+#include "forwarder.h"
+#include "handlers.h"
+#include "worker.h"
+
+int open_workers(struct peer *peer, unsigned int n, int client,
+                 const struct handlers *handlers, const struct peer *shared)
+{
+    struct worker *worker;
+    unsigned int i, queues = n;
+    int err;
+
+    /* packets may carry whole frames or up to the payload limit. */
+    int payload = opts.mtu > opts.payload ? opts.mtu : opts.payload;
+
+    /* the workers past the queues read frames from the tunnel device, the
+     * first ones only receive packets then.
+     */
+    if (opts.pipeline)
+        n *= 2;
+
+    /* the counters of each worker start a cache line of their own. */
+    if ((err = posix_memalign((void **)&peer->workers, STATS_ALIGN,
+                              n * sizeof(*peer->workers))) != 0) {
+        fprintf(stderr, "unable to allocate workers: %s\n", strerror(err));
+        peer->workers = NULL;
+        return -1;
+    }
+
+    memset(peer->workers, 0, n * sizeof(*peer->workers));
+
+    peer->nworkers = 0;
+    open_peer(peer);
+
+    if (!(peer->timers = malloc(sizeof(*peer->timers)))) {
+        fprintf(stderr, "unable to allocate timers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (open_timers(peer->timers) < 0)
+        return -1;
+
+    /* share the socket of another peer, or that of the first worker. */
+    if (!shared)
+        shared = peer;
+
+    for (i = 0; i < n; i++) {
+        worker = &peer->workers[i];
+        worker->peer = peer;
+        worker->host = peer;
+        worker->handlers = handlers;
+        worker->index = i;
+        worker->sibling = NULL;
+        worker->icmp = i < queues;
+        worker->tunnel = i >= queues || !opts.pipeline;
+        worker->controls = NULL;
+        worker->bundle.buf = NULL;
+        worker->bundle.timerfd = -1;
+
+        /* the first worker opens the socket and device, others share them. */
+        if (i == 0 && shared == peer ? open_echo_skt(&worker->skt, payload, opts.ttl, client) :
+                                       share_echo_skt(&worker->skt, &shared->workers[0].skt)) {
+            close_echo_skt(&worker->skt);
+            return -1;
+        }
+
+        if (i == 0 ? open_tun_device(&worker->device, opts.mtu, queues > 1, opts.offload) :
+            i >= queues ? share_tun_queue(&worker->device, &peer->workers[i - queues].device) :
+                          open_tun_queue(&worker->device, &peer->workers[0].device)) {
+            close_tun_device(&worker->device);
+            close_echo_skt(&worker->skt);
+            return -1;
+        }
+
+        /* the two workers of a queue share a ring, which the one
+         * receiving packets owns.
+         */
+        if (opts.pipeline && (i < queues ?
+            !(worker->controls = open_control_ring(ICMPTUNNEL_CONTROL_RING)) :
+            !(worker->controls = peer->workers[i - queues].controls))) {
+            close_tun_device(&worker->device);
+            close_echo_skt(&worker->skt);
+            return -1;
+        }
+
+        worker->skt.stats = &worker->stats;
+        worker->device.stats = &worker->stats;
+        worker->device.cache = &worker->skt.cache;
+
+        /* frames read from the tunnel queue are bundled and fragmented. */
+        if (worker->tunnel && opts.bundle &&
+            open_bundle(&worker->bundle, opts.payload, opts.bundle) < 0) {
+            close_bundle(&worker->bundle);
+            close_tun_device(&worker->device);
+            close_echo_skt(&worker->skt);
+            return -1;
+        }
+
+        peer->nworkers++;
+    }
+
+    return 0;
+}
+
+void post_control(struct worker *worker, const struct control *ctl)
+{
+    if (worker->controls && push_control(worker->controls, ctl) == 0)
+        return;
+
+    worker->handlers->control(worker, ctl);
+}
+
+/* pin the calling thread to a cpu of its own, if there are enough. */
+static void pin_worker(const struct worker *worker)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int err;
+
+    if (ncpus <= 1)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->index % ncpus, &set);
+
+    if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        fprintf(stderr, "unable to pin worker %u to a cpu: %s\n",
+                worker->index, strerror(err));
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+
+    pin_worker(worker);
+
+    /* run the packet forwarding loop. */
+    if (forward(worker, worker->handlers) < 0)
+        stop();
+
+    return NULL;
+}
+
+int start_workers(struct peer *peer)
+{
+    sigset_t set, oset;
+    unsigned int i;
+    int err = 0;
+
+    if (peer->nworkers < 2 || peer->workers[1].started)
+        return 0;
+
+    pin_worker(&peer->workers[0]);
+
+    /* leave signals to the main thread. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+    for (i = 1; i < peer->nworkers; i++) {
+        struct worker *worker = &peer->workers[i];
+
+        if ((err = pthread_create(&worker->thread, NULL, run_worker, worker)) != 0) {
+            fprintf(stderr, "unable to start worker %u: %s\n", i, strerror(err));
+            break;
+        }
+
+        worker->started = 1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+    return err ? -1 : 0;
+}
+
+void close_workers(struct peer *peer)
+{
+    unsigned int i;
+
+    if (!peer->workers)
+        return;
+
+    /* forwarding loops notice within a poll interval. */
+    stop();
+
+    for (i = 0; i < peer->nworkers; i++) {
+        struct worker *worker = &peer->workers[i];
+
+        if (worker->started)
+            pthread_join(worker->thread, NULL);
+
+        close_bundle(&worker->bundle);
+        close_tun_device(&worker->device);
+        close_echo_skt(&worker->skt);
+    }
+
+    /* the rings go once both threads of a queue are gone. */
+    for (i = 0; i < peer->nworkers; i++) {
+        if (peer->workers[i].icmp)
+            close_control_ring(peer->workers[i].controls);
+    }
+
+    if (peer->timers) {
+        close_timers(peer->timers);
+        free(peer->timers);
+        peer->timers = NULL;
+    }
+
+    close_peer(peer);
+    free(peer->workers);
+    peer->workers = NULL;
+}
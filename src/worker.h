@@ -0,0 +1,101 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#ifndef ICMPTUNNEL_WORKER_H
+#define ICMPTUNNEL_WORKER_H
+
+#include <pthread.h>
+
+#include "echo-skt.h"
+#include "tun-device.h"
+#include "bundle.h"
+#include "control.h"
+#include "stats.h"
+
+struct peer;
+struct handlers;
+
+struct worker
+{
+    /* own buffers on the shared socket and own tunnel queue. */
+    struct echo_skt skt;
+    struct tun_device device;
+
+    /* small frames waiting to be sent together, if enabled. */
+    struct bundle bundle;
+
+    /* peer the packets are forwarded for, and the one the workers were
+     * opened for.
+     */
+    struct peer *peer;
+    struct peer *host;
+    const struct handlers *handlers;
+
+    /* worker 0 runs in the main thread and the timers. */
+    unsigned int index;
+    unsigned int started:1;
+    pthread_t thread;
+
+    /* receives packets from the socket, and reads frames from the tunnel
+     * queue, or just one of them if each direction has a worker.
+     */
+    unsigned int icmp:1;
+    unsigned int tunnel:1;
+
+    /* events from the worker receiving packets for the queue to the one
+     * reading frames from it, if each direction has a worker.
+     */
+    struct control_ring *controls;
+
+    /* worker with the same index of another peer sharing the socket, run
+     * in the same thread.
+     */
+    struct worker *sibling;
+
+    /* packets, bytes and drops counted by the thread running it. */
+    struct stats stats;
+};
+
+/* open the socket, or share the one of another peer, and a tunnel queue
+ * for each worker of the peer, for two workers if each direction of a
+ * queue is forwarded in a thread of its own.
+ */
+int open_workers(struct peer *peer, unsigned int n, int client,
+                 const struct handlers *handlers, const struct peer *shared);
+
+/* hand an event to the worker reading frames from the queue, or handle it
+ * at once if there is no such worker or its ring is full, the state it
+ * touches then being shared under a lock.
+ */
+void post_control(struct worker *worker, const struct control *ctl);
+
+/* start forwarding threads for all but the first worker. */
+int start_workers(struct peer *peer);
+
+/* stop the forwarding threads and close the workers. */
+void close_workers(struct peer *peer);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "checksum.h"
+
+#define MAX_SIZE 9100
+#define MAX_OFFSET 64
+
+/* the plain loop the vector variants replaced, one word at a time. */
+static uint32_t reference(const unsigned char *p, int size, uint32_t sum)
+{
+    uint16_t word;
+
+    for (; size > 1; p += 2, size -= 2) {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+
+    if (size == 1)
+        sum += *p;
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return sum & 0xffff;
+}
+
+enum
+{
+    PATTERN_ZERO = 0,
+    PATTERN_ONES,
+    PATTERN_BIT,
+    PATTERN_ALTERNATE,
+    PATTERN_RANDOM,
+    PATTERN_MAX,
+};
+
+static const char *const pattern_names[PATTERN_MAX] = {
+    [PATTERN_ZERO] = "zeros",
+    [PATTERN_ONES] = "ones",
+    [PATTERN_BIT] = "single bit",
+    [PATTERN_ALTERNATE] = "alternating",
+    [PATTERN_RANDOM] = "random",
+};
+
+static void fill(unsigned char *buf, int size, int pattern)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        switch (pattern) {
+        case PATTERN_ZERO:
+            buf[i] = 0;
+            break;
+        case PATTERN_ONES:
+            buf[i] = 0xff;
+            break;
+        case PATTERN_BIT:
+            buf[i] = i % 131 == 7 ? 1 << (i % 8) : 0;
+            break;
+        case PATTERN_ALTERNATE:
+            buf[i] = i & 1 ? 0x55 : 0xaa;
+            break;
+        default:
+            buf[i] = rand();
+            break;
+        }
+    }
+}
+
+/* sizes around every vector width and the payloads the tunnel sends. */
+static int next_size(int size)
+{
+    if (size < 600)
+        return size + 1;
+    if (size < 1600)
+        return size + 3;
+
+    return size + 61;
+}
+
+static int check(const char *name, const unsigned char *src, unsigned char *dst,
+                 int pattern)
+{
+    static const uint32_t starts[] = { 0, 1, 0xffff, 0x1fffe };
+    uint32_t start, want, got;
+    int off, size, k, bad = 0;
+
+    for (off = 0; off < MAX_OFFSET; off += 2) {
+        for (size = 0; size <= MAX_SIZE - MAX_OFFSET; size = next_size(size)) {
+            for (k = 0; k < (int)(sizeof(starts) / sizeof(starts[0])); k++) {
+                start = starts[k];
+                want = reference(src + off, size, start);
+
+                got = checksum_partial(src + off, size, start);
+                if (got != want) {
+                    fprintf(stderr, "%s: partial of %d %s bytes at %d from 0x%x: 0x%x, expected 0x%x.\n",
+                            name, size, pattern_names[pattern], off, start, got, want);
+                    bad++;
+                }
+
+                memset(dst, 0x5a, MAX_SIZE);
+                got = checksum_copy(dst + off, src + off, size, start);
+                if (got != want || memcmp(dst + off, src + off, size) != 0 ||
+                    dst[off + size] != 0x5a || (off && dst[off - 1] != 0x5a)) {
+                    fprintf(stderr, "%s: copy of %d %s bytes at %d from 0x%x: 0x%x, expected 0x%x.\n",
+                            name, size, pattern_names[pattern], off, start, got, want);
+                    bad++;
+                }
+            }
+
+            if (checksum(src + off, size) != (uint16_t)~reference(src + off, size, 0)) {
+                fprintf(stderr, "%s: checksum of %d %s bytes at %d.\n",
+                        name, size, pattern_names[pattern], off);
+                bad++;
+            }
+
+            if (bad > 20)
+                return bad;
+        }
+    }
+
+    return bad;
+}
+
+int main(void)
+{
+    static unsigned char src[MAX_SIZE] __attribute__((aligned(64)));
+    static unsigned char dst[MAX_SIZE] __attribute__((aligned(64)));
+    const char *name;
+    unsigned int n;
+    int pattern, bad, failed = 0;
+
+    srand(1);
+
+    for (n = 0; (name = checksum_variant(n)); n++) {
+        if (select_checksum(n) < 0) {
+            printf("%s: not supported, skipped.\n", name);
+            continue;
+        }
+
+        bad = 0;
+        for (pattern = 0; pattern < PATTERN_MAX; pattern++) {
+            fill(src, MAX_SIZE, pattern);
+            bad += check(name, src, dst, pattern);
+        }
+
+        printf("%s: %s.\n", name, bad ? "failed" : "ok");
+        failed += bad;
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
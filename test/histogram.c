@@ -0,0 +1,188 @@
+/*
+ *  https://github.com/jamesbarlow/icmptunnel
+ *
+ *  The MIT License (MIT)
+ *
+ *  Copyright (c) 2016 James Barlow-Bignell
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define LARGEST ((1ULL << HISTOGRAM_BITS) - 1)
+
+static int failed;
+
+static void expect(int ok, const char *what, uint64_t value, uint64_t got, uint64_t want)
+{
+    if (ok)
+        return;
+
+    fprintf(stderr, "%s of %llu: %llu, expected %llu.\n", what,
+            (unsigned long long)value, (unsigned long long)got,
+            (unsigned long long)want);
+    failed++;
+}
+
+/* every bucket holds the values from one past the last of the previous
+ * bucket up to its own last value.
+ */
+static void check_buckets(void)
+{
+    uint64_t first = 0, last;
+    unsigned int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        last = histogram_value(i);
+
+        expect(last >= first, "last value of bucket", i, last, first);
+        expect(histogram_bucket(first) == i, "bucket", first, histogram_bucket(first), i);
+        expect(histogram_bucket(last) == i, "bucket", last, histogram_bucket(last), i);
+
+        /* no bucket is wider than a 32nd of its values. */
+        expect((last - first) * HISTOGRAM_SUB <= first, "width of bucket", i,
+               last - first + 1, first / HISTOGRAM_SUB + 1);
+
+        first = last + 1;
+    }
+
+    expect(histogram_value(HISTOGRAM_BUCKETS - 1) == LARGEST, "last value of bucket",
+           HISTOGRAM_BUCKETS - 1, histogram_value(HISTOGRAM_BUCKETS - 1), LARGEST);
+}
+
+/* values below 32 have a bucket each, and each power of two above starts
+ * a group of 32 buckets.
+ */
+static void check_edges(void)
+{
+    static const struct
+    {
+        uint64_t value;
+        unsigned int bucket;
+    } edges[] = {
+        { 0, 0 },
+        { 31, 31 },
+        { 32, 32 },
+        { 63, 63 },
+        { 64, 64 },
+        { 65, 64 },
+        { 66, 65 },
+        { 127, 95 },
+        { 128, 96 },
+        { 131, 96 },
+        { 132, 97 },
+        { 1ULL << 20, 16 * HISTOGRAM_SUB },
+        { LARGEST, HISTOGRAM_BUCKETS - 1 },
+        { LARGEST + 1, HISTOGRAM_BUCKETS - 1 },
+        { 1ULL << 40, HISTOGRAM_BUCKETS - 1 },
+        { UINT64_MAX, HISTOGRAM_BUCKETS - 1 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+        expect(histogram_bucket(edges[i].value) == edges[i].bucket, "bucket",
+               edges[i].value, histogram_bucket(edges[i].value), edges[i].bucket);
+}
+
+static int compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* the quantiles of values against the nearest rank of the sorted values,
+ * the smallest one at least the fraction q of them are at or below.
+ */
+static void check_quantiles(const char *name, uint64_t *values, unsigned int n)
+{
+    static const unsigned int permille[] = { 0, 1, 500, 900, 990, 999, 1000 };
+    static uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t got, want, rank;
+    unsigned int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        counts[i] = 0;
+
+    for (i = 0; i < n; i++)
+        counts[histogram_bucket(values[i])]++;
+
+    qsort(values, n, sizeof(*values), compare);
+
+    for (i = 0; i < sizeof(permille) / sizeof(permille[0]); i++) {
+        rank = ((uint64_t)permille[i] * n + 999) / 1000;
+        want = n ? histogram_value(histogram_bucket(values[rank ? rank - 1 : 0])) : 0;
+        got = histogram_quantile(counts, permille[i] / 1000.0);
+
+        if (got != want) {
+            fprintf(stderr, "%s: p%u of %u values: %llu, expected %llu.\n", name,
+                    permille[i], n, (unsigned long long)got, (unsigned long long)want);
+            failed++;
+        }
+    }
+}
+
+static void check_distributions(void)
+{
+    static const unsigned int sizes[] = { 1, 2, 3, 7, 100, 1000, 1070, 100000 };
+    static uint64_t values[100000];
+    unsigned int i, j, n;
+
+    check_quantiles("empty", values, 0);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        n = sizes[i];
+
+        for (j = 0; j < n; j++)
+            values[j] = j + 1;
+        check_quantiles("uniform", values, n);
+
+        for (j = 0; j < n; j++)
+            values[j] = 12345;
+        check_quantiles("constant", values, n);
+
+        /* mostly fast with a slow tail, as round trips are. */
+        for (j = 0; j < n; j++)
+            values[j] = j % 100 ? 100 + rand() % 50 : 100000 + rand() % 1000;
+        check_quantiles("bimodal", values, n);
+
+        /* spread over every scale, beyond the largest bucket too. */
+        for (j = 0; j < n; j++)
+            values[j] = (uint64_t)rand() >> (rand() % 31) << (rand() % 10);
+        check_quantiles("log-uniform", values, n);
+    }
+}
+
+int main(void)
+{
+    srand(1);
+
+    check_buckets();
+    check_edges();
+    check_distributions();
+
+    printf("histogram: %s.\n", failed ? "failed" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}